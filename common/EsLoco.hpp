@@ -6,27 +6,52 @@
  *
  * This work is published under the MIT license. See LICENSE.txt
  */
+#include <atomic>
 #include <cstring>
 
 /*
  * EsLoco is an Extremely Simple memory aLOCatOr
  *
- * It is based on intrusive singly-linked lists (a free-list), one for each power of two size.
- * All blocks are powers of two, the smallest size enough to contain the desired user data plus the block header.
- * There is an array named 'freelists' where each entry is a pointer to the head of a stack for that respective block size.
- * Blocks are allocated in powers of 2 of words (64bit words).
- * Each block has an header with two words: the size of the node (in words), the pointer to the next node.
- * The minimum block size is 4 words, with 2 for the header and 2 for the user.
- * When there is no suitable block in the freelist, it will create a new block from the remaining pool.
+ * The pool is carved in blocks, and each allocation is served by one of three kinds of memory, by size:
+ *
+ *  - Objects of up to 7 KB (kMaxSlabObject) come from slabs and have no header. A slab is a block of
+ *    kSlabSize (16 KB) bytes split in objects of the same size class, with a bitmap of the used objects.
+ *    The size classes go in steps of 16 bytes up to 256 bytes, and then in four steps per power of two,
+ *    so an object takes at most 25% more than it asked for, past 256 bytes. The last class is 7 KB, which
+ *    fits twice in a slab: an object of the next class, 8 KB, would be alone in a slab and take 16 KB.
+ *  - Objects of up to kSlabSize bytes, with their header of two words, take a block of their own, the
+ *    smallest power of two with room for them: a request of 7.1 KB takes 8 KB, one of 8.1 KB takes 16 KB.
+ *  - Larger objects are extents, a multiple of kSlabSize bytes (with their header) inside an arena. An arena is
+ *    a block of at least 2^kMinArenaExp bytes (4 MB), with its header in the first window, and the free extents
+ *    of each arena are in a tree ordered by address, where each node keeps the largest size in its sub-tree,
+ *    for a first-fit search. When no arena has room, a new one is made with the smallest power of two that fits
+ *    the extent: a request of 80 MB makes an arena of 128 MB. The 48 MB left in it can only be used by other
+ *    extents, so the pool must be able to grow to the next power of two of the largest object, not to its size.
+ *    Extents start at a multiple of kSlabSize from the start of the pool, which doesn't have to be page-aligned,
+ *    and the object starts after the two words of the header, so an extent's payload is not page-aligned either.
+ *
+ * Blocks are powers of two from 4 KB up, and are aligned to their size (relative to the start of the pool).
+ * There is an array named 'freelists' where each entry is the head of a doubly-linked list of the free blocks
+ * of that size. When there is no suitable block in the freelist, a larger free block is split in halves, or a
+ * new block is created from the top of the pool. Each block has a header with two words: a pointer and the
+ * exponent of its size, with a FREE bit while it's in a free-list.
+ * On free(), a block is merged with its buddy (the other half of the block of twice the size) while the buddy
+ * is free, and when the block ends at the top of the pool, the top is lowered instead, past any free blocks below it.
+ * This way, getUsedSize() follows the live data instead of staying at its high-water mark.
+ * Coalescing can be disabled by defining ESLOCO_NO_COALESCING.
+ * Because blocks are aligned to their size, the start of the kSlabSize window that contains an object is the
+ * header of a slab, an extent or a block, and on free() the tag in that header tells which one it is.
+ * An empty slab is kept as long as it's the one its class allocates from, trim() gives those back to the pool.
+ * An extent is merged with its free neighbours, and when the whole arena is free it goes back to the freelists
+ * (or lowers the top). The free space at the end of the arena at the top of the pool is not counted in
+ * getUsedSize() and is not copied between replicas.
  *
  * EsLoco was designed for usage in PTMs but it doesn't have to be used only for that.
- * Average number of stores for an allocation is 1.
- * Average number of stores for a de-allocation is 2.
  *
  * Memory layout:
- * ------------------------------------------------------------------------
- * | poolTop | freelists[0] ... freelists[61] | ... allocated objects ... |
- * ------------------------------------------------------------------------
+ * ------------------------------------------------------------------------------------------------------------------------------
+ * | poolTop | freelists[0] ... freelists[39] | slabs[0] ... slabs[34] | arenas | topSlack | ... blocks, slabs and arenas ... | top |
+ * ------------------------------------------------------------------------------------------------------------------------------
  */
 template <template <typename> class P>
 class EsLoco {
@@ -36,31 +61,464 @@ private:
         P<uint64_t> size;   // Exponent of power of two of the size of this block in bytes.
     };
 
+    // A block in a free-list. The smallest block has 4 KB so there is always room for 'prev'.
+    struct freeblock {
+        P<block*>   next;
+        P<uint64_t> size;   // Exponent plus kFreeBit
+        P<block*>   prev;   // Pointer to previous block in free-list, nullptr for the head
+    };
+
+    // Set in the size of blocks that are in a free-list
+    static const uint64_t kFreeBit = 1ULL << 32;
+
+    // Number of blocks in the freelists array.
+    // Each entry corresponds to an exponent of the block size: 2^4, 2^5, 2^6... 2^40
+    static const int kMaxBlockSize = 40; // 1 TB of memory should be enough
+
+    // Slabs are blocks of 2^kSlabExp bytes
+    static const uint64_t kSlabExp = 14;
+    static const uint64_t kSlabSize = 1ULL << kSlabExp;
+    // Enough bits for the smallest class, (16KB-160)/16 < 1024 objects
+    static const uint64_t kSlabBitmapWords = 16;
+    // Number of size classes and largest object that goes in a slab
+    static const int      kNumClasses = 35;
+    static const uint64_t kMaxSlabObject = 7168;
+    // The 'size' of a slab is this tag plus the size class, which can't be mistaken for an exponent
+    static const uint64_t kSlabTag = 0x51AB000000000000ULL;
+    static const uint64_t kSlabClassMask = 0xFF;
+
+    // Header of a slab. The first two words overlap with the header of a block.
+    struct slab {
+        P<slab*>    next;       // Next slab of the same class with free objects
+        P<uint64_t> tag;        // kSlabTag | size class
+        P<slab*>    prev;       // Previous slab of the same class with free objects
+        P<uint64_t> numFree;    // Number of free objects in this slab
+        P<uint64_t> bitmap[kSlabBitmapWords]; // One bit per object, set when the object is in use
+    };
+
+    // Arenas are blocks of at least 2^kMinArenaExp bytes (4 MB)
+    static const uint64_t kMinArenaExp = 22;
+    // The 'size' of an arena is this tag plus its exponent, and the 'size' of an allocated extent is
+    // kExtentTag plus the exponent of its arena. Like kSlabTag, these can't be mistaken for an exponent.
+    static const uint64_t kArenaTag = 0xA7E4000000000000ULL;
+    static const uint64_t kExtentTag = 0xE7E0000000000000ULL;
+
+    // Header of an extent, at the start of a kSlabSize window. Allocated extents use only the first two words,
+    // the second one overlapping with the 'size' of a block. Free extents are the nodes of a treap ordered by
+    // address, with a priority that is a hash of the address, so that it's the same in all replicas.
+    struct extent {
+        P<uint64_t> size;       // Size of the extent in bytes, a multiple of kSlabSize
+        P<uint64_t> tag;        // kExtentTag | exponent of the arena (allocated extents only)
+        P<extent*>  left;       // Free extents at lower addresses
+        P<extent*>  right;      // Free extents at higher addresses
+        P<uint64_t> maxSize;    // Size of the largest free extent in this sub-tree
+    };
+
+    // Header of an arena, in its first kSlabSize window. The first two words overlap with the header of a block.
+    struct arena {
+        P<arena*>   next;       // Next arena in the list of arenas
+        P<uint64_t> tag;        // kArenaTag | exponent of the size of the arena
+        P<arena*>   prev;       // Previous arena in the list of arenas
+        P<extent*>  root;       // Root of the tree of free extents
+    };
+
     const bool debugOn = false;
 
     // Volatile data
     uint8_t* poolAddr {nullptr};
-    uint64_t poolSize {0};
+    // Grown by one thread while the combiners of the other partitions allocate
+    std::atomic<uint64_t> poolSize {0};
 
     // Volatile pointer to array of persistent heads of free-list (blocks)
     block* freelists {nullptr};
+    // Volatile pointer to array of persistent heads of the lists of slabs with free objects, one per size class
+    P<slab*>* slabs {nullptr};
     // Volatile pointer to persistent pointer to last unused address (the top of the pool)
     P<uint8_t*>* poolTop {nullptr};
-
-    // Number of blocks in the freelists array.
-    // Each entry corresponds to an exponent of the block size: 2^4, 2^5, 2^6... 2^40
-    static const int kMaxBlockSize = 40; // 1 TB of memory should be enough
+    // Volatile pointer to persistent head of the list of arenas
+    P<arena*>* arenas {nullptr};
+    // Volatile pointer to persistent number of bytes at the end of the arena at the top that are free and untouched
+    P<uint64_t>* topSlack {nullptr};
 
     // For powers of 2, returns the highest bit, otherwise, returns the next highest bit
     uint64_t highestBit(uint64_t val) {
         uint64_t b = 0;
         while ((val >> (b+1)) != 0) b++;
-        if (val > (1 << b)) return b+1;
+        if (val > (1ULL << b)) return b+1;
         return b;
     }
 
-    uint8_t* aligned(uint8_t* addr) {
-        return (uint8_t*)((size_t)addr & (~0x3FULL)) + 128;
+    // Returns the size class for an object of 'size' bytes, up to kMaxSlabObject
+    static int sizeClass(uint64_t size) {
+        if (size <= 256) return size == 0 ? 0 : (size-1)/16;
+        uint64_t p = 63 - __builtin_clzll(size-1);   // 2^p < size <= 2^(p+1)
+        uint64_t step = 1ULL << (p-2);
+        return 16 + (p-8)*4 + (size - (1ULL << p) + step - 1)/step - 1;
+    }
+
+    // Returns the size in bytes of the objects of size class 'cls'
+    static uint64_t classSize(int cls) {
+        if (cls < 16) return 16*(cls+1);
+        return (1ULL << (8+(cls-16)/4)) + ((cls-16)%4+1)*(1ULL << (6+(cls-16)/4));
+    }
+
+    static uint64_t slabCapacity(int cls) {
+        return (kSlabSize - sizeof(slab))/classSize(cls);
+    }
+
+    // Returns the block at the start of the kSlabSize window that contains 'ptr'
+    block* windowOf(void* ptr) {
+        return (block*)(poolAddr + (((uint8_t*)ptr - poolAddr) & ~(kSlabSize-1)));
+    }
+
+    // Returns the exponent of the size of the block that starts at 'myblock', be it free, allocated or a slab
+    uint64_t blockExp(block* myblock) {
+        uint64_t size = myblock->size.pload();
+        if ((size & ~kSlabClassMask) == kSlabTag) return kSlabExp;
+        if ((size & ~kSlabClassMask) == kArenaTag) return size & kSlabClassMask;
+        return size & ~kFreeBit;
+    }
+
+    // Puts a block of 2^bsize bytes in the corresponding freelist
+    void pushFree(block* myblock, uint64_t bsize) {
+        block* head = freelists[bsize].next.pload();
+        myblock->size = bsize | kFreeBit;                // pstore()
+        myblock->next = head;                            // pstore()
+        ((freeblock*)myblock)->prev = nullptr;           // pstore()
+        if (head != nullptr) ((freeblock*)head)->prev = myblock;  // pstore()
+        freelists[bsize].next = myblock;                 // pstore()
+    }
+
+    // Takes a block of 2^bsize bytes out of its freelist
+    void unlinkFree(block* myblock, uint64_t bsize) {
+        block* prev = ((freeblock*)myblock)->prev.pload();
+        block* next = myblock->next.pload();
+        if (prev == nullptr) {
+            freelists[bsize].next = next;                // pstore()
+        } else {
+            prev->next = next;                           // pstore()
+        }
+        if (next != nullptr) ((freeblock*)next)->prev = prev;    // pstore()
+    }
+
+    // Gives back a block of 2^bsize bytes, merging it with its free buddies, or with the top of the pool
+    void freeBlock(block* myblock, uint64_t bsize) {
+#ifndef ESLOCO_NO_COALESCING
+        uint64_t offset = (uint8_t*)myblock - poolAddr;
+        uint64_t top = poolTop->pload() - poolAddr;
+        while (bsize+1 < kMaxBlockSize) {
+            uint64_t buddyOffset = offset ^ (1ULL << bsize);
+            // The first window of the pool has the metadata and there are no blocks above the top
+            if (buddyOffset < kSlabSize || buddyOffset >= top) break;
+            block* buddy = (block*)(poolAddr + buddyOffset);
+            if (buddy->size.pload() != (bsize | kFreeBit)) break;
+            unlinkFree(buddy, bsize);
+            if (buddyOffset < offset) offset = buddyOffset;
+            bsize++;
+        }
+        if (offset + (1ULL << bsize) == top) {
+            lowerTop(offset);
+            return;
+        }
+        myblock = (block*)(poolAddr + offset);
+#endif
+        pushFree(myblock, bsize);
+    }
+
+    // Sets the top of the pool at 'offset' and keeps going down while the block below the top is free.
+    // The block that ends at 'offset' starts at 'offset - 2^j' for some j no larger than the alignment of 'offset'.
+    // For any larger j, that address can only be the start of a smaller block (blocks are aligned to their
+    // size and none of them spans over 'offset'), so going from the largest j down, every probed address
+    // is the header of a block and the first one whose size is 2^j is the block below the top.
+    void lowerTop(uint64_t offset) {
+        while (offset > kSlabSize) {
+            uint64_t j = __builtin_ctzll(offset);
+            if (j >= kMaxBlockSize) j = kMaxBlockSize-1;
+            block* below = nullptr;
+            for (; below == nullptr; j--) {
+                if (offset - kSlabSize < (1ULL << j)) continue;
+                block* candidate = (block*)(poolAddr + offset - (1ULL << j));
+                if (blockExp(candidate) == j) below = candidate;
+            }
+            j++;
+            if (below->size.pload() != (j | kFreeBit)) break;
+            unlinkFree(below, j);
+            offset -= 1ULL << j;
+        }
+        poolTop->pstore(poolAddr + offset);
+        setTopSlack(0);
+    }
+
+    void setTopSlack(uint64_t slack) {
+        if (topSlack->pload() != slack) topSlack->pstore(slack);
+    }
+
+    // Creates a block of 2^bsize bytes from the top of the pool, aligned to its size.
+    // The space skipped to align it goes to the freelists, as blocks aligned to their size.
+    block* carve(uint64_t bsize) {
+        uint64_t top = poolTop->pload() - poolAddr;
+        uint64_t start = (top + (1ULL << bsize) - 1) & ~((1ULL << bsize) - 1);
+        if (start + (1ULL << bsize) > poolSize.load(std::memory_order_acquire)) return nullptr;
+        while (top < start) {
+            uint64_t e = __builtin_ctzll(top);
+            while (top + (1ULL << e) > start) e--;
+            pushFree((block*)(poolAddr + top), e);
+            top += 1ULL << e;
+        }
+        poolTop->pstore(poolAddr + start + (1ULL << bsize));
+        setTopSlack(0);
+        block* myblock = (block*)(poolAddr + start);
+        myblock->size = bsize;                           // pstore()
+        return myblock;
+    }
+
+    // Returns a block of 2^bsize bytes, from the freelist, or by splitting a larger free block, or from the top of the pool
+    block* allocBlock(uint64_t bsize) {
+        uint64_t k = bsize;
+        while (k < kMaxBlockSize && freelists[k].next.pload() == nullptr) k++;
+        if (k == kMaxBlockSize) {
+            if (debugOn) printf("Creating new block from top, currently at %p\n", poolTop->pload());
+            return carve(bsize);
+        }
+        // Unlink block
+        block* myblock = freelists[k].next.pload();
+        unlinkFree(myblock, k);
+        // Split it in halves until it has the right size, the upper halves go to the freelists
+        while (k > bsize) {
+            k--;
+            pushFree((block*)((uint8_t*)myblock + (1ULL << k)), k);
+        }
+        myblock->size = bsize;                           // pstore()
+        return myblock;
+    }
+
+    // Returns an object from the first slab in the list of size class 'cls', creating a new slab if needed
+    void* slabMalloc(int cls) {
+        slab* myslab = slabs[cls].pload();
+        if (myslab == nullptr) {
+            myslab = (slab*)allocBlock(kSlabExp);
+            if (myslab == nullptr) return nullptr;
+            myslab->tag = kSlabTag | cls;
+            myslab->next = nullptr;
+            myslab->prev = nullptr;
+            myslab->numFree = slabCapacity(cls);
+            for (uint64_t i = 0; i < kSlabBitmapWords; i++) myslab->bitmap[i] = 0;
+            slabs[cls] = myslab;
+        }
+        uint64_t i = 0;
+        uint64_t word;
+        while ((word = myslab->bitmap[i].pload()) == ~0ULL) i++;
+        uint64_t bit = __builtin_ctzll(~word);
+        myslab->bitmap[i] = word | (1ULL << bit);        // pstore()
+        uint64_t numFree = myslab->numFree.pload() - 1;
+        myslab->numFree = numFree;                       // pstore()
+        if (numFree == 0) {
+            // The slab is full, take it out of the list
+            slab* next = myslab->next.pload();
+            slabs[cls] = next;
+            if (next != nullptr) next->prev = nullptr;
+        }
+        return (uint8_t*)myslab + sizeof(slab) + (i*64+bit)*classSize(cls);
+    }
+
+    void slabFree(slab* myslab, void* ptr) {
+        int cls = myslab->tag.pload() & kSlabClassMask;
+        uint64_t idx = ((uint8_t*)ptr - (uint8_t*)myslab - sizeof(slab))/classSize(cls);
+        myslab->bitmap[idx/64] = myslab->bitmap[idx/64].pload() & ~(1ULL << (idx%64));  // pstore()
+        uint64_t numFree = myslab->numFree.pload() + 1;
+        myslab->numFree = numFree;                       // pstore()
+        if (numFree == 1) {
+            // The slab was full, put it back at the head of the list. An empty slab at the head is only kept
+            // while it's the one we allocate from, give it back.
+            slab* head = slabs[cls].pload();
+            if (head != nullptr && head->numFree.pload() == slabCapacity(cls)) {
+                slab* next = head->next.pload();
+                if (next != nullptr) next->prev = nullptr;
+                freeBlock((block*)head, kSlabExp);
+                head = next;
+            }
+            myslab->prev = nullptr;
+            myslab->next = head;
+            if (head != nullptr) head->prev = myslab;
+            slabs[cls] = myslab;
+        } else if (numFree == slabCapacity(cls) && slabs[cls].pload() != myslab) {
+            // The slab is empty and it's not the one we allocate from, give it back
+            slab* prev = myslab->prev.pload();
+            slab* next = myslab->next.pload();
+            prev->next = next;
+            if (next != nullptr) next->prev = prev;
+            freeBlock((block*)myslab, kSlabExp);
+        }
+    }
+
+    uint64_t maxSizeOf(extent* t) { return t == nullptr ? 0 : t->maxSize.pload(); }
+
+    uint64_t priority(extent* t) { return (((uint8_t*)t - poolAddr) >> kSlabExp) * 0x9E3779B97F4A7C15ULL; }
+
+    void setLeft(extent* t, extent* child) { if (t->left.pload() != child) t->left = child; }
+
+    void setRight(extent* t, extent* child) { if (t->right.pload() != child) t->right = child; }
+
+    void updateMaxSize(extent* t) {
+        uint64_t maxSize = t->size.pload();
+        uint64_t leftMax = maxSizeOf(t->left.pload());
+        uint64_t rightMax = maxSizeOf(t->right.pload());
+        if (leftMax > maxSize) maxSize = leftMax;
+        if (rightMax > maxSize) maxSize = rightMax;
+        if (t->maxSize.pload() != maxSize) t->maxSize = maxSize;
+    }
+
+    // Splits the tree 't' in the extents below 'key' and the ones at or above 'key'
+    void split(extent* t, uint8_t* key, extent*& lower, extent*& upper) {
+        if (t == nullptr) {
+            lower = upper = nullptr;
+            return;
+        }
+        if ((uint8_t*)t < key) {
+            split(t->right.pload(), key, lower, upper);
+            setRight(t, lower);
+            updateMaxSize(t);
+            lower = t;
+        } else {
+            split(t->left.pload(), key, lower, upper);
+            setLeft(t, upper);
+            updateMaxSize(t);
+            upper = t;
+        }
+    }
+
+    // Joins two trees, where all the extents in 'lower' are below the ones in 'upper'
+    extent* join(extent* lower, extent* upper) {
+        if (lower == nullptr) return upper;
+        if (upper == nullptr) return lower;
+        if (priority(lower) > priority(upper)) {
+            setRight(lower, join(lower->right.pload(), upper));
+            updateMaxSize(lower);
+            return lower;
+        }
+        setLeft(upper, join(lower, upper->left.pload()));
+        updateMaxSize(upper);
+        return upper;
+    }
+
+    extent* newFreeExtent(uint8_t* addr, uint64_t size) {
+        extent* t = (extent*)addr;
+        t->size = size;                                  // pstore()
+        t->left = nullptr;                               // pstore()
+        t->right = nullptr;                              // pstore()
+        t->maxSize = size;                               // pstore()
+        return t;
+    }
+
+    uint64_t arenaExp(arena* myarena) { return myarena->tag.pload() & kSlabClassMask; }
+
+    uint8_t* arenaEnd(arena* myarena) { return (uint8_t*)myarena + (1ULL << arenaExp(myarena)); }
+
+    // When 'myarena' is the block at the top of the pool, its last free extent doesn't need to be copied
+    // between replicas, except for the window with the header of the extent
+    void updateTopSlack(arena* myarena) {
+        if (arenaEnd(myarena) != poolTop->pload()) return;
+        extent* last = myarena->root.pload();
+        if (last != nullptr) {
+            while (last->right.pload() != nullptr) last = last->right.pload();
+        }
+        if (last != nullptr && (uint8_t*)last + last->size.pload() == arenaEnd(myarena)) {
+            setTopSlack(last->size.pload() - kSlabSize);
+        } else {
+            setTopSlack(0);
+        }
+    }
+
+    // Returns an extent with room for 'size' bytes and its header, from the first arena where it fits
+    void* extentMalloc(size_t size) {
+        uint64_t esize = (size + sizeof(block) + kSlabSize - 1) & ~(kSlabSize - 1);
+        arena* myarena = arenas->pload();
+        while (myarena != nullptr && maxSizeOf(myarena->root.pload()) < esize) myarena = myarena->next.pload();
+        if (myarena == nullptr) {
+            uint64_t aexp = highestBit(esize + kSlabSize);
+            if (aexp < kMinArenaExp) aexp = kMinArenaExp;
+            if (aexp >= kMaxBlockSize) return nullptr;
+            myarena = (arena*)allocBlock(aexp);
+            if (myarena == nullptr) return nullptr;
+            if (debugOn) printf("Creating arena of 2^%ld bytes at %p\n", aexp, myarena);
+            arena* head = arenas->pload();
+            myarena->tag = kArenaTag | aexp;             // pstore()
+            myarena->next = head;                        // pstore()
+            myarena->prev = nullptr;                     // pstore()
+            myarena->root = newFreeExtent((uint8_t*)myarena + kSlabSize, (1ULL << aexp) - kSlabSize);
+            if (head != nullptr) head->prev = myarena;   // pstore()
+            arenas->pstore(myarena);
+        }
+        // First-fit, the free extent at the lowest address that is large enough
+        extent* myextent = myarena->root.pload();
+        while (true) {
+            extent* left = myextent->left.pload();
+            if (maxSizeOf(left) >= esize) {
+                myextent = left;
+            } else if (myextent->size.pload() >= esize) {
+                break;
+            } else {
+                myextent = myextent->right.pload();
+            }
+        }
+        // Take it out of the tree and put back what is left of it
+        extent *lower, *middle, *upper;
+        split(myarena->root.pload(), (uint8_t*)myextent, lower, middle);
+        split(middle, (uint8_t*)myextent + 1, middle, upper);
+        uint64_t remaining = myextent->size.pload() - esize;
+        if (remaining > 0) lower = join(lower, newFreeExtent((uint8_t*)myextent + esize, remaining));
+        extent* root = join(lower, upper);
+        if (myarena->root.pload() != root) myarena->root = root;
+        myextent->size = esize;                          // pstore()
+        myextent->tag = kExtentTag | arenaExp(myarena);  // pstore()
+        updateTopSlack(myarena);
+        return (uint8_t*)myextent + sizeof(block);
+    }
+
+    // Gives back an extent to its arena, merging it with the free extents next to it
+    void extentFree(extent* myextent) {
+        uint64_t offset = (uint8_t*)myextent - poolAddr;
+        uint64_t aexp = myextent->tag.pload() & kSlabClassMask;
+        arena* myarena = (arena*)(poolAddr + (offset & ~((1ULL << aexp) - 1)));
+        uint8_t* start = (uint8_t*)myextent;
+        uint64_t size = myextent->size.pload();
+        extent *lower, *middle, *upper;
+        split(myarena->root.pload(), start, lower, upper);
+        extent* prev = lower;
+        if (prev != nullptr) {
+            while (prev->right.pload() != nullptr) prev = prev->right.pload();
+            if ((uint8_t*)prev + prev->size.pload() == start) {
+                split(lower, (uint8_t*)prev, lower, middle);
+                start = (uint8_t*)prev;
+                size += prev->size.pload();
+            }
+        }
+        extent* next = upper;
+        if (next != nullptr) {
+            while (next->left.pload() != nullptr) next = next->left.pload();
+            if ((uint8_t*)next == start + size) {
+                split(upper, (uint8_t*)next + 1, middle, upper);
+                size += next->size.pload();
+            }
+        }
+        if (size == (1ULL << aexp) - kSlabSize) {
+            // The whole arena is free, give it back
+            if (debugOn) printf("Releasing arena of 2^%ld bytes at %p\n", aexp, myarena);
+            arena* aprev = myarena->prev.pload();
+            arena* anext = myarena->next.pload();
+            if (aprev == nullptr) {
+                arenas->pstore(anext);
+            } else {
+                aprev->next = anext;                     // pstore()
+            }
+            if (anext != nullptr) anext->prev = aprev;   // pstore()
+            if (arenaEnd(myarena) == poolTop->pload()) setTopSlack(0);
+            freeBlock((block*)myarena, aexp);
+            return;
+        }
+        extent* root = join(join(lower, newFreeExtent(start, size)), upper);
+        if (myarena->root.pload() != root) myarena->root = root;
+        updateTopSlack(myarena);
     }
 
 public:
@@ -69,70 +527,101 @@ public:
 
         poolAddr = (uint8_t*)addressOfMemoryPool;
         if(poolAddr!=(uint8_t*)addressOfMemoryPool)std::cout<<"ERROR init Esloco \n";
-        poolSize = sizeOfMemoryPool + (uint8_t*)addressOfMemoryPool - poolAddr;
+        poolSize.store(sizeOfMemoryPool + (uint8_t*)addressOfMemoryPool - poolAddr, std::memory_order_release);
         // The first thing in the pool is a pointer to the top of the pool
         poolTop = (P<uint8_t*>*)poolAddr;
         // The second thing in the pool is the array of freelists
         freelists = (block*)(poolAddr + sizeof(*poolTop));
+        // The third thing in the pool is the array of slab lists
+        slabs = (P<slab*>*)(poolAddr + sizeof(*poolTop) + sizeof(block)*kMaxBlockSize);
+        // Then the list of arenas and the free space at the end of the arena at the top
+        arenas = (P<arena*>*)(slabs + kNumClasses);
+        topSlack = (P<uint64_t>*)(arenas + 1);
         if (clearPool) {
             // Unlike OneFile, in CX and Redo we don't need to clear the pool with memset()
             for (int i = 0; i < kMaxBlockSize; i++) freelists[i].next.pstore(nullptr);
-            // The size of the freelists array in bytes is sizeof(block)*kMaxBlockSize
-            // Align to cache line boundary
-            poolTop->pstore(aligned(poolAddr + sizeof(*poolTop) + sizeof(block)*kMaxBlockSize));
+            for (int i = 0; i < kNumClasses; i++) slabs[i].pstore(nullptr);
+            arenas->pstore(nullptr);
+            topSlack->pstore(0);
+            // The metadata takes the first kSlabSize window of the pool, blocks start after it
+            poolTop->pstore(poolAddr + kSlabSize);
         }
-        if (debugOn) printf("Starting EsLoco with poolAddr=%p and poolSize=%ld, up to %p\n", poolAddr, poolSize, poolAddr+poolSize);
+        if (debugOn) printf("Starting EsLoco with poolAddr=%p and poolSize=%ld, up to %p\n", poolAddr, poolSize.load(), poolAddr+poolSize.load());
     }
 
     // Resets the metadata of the allocator back to its defaults
     void reset() {
-        std::memset(poolAddr, 0, sizeof(block)*kMaxBlockSize);
+        std::memset(poolAddr, 0, sizeof(*poolTop) + sizeof(block)*kMaxBlockSize + sizeof(P<slab*>)*kNumClasses + sizeof(*arenas) + sizeof(*topSlack));
         poolTop->pstore(nullptr);
     }
 
-    // Returns the number of bytes that may (or may not) have allocated objects, from the base address to the top address
+    // Returns the number of bytes that may (or may not) have allocated objects, from the base address to the top address,
+    // minus the untouched free space at the end of the arena at the top
     uint64_t getUsedSize() {
     	if(poolAddr==nullptr) return 0;//to deal with transaction in createFile()
-        return poolTop->pload() - poolAddr;
+        return poolTop->pload() - poolAddr - topSlack->pload();
+    }
+
+    // Returns the number of bytes in the pool, from the base address to the end of the pool
+    uint64_t getPoolSize() { return poolSize.load(std::memory_order_acquire); }
+
+    // Extends the end of the pool to 'newPoolSize' bytes from the base address.
+    // The caller must make sure the new range is already mapped, the release store publishes it. The pool never shrinks.
+    void grow(size_t newPoolSize) {
+        if (newPoolSize > poolSize.load(std::memory_order_relaxed)) poolSize.store(newPoolSize, std::memory_order_release);
+    }
+
+    // Gives back to the pool the empty slabs that are kept at the head of their lists.
+    // Must be called inside a transaction, like malloc() and free().
+    void trim() {
+        for (int cls = 0; cls < kNumClasses; cls++) {
+            slab* myslab = slabs[cls].pload();
+            if (myslab == nullptr || myslab->numFree.pload() != slabCapacity(cls)) continue;
+            slab* next = myslab->next.pload();
+            slabs[cls] = next;                           // pstore()
+            if (next != nullptr) next->prev = nullptr;   // pstore()
+            freeBlock((block*)myslab, kSlabExp);
+        }
     }
 
     // Takes the desired size of the object in bytes.
     // Returns pointer to memory in pool, or nullptr.
-    // Does on average 1 store to persistent memory when re-utilizing blocks.
     void* malloc(size_t size) {
-        P<uint8_t*>* top = (P<uint8_t*>*)(((uint8_t*)poolTop));
+        if (size <= kMaxSlabObject) {
+            if (debugOn) printf("malloc(%ld) requested,  size class = %d\n", size, sizeClass(size));
+            return slabMalloc(sizeClass(size));
+        }
+        if (size + sizeof(block) > kSlabSize) {
+            if (debugOn) printf("malloc(%ld) requested,  extent\n", size);
+            return extentMalloc(size);
+        }
         // Adjust size to nearest (highest) power of 2
         uint64_t bsize = highestBit(size + sizeof(block));
         if (debugOn) printf("malloc(%ld) requested,  block size exponent = %ld\n", size, bsize);
-        block* myblock = nullptr;
-        // Check if there is a block of that size in the corresponding freelist
-        if (freelists[bsize].next.pload() != nullptr) {
-            if (debugOn) printf("Found available block in freelist\n");
-            // Unlink block
-            myblock = freelists[bsize].next.pload();
-            freelists[bsize].next = myblock->next.pload();// pstore()
-        } else {
-            if (debugOn) printf("Creating new block from top, currently at %p\n", top->pload());
-            // Couldn't find a suitable block, get one from the top of the pool if there is one available
-            if (top->pload() + (1<<bsize) > poolSize + poolAddr) return nullptr;
-            myblock = (block*)top->pload();
-            top->pstore(top->pload() + (1<<bsize));      // pstore()
-            myblock->size = bsize;                       // pstore()
-        }
+        if (bsize >= kMaxBlockSize) return nullptr;
+        block* myblock = allocBlock(bsize);
+        if (myblock == nullptr) return nullptr;
         if (debugOn) printf("returning ptr = %p\n", (void*)((uint8_t*)myblock + sizeof(block)));
         // Return the block, minus the header
         return (void*)((uint8_t*)myblock + sizeof(block));
     }
 
-    // Takes a pointer to an object and puts the block on the free-list.
-    // Does on average 2 stores to persistent memory.
+    // Takes a pointer to an object and puts it back in its slab or arena, or puts the block on the free-list.
     void free(void* ptr) {
         if (ptr == nullptr) return;
+        block* window = windowOf(ptr);
+        uint64_t tag = window->size.pload() & ~kSlabClassMask;
+        if (tag == kSlabTag) {
+            slabFree((slab*)window, ptr);
+            return;
+        }
+        if (tag == kExtentTag) {
+            extentFree((extent*)window);
+            return;
+        }
         block* myblock = (block*)((uint8_t*)ptr - sizeof(block));
         if (debugOn) printf("free(%p)  block size exponent = %ld\n", ptr, myblock->size.pload());
-        // Insert the block in the corresponding freelist
-        uint64_t size = myblock->size.pload();
-        myblock->next = freelists[size].next.pload();    // pstore()
-        freelists[size].next = myblock;                  // pstore()
+        // Insert the block in the corresponding freelist, or merge it
+        freeBlock(myblock, myblock->size.pload());
     }
 };
@@ -0,0 +1,182 @@
+/*
+ * Copyright 2017-2020
+ *   Andreia Correia <andreia.veiga@unine.ch>
+ *   Pedro Ramalhete <pramalhe@gmail.com>
+ *   Pascal Felber <pascal.felber@unine.ch>
+ *
+ * This work is published under the MIT license. See LICENSE.txt
+ */
+#ifndef _EVENT_TRACER_H_
+#define _EVENT_TRACER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include "pfences.h"     // asm_rdtsc() and cpuCyclesPerNs()
+
+/**
+ * <h1> Event Tracer </h1>
+ *
+ * Records the events of a PTM (begin and end of a transaction, start of a copy, CAS on curComb, etc) in
+ * one ring buffer per thread, with the rdtsc timestamp of the event and two arguments (usually tickets).
+ * The rings can be exported to the JSON format of Chrome traces, to be opened in chrome://tracing or
+ * https://ui.perfetto.dev, with one line per thread.
+ *
+ * Tracing is off by default and is turned on and off at runtime with enable(). When it is off, the
+ * cost of an event is a relaxed load and a branch. The rings take RING_SIZE*32 bytes per thread (8 MB for
+ * 32 threads) and are allocated the first time tracing is turned on, until then they take no memory.
+ * When it is on, an event is written only by its own thread with relaxed stores, there are no locked
+ * instructions. When a ring is full the oldest events are overwritten.
+ *
+ * The events should be exported after disabling the tracing, otherwise the events being written while
+ * exporting may be dropped or torn.
+ *
+ * Usage:
+ *   if (tracer.isEnabled()) tracer.record(tid, EV_COPY_START, seq, 0);
+ */
+template<int MAX_THREADS, uint64_t RING_SIZE = 8192>
+class EventTracer {
+    static_assert((RING_SIZE & (RING_SIZE-1)) == 0, "RING_SIZE must be a power of two");
+
+public:
+    // How an event is shown in the trace
+    enum Kind : char {
+        BEGIN = 'B',            // Start of a duration, ended by the next END on the same thread
+        END = 'E',
+        INSTANT = 'i',
+    };
+
+    // Description of each event type, indexed by the type passed to record()
+    struct EventInfo {
+        const char* name;
+        Kind        kind;
+        const char* arg1Name;   // nullptr if the argument is not used
+        const char* arg2Name;
+    };
+
+private:
+    struct Event {
+        std::atomic<uint64_t> tsc {0};
+        std::atomic<uint64_t> type {0};
+        std::atomic<uint64_t> arg1 {0};
+        std::atomic<uint64_t> arg2 {0};
+    };
+
+    struct alignas(128) ThreadRing {
+        std::atomic<uint64_t> head {0};     // Number of events recorded by this thread since the start
+        Event events[RING_SIZE];
+    };
+
+    std::atomic<bool> enabled {false};
+    std::atomic<ThreadRing*> rings {nullptr};   // MAX_THREADS rings, nullptr until tracing is first enabled
+
+public:
+    EventTracer() { }
+
+    ~EventTracer() {
+        std::free(rings.load());
+    }
+
+    inline bool isEnabled() const { return enabled.load(std::memory_order_relaxed); }
+
+    // Returns false if tracing is turned on and there is no memory for the rings
+    bool enable(bool on) {
+        if (on && rings.load() == nullptr) {
+            // The alignment of ThreadRing is not honored by operator new before C++17
+            void* mem = nullptr;
+            if (posix_memalign(&mem, alignof(ThreadRing), sizeof(ThreadRing)*MAX_THREADS) != 0) return false;
+            ThreadRing* newRings = static_cast<ThreadRing*>(mem);
+            for (int tid = 0; tid < MAX_THREADS; tid++) new (&newRings[tid]) ThreadRing();
+            ThreadRing* expected = nullptr;
+            if (!rings.compare_exchange_strong(expected, newRings)) std::free(newRings);
+        }
+        enabled.store(on);
+        return true;
+    }
+
+    // Must only be called when isEnabled() is true
+    inline void record(const int tid, const uint64_t type, const uint64_t arg1, const uint64_t arg2) {
+        ThreadRing& ring = rings.load(std::memory_order_acquire)[tid];
+        const uint64_t h = ring.head.load(std::memory_order_relaxed);
+        Event& ev = ring.events[h & (RING_SIZE-1)];
+        ev.tsc.store(asm_rdtsc(), std::memory_order_relaxed);
+        ev.type.store(type, std::memory_order_relaxed);
+        ev.arg1.store(arg1, std::memory_order_relaxed);
+        ev.arg2.store(arg2, std::memory_order_relaxed);
+        ring.head.store(h+1, std::memory_order_release);
+    }
+
+    // Drops all the events recorded so far. Must not be called while tracing is enabled.
+    void clear() {
+        ThreadRing* lrings = rings.load();
+        if (lrings == nullptr) return;
+        for (int tid = 0; tid < MAX_THREADS; tid++) lrings[tid].head.store(0);
+    }
+
+    // Returns the events of all threads in the Chrome trace JSON format
+    std::string toChromeTrace(const EventInfo infos[], const uint64_t numTypes) const {
+        const ThreadRing* lrings = rings.load();
+        std::string s = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+        if (lrings == nullptr) return s + "\n]}\n";
+        // Timestamps are shown relative to the oldest event
+        uint64_t minTSC = UINT64_MAX;
+        for (int tid = 0; tid < MAX_THREADS; tid++) {
+            const ThreadRing& ring = lrings[tid];
+            const uint64_t h = ring.head.load(std::memory_order_acquire);
+            if (h == 0) continue;
+            const uint64_t oldest = h > RING_SIZE ? h-RING_SIZE : 0;
+            const uint64_t tsc = ring.events[oldest & (RING_SIZE-1)].tsc.load(std::memory_order_relaxed);
+            if (tsc < minTSC) minTSC = tsc;
+        }
+        const double cyclesPerUs = cpuCyclesPerNs() * 1000;
+        bool first = true;
+        char buf[512];
+        for (int tid = 0; tid < MAX_THREADS; tid++) {
+            const ThreadRing& ring = lrings[tid];
+            const uint64_t h = ring.head.load(std::memory_order_acquire);
+            const uint64_t oldest = h > RING_SIZE ? h-RING_SIZE : 0;
+            for (uint64_t i = oldest; i < h; i++) {
+                const Event& ev = ring.events[i & (RING_SIZE-1)];
+                const uint64_t type = ev.type.load(std::memory_order_relaxed);
+                const uint64_t tsc = ev.tsc.load(std::memory_order_relaxed);
+                const uint64_t arg1 = ev.arg1.load(std::memory_order_relaxed);
+                const uint64_t arg2 = ev.arg2.load(std::memory_order_relaxed);
+                // Drop the event if its slot was overwritten while we were reading it
+                if (ring.head.load(std::memory_order_acquire) >= i + RING_SIZE) continue;
+                if (type >= numTypes || tsc < minTSC) continue;
+                const EventInfo& info = infos[type];
+                int n = snprintf(buf, sizeof(buf), "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d",
+                                 first ? "" : ",\n", info.name, (char)info.kind, (tsc-minTSC)/cyclesPerUs, tid);
+                if (info.kind == INSTANT) n += snprintf(buf+n, sizeof(buf)-n, ",\"s\":\"t\"");
+                if (info.arg1Name != nullptr) {
+                    n += snprintf(buf+n, sizeof(buf)-n, ",\"args\":{\"%s\":%llu", info.arg1Name,
+                                  (unsigned long long)arg1);
+                    if (info.arg2Name != nullptr) {
+                        n += snprintf(buf+n, sizeof(buf)-n, ",\"%s\":%llu", info.arg2Name,
+                                      (unsigned long long)arg2);
+                    }
+                    n += snprintf(buf+n, sizeof(buf)-n, "}");
+                }
+                snprintf(buf+n, sizeof(buf)-n, "}");
+                s += buf;
+                first = false;
+            }
+        }
+        s += "\n]}\n";
+        return s;
+    }
+
+    // Writes the Chrome trace to a file. Returns false if the file could not be written.
+    bool saveChromeTrace(const char* filename, const EventInfo infos[], const uint64_t numTypes) const {
+        FILE* f = fopen(filename, "w");
+        if (f == nullptr) return false;
+        const std::string s = toChromeTrace(infos, numTypes);
+        const bool ok = fwrite(s.data(), 1, s.size(), f) == s.size();
+        return fclose(f) == 0 && ok;
+    }
+};
+
+#endif /* _EVENT_TRACER_H_ */
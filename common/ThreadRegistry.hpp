@@ -25,6 +25,8 @@ extern void thread_registry_deregister_thread(const int tid);
 struct ThreadCheckInCheckOut {
     static const int NOT_ASSIGNED = -1;
     int tid { NOT_ASSIGNED };
+    int leaseDepth { 0 };              // Nesting of leases. The tid is leased when this is above zero.
+    int leaseHint { NOT_ASSIGNED };    // Last tid leased by this thread, tried first on the next lease
     ~ThreadCheckInCheckOut() {
         if (tid == NOT_ASSIGNED) return;
         thread_registry_deregister_thread(tid);
@@ -49,17 +51,73 @@ extern ThreadRegistry gThreadRegistry;
  * upon destruction of the thread will call the destructor of ThreadCheckInCheckOut and free the
  * corresponding slot to be used by a later thread.
  * RomulusLR relies on this to work properly.
+ *
+ * <h2> Lease mode </h2>
+ * With pools of hundreds of short-lived threads, binding each thread to a slot until it exits
+ * exhausts the registry. When lease mode is on, a thread that enters a transaction without a tid
+ * leases one with a ThreadRegistry::Lease and gives it back when the transaction ends. The PTMs can
+ * then size their per-thread arrays by the number of concurrent transactions instead of the number
+ * of live threads: a lease waits until one of the first 'maxTids' slots is free.
+ * The free slots are kept in a lock-free stack (Treiber stack with a version tag against ABA), so
+ * that the most recently released slot is leased next. Each thread first tries the slot it leased
+ * the last time, which keeps the per-tid state of the PTM in the cache of that core.
+ * The stack may have slots that were taken by a scan or by a hint, these are skipped when popped.
  */
 class ThreadRegistry {
 private:
     alignas(128) std::atomic<bool>      usedTID[REGISTRY_MAX_THREADS];   // Which TIDs are in use by threads
     alignas(128) std::atomic<int>       maxTid {-1};                     // Highest TID (+1) in use by threads
+    // Stack of free TIDs for the leases
+    static const uint64_t NO_SLOT = 0xFFFFFFFF;
+    alignas(128) std::atomic<uint64_t>  freeHead {NO_SLOT};              // Version (32 bits) and top of the stack (32 bits)
+    alignas(128) std::atomic<uint32_t>  nextFree[REGISTRY_MAX_THREADS];  // Next TID in the stack
+    alignas(128) std::atomic<bool>      inFreeStack[REGISTRY_MAX_THREADS];
+    std::atomic<bool>                   leaseMode {false};
+
+    void pushFree(const int tid) {
+        if (inFreeStack[tid].exchange(true)) return;  // Already in the stack
+        uint64_t head = freeHead.load();
+        while (true) {
+            nextFree[tid].store((uint32_t)(head & NO_SLOT), std::memory_order_relaxed);
+            const uint64_t newHead = (((head >> 32) + 1) << 32) | (uint64_t)tid;
+            if (freeHead.compare_exchange_weak(head, newHead)) return;
+        }
+    }
+
+    int popFree() {
+        uint64_t head = freeHead.load();
+        while (true) {
+            const uint64_t top = head & NO_SLOT;
+            if (top == NO_SLOT) return ThreadCheckInCheckOut::NOT_ASSIGNED;
+            const uint64_t newHead = (((head >> 32) + 1) << 32) | nextFree[top].load(std::memory_order_relaxed);
+            if (freeHead.compare_exchange_weak(head, newHead)) {
+                inFreeStack[top].store(false);
+                return (int)top;
+            }
+        }
+    }
+
+    inline bool tryTake(const int tid) {
+        if (usedTID[tid].load(std::memory_order_acquire)) return false;
+        bool unused = false;
+        if (!usedTID[tid].compare_exchange_strong(unused, true)) return false;
+        // Increase the current maximum to cover our thread id
+        int curMax = maxTid.load();
+        while (curMax <= tid) {
+            maxTid.compare_exchange_strong(curMax, tid+1);
+            curMax = maxTid.load();
+        }
+        return true;
+    }
 
 public:
     ThreadRegistry() {
         for (int it = 0; it < REGISTRY_MAX_THREADS; it++) {
             usedTID[it].store(false, std::memory_order_relaxed);
+            inFreeStack[it].store(false, std::memory_order_relaxed);
         }
+        // The lowest TIDs are on the top of the stack
+        for (int it = REGISTRY_MAX_THREADS-1; it >= 0; it--) pushFree(it);
     }
 
     /*
@@ -67,15 +125,7 @@ public:
      */
     int register_thread_new(void) {
         for (int tid = 0; tid < REGISTRY_MAX_THREADS; tid++) {
-            if (usedTID[tid].load(std::memory_order_acquire)) continue;
-            bool unused = false;
-            if (!usedTID[tid].compare_exchange_strong(unused, true)) continue;
-            // Increase the current maximum to cover our thread id
-            int curMax = maxTid.load();
-            while (curMax <= tid) {
-                maxTid.compare_exchange_strong(curMax, tid+1);
-                curMax = maxTid.load();
-            }
+            if (!tryTake(tid)) continue;
             tl_tcico.tid = tid;
             return tid;
         }
@@ -88,8 +138,82 @@ public:
      */
     inline void deregister_thread(const int tid) {
         usedTID[tid].store(false, std::memory_order_release);
+        pushFree(tid);
+    }
+
+    /*
+     * Leases one of the TIDs in [0, maxTids), waiting for one to be released if they are all in use.
+     * Progress condition: lock-free (blocking if there are more than 'maxTids' concurrent leases)
+     */
+    int lease_tid(const int maxTids) {
+        ThreadCheckInCheckOut& tc = tl_tcico;
+        int tid = tc.leaseHint;
+        if (tid == ThreadCheckInCheckOut::NOT_ASSIGNED || tid >= maxTids || !tryTake(tid)) {
+            while (true) {
+                tid = popFree();
+                if (tid != ThreadCheckInCheckOut::NOT_ASSIGNED) {
+                    if (tid < maxTids && tryTake(tid)) break;
+                    // Too high for the caller, give it back. Taken by someone else, skip it.
+                    if (tid >= maxTids) pushFree(tid);
+                    else continue;
+                }
+                // Slots that are being released may not be in the stack yet
+                for (tid = 0; tid < maxTids; tid++) {
+                    if (tryTake(tid)) break;
+                }
+                if (tid < maxTids) break;
+                std::this_thread::yield();
+            }
+        }
+        tc.tid = tid;
+        tc.leaseHint = tid;
+        return tid;
     }
 
+    /*
+     * Progress condition: lock-free
+     */
+    inline void release_tid(const int tid) {
+        tl_tcico.tid = ThreadCheckInCheckOut::NOT_ASSIGNED;
+        deregister_thread(tid);
+    }
+
+    // Turns lease mode on or off. Threads that already have a tid keep it until they exit.
+    static void setLeaseMode(bool on) {
+        gThreadRegistry.leaseMode.store(on);
+    }
+
+    static inline bool isLeaseMode() {
+        return gThreadRegistry.leaseMode.load(std::memory_order_relaxed);
+    }
+
+    /*
+     * Leases a tid for the scope of a transaction, when lease mode is on and the thread doesn't have a tid yet.
+     * Nested leases keep the tid of the outermost one. Does nothing when lease mode is off.
+     */
+    class Lease {
+    public:
+        Lease(const int maxTids = REGISTRY_MAX_THREADS) {
+            ThreadCheckInCheckOut& tc = tl_tcico;
+            if (tc.leaseDepth > 0) {
+                tc.leaseDepth++;
+                return;
+            }
+            if (tc.tid != ThreadCheckInCheckOut::NOT_ASSIGNED || !isLeaseMode()) return;
+            gThreadRegistry.lease_tid(maxTids);
+            tc.leaseDepth = 1;
+        }
+
+        ~Lease() {
+            ThreadCheckInCheckOut& tc = tl_tcico;
+            if (tc.leaseDepth == 0) return;
+            if (--tc.leaseDepth == 0) gThreadRegistry.release_tid(tc.tid);
+        }
+
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+    };
+
     /*
      * Progress condition: wait-free population oblivious
      */
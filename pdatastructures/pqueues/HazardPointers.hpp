@@ -8,12 +8,21 @@
 #ifndef _HAZARD_POINTERS_H_
 #define _HAZARD_POINTERS_H_
 
+#include <algorithm>
 #include <atomic>
 #include <iostream>
 #include <functional>
 #include <vector>
 
 
+/*
+ * Retired objects are reclaimed in batches: a thread scans the hazard pointers only after it has retired
+ * R = HP_THRESHOLD_FACTOR*H more objects since its last scan, where H is the number of hazard pointers of the
+ * active threads (named 'R' and 'H' in the HP paper). A scan copies the non-null hazard pointers of the active
+ * threads into a sorted array and looks up each retired object in it, which is O(R log H). At most H retired
+ * objects can be protected, therefore the cost of a scan is amortized over at least R-H retires.
+ * The active threads are the ones with a tid below the highest tid that has published a hazard pointer.
+ */
 template<typename T>
 class HazardPointers {
 
@@ -21,17 +30,60 @@ private:
     static const int      HP_MAX_THREADS = 128;
     static const int      HP_MAX_HPS = 128;     // This is named 'K' in the HP paper
     static const int      CLPAD = 128/sizeof(std::atomic<T*>);
-    static const int      HP_THRESHOLD_R = 0; // This is named 'R' in the HP paper
+    static const int      HP_THRESHOLD_FACTOR = 2;  // R = HP_THRESHOLD_FACTOR*H
+    static const int      HP_THRESHOLD_MIN = 64;    // Minimum for R, so that a single thread doesn't scan on every retire
     static const int      MAX_RETIRED = HP_MAX_THREADS*HP_MAX_HPS; // Maximum number of retired objects per thread
 
     const int             maxHPs;
     const int             maxThreads;
 
+    struct alignas(128) RetiredList {
+        std::vector<T*>   objs;
+        std::vector<T*>   hazards;      // Used by scan(), kept here to avoid allocating on each scan
+        size_t            kept {0};     // Number of objects left by the last scan
+    };
+
     alignas(128) std::atomic<T*>*      hp[HP_MAX_THREADS];
-    // It's not nice that we have a lot of empty vectors, but we need padding to avoid false sharing
-    alignas(128) std::vector<T*>       retiredList[HP_MAX_THREADS*CLPAD];
+    alignas(128) RetiredList           retiredList[HP_MAX_THREADS];
+    alignas(128) std::atomic<int>      maxActive {0};  // Highest tid (+1) that has published a hazard pointer
     std::function<void(T*,int)> defdeleter = [](T* t, int tid){ delete t; };
     std::function<void(T*,int)>& deleter;
+
+    // Must be seq-cst (like the store of the hazard pointer), otherwise a scan could miss the hazard pointers of this thread
+    inline void setActive(const int tid) {
+        if (tid < maxActive.load()) return;
+        int curMax = maxActive.load();
+        while (curMax <= tid && !maxActive.compare_exchange_strong(curMax, tid+1)) { }
+    }
+
+    /**
+     * Deletes the retired objects of 'tid' that are not protected by a hazard pointer
+     * Progress Condition: wait-free bounded (by the number of active threads and retired objects)
+     */
+    void scan(const int tid) {
+        RetiredList& rl = retiredList[tid];
+        rl.hazards.clear();
+        const int numActive = std::min(maxActive.load(), maxThreads);
+        for (int it = 0; it < numActive; it++) {
+            for (int ihp = 0; ihp < maxHPs; ihp++) {
+                T* ptr = hp[it][ihp].load();
+                if (ptr != nullptr) rl.hazards.push_back(ptr);
+            }
+        }
+        std::sort(rl.hazards.begin(), rl.hazards.end());
+        size_t kept = 0;
+        for (size_t iret = 0; iret < rl.objs.size(); iret++) {
+            T* obj = rl.objs[iret];
+            if (std::binary_search(rl.hazards.begin(), rl.hazards.end(), obj)) {
+                rl.objs[kept++] = obj;
+            } else {
+                deleter(obj,tid);
+            }
+        }
+        rl.objs.resize(kept);
+        rl.kept = kept;
+    }
+
 public:
 
     HazardPointers(int maxHPs, int maxThreads) : maxHPs{maxHPs}, maxThreads{maxThreads}, deleter{defdeleter} {
@@ -56,8 +108,8 @@ public:
         for (int ithread = 0; ithread < HP_MAX_THREADS; ithread++) {
             delete[] hp[ithread];
             // Clear the current retired nodes
-            for (unsigned iret = 0; iret < retiredList[ithread*CLPAD].size(); iret++) {
-                delete retiredList[ithread*CLPAD][iret];
+            for (unsigned iret = 0; iret < retiredList[ithread].objs.size(); iret++) {
+                delete retiredList[ithread].objs[iret];
             }
         }
     }
@@ -85,6 +137,7 @@ public:
      * Progress Condition: lock-free
      */
     T* protect(int index, const std::atomic<T*>& atom, const int tid) {
+        setActive(tid);
         T* n = nullptr;
         T* ret;
 		while ((ret = atom.load()) != n) {
@@ -102,6 +155,7 @@ public:
      * Progress Condition: wait-free population oblivious
      */
     T* protectPtr(int index, T* ptr, const int tid) {
+        setActive(tid);
         hp[tid][index].store(ptr);
         return ptr;
     }
@@ -113,35 +167,22 @@ public:
      * Progress Condition: wait-free population oblivious
      */
     T* protectPtrRelease(int index, T* ptr, const int tid) {
+        setActive(tid);
         hp[tid][index].store(ptr, std::memory_order_release);
         return ptr;
     }
 
 
     /**
-     * Progress Condition: wait-free bounded (by the number of threads squared)
+     * Progress Condition: wait-free bounded (by the number of active threads and retired objects)
      */
     void retire(T* ptr, const int tid) {
-        retiredList[tid*CLPAD].push_back(ptr);
-        if (retiredList[tid*CLPAD].size() < HP_THRESHOLD_R) return;
-        for (unsigned iret = 0; iret < retiredList[tid*CLPAD].size();) {
-            auto obj = retiredList[tid*CLPAD][iret];
-            bool canDelete = true;
-            for (int tid = 0; tid < maxThreads && canDelete; tid++) {
-                for (int ihp = maxHPs-1; ihp >= 0; ihp--) {
-                    if (hp[tid][ihp].load() == obj) {
-                        canDelete = false;
-                        break;
-                    }
-                }
-            }
-            if (canDelete) {
-                retiredList[tid*CLPAD].erase(retiredList[tid*CLPAD].begin() + iret);
-                deleter(obj,tid);
-                continue;
-            }
-            iret++;
-        }
+        RetiredList& rl = retiredList[tid];
+        rl.objs.push_back(ptr);
+        const size_t numHPs = (size_t)std::min(maxActive.load(std::memory_order_relaxed), maxThreads)*maxHPs;
+        const size_t threshold = std::max<size_t>(HP_THRESHOLD_FACTOR*numHPs, HP_THRESHOLD_MIN);
+        if (rl.objs.size() < rl.kept + threshold) return;
+        scan(tid);
     }
 };
 
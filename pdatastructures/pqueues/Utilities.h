@@ -16,6 +16,10 @@
 
 std::ofstream file;
 
+#if !defined(PWB_IS_CLFLUSH) && !defined(PWB_IS_CLFLUSHOPT) && !defined(PWB_IS_CLWB)
+#include "../../common/pfences.h"      // The pwb is chosen at startup
+#endif
+
 #ifdef MEASURE_PWB
 extern thread_local uint64_t tl_num_pwbs;
 extern thread_local uint64_t tl_num_pfences;
@@ -24,7 +28,7 @@ extern thread_local uint64_t tl_num_pfences;
 
 void FLUSH(void *p)
 {
-#ifdef MEASURE_PWB
+#if defined(MEASURE_PWB) && !defined(PWB_IS_RUNTIME)   // PWB() counts it
     tl_num_pwbs++;
 #endif
 #ifdef PWB_IS_CLFLUSH
@@ -33,6 +37,8 @@ void FLUSH(void *p)
     asm volatile(".byte 0x66; clflush %0" : "+m" (*(volatile char *)(p)));    // clflushopt (Kaby Lake)
 #elif PWB_IS_CLWB
     asm volatile(".byte 0x66; xsaveopt %0" : "+m" (*(volatile char *)(p)));  // clwb() only for Ice Lake onwards
+#elif defined(PWB_IS_RUNTIME)
+    PWB(p);                 // pwbRuntime(), or pmEmuPwb() with PM_EMULATION
 #else
 #error "You must define what PWB is. Choose PWB_IS_CLFLUSH if you don't know what your CPU is capable of"
 #endif
@@ -40,7 +46,7 @@ void FLUSH(void *p)
 
 void FLUSH(void volatile * p)
 {
-#ifdef MEASURE_PWB
+#if defined(MEASURE_PWB) && !defined(PWB_IS_RUNTIME)   // PWB() counts it
     tl_num_pwbs++;
 #endif
 #ifdef PWB_IS_CLFLUSH
@@ -49,6 +55,8 @@ void FLUSH(void volatile * p)
     asm volatile(".byte 0x66; clflush %0" : "+m" (*(volatile char *)(p)));    // clflushopt (Kaby Lake)
 #elif PWB_IS_CLWB
     asm volatile(".byte 0x66; xsaveopt %0" : "+m" (*(volatile char *)(p)));  // clwb() only for Ice Lake onwards
+#elif defined(PWB_IS_RUNTIME)
+    PWB(p);                 // pwbRuntime(), or pmEmuPwb() with PM_EMULATION
 #else
 #error "You must define what PWB is. Choose PWB_IS_CLFLUSH if you don't know what your CPU is capable of"
 #endif
@@ -68,6 +76,10 @@ void SFENCE()
     #define FENCE SFENCE
 #elif PWB_IS_CLWB
     #define FENCE SFENCE
+#elif defined(PM_EMULATION)
+    #define FENCE() PSYNC()
+#elif defined(PWB_IS_RUNTIME)
+    #define FENCE() {if (g_pwb_flavor == PWB_FLAVOR_CLFLUSH) MFENCE(); else SFENCE();}
 #else
 #error "You must define what PWB is. Choose PWB_IS_CLFLUSH if you don't know what your CPU is capable of"
 #endif
@@ -1,45 +1,100 @@
 #ifndef _TM_RESIZABLE_HASHByVal_MAP_H_
 #define _TM_RESIZABLE_HASHByVal_MAP_H_
 
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <new>
 #include <string>
 
 #include "ptmdb.h"
 #include "slice.h"
+#include "merge_operator.h"
+#include "util/hash.h"
 
 namespace ptmdb {
 
 /**
  * <h1> A Resizable Hash Map for usage in CX-Redo </h1>
  *
+ * Grows with linear hashing: each insertion that takes the map over its load factor splits one bucket,
+ * the bucket 'split', into itself and the bucket 'split + mask + 1'. There is never a rehash of the whole
+ * map, so no transaction modifies more than a few buckets and one new segment.
+ * Buckets [0, split) and [mask+1, capacity) are addressed with the bits of 2*mask+1, the others with 'mask'.
+ *
+ * The buckets are in segments of SEGMENT_SIZE buckets, so that adding buckets does not move the existing ones.
+ * The directory of segments doubles when it is full, it has one entry per SEGMENT_SIZE buckets.
+ *
+ * The map does not shrink when keys are removed.
+ *
+ * A node is a single allocation with the key and, up to MAX_INLINE_VALUE bytes, the value right after its
+ * header, so that an insertion does one allocation and a lookup reads one cache line per node for small
+ * keys. Larger values are in a separate allocation. The bytes of a node are written in whole words
+ * (the PTMs log the modifications in words of 8 bytes), from the start of the key.
+ *
+ * Each node keeps the hash of its key: the walk of a chain compares the hashes and only compares the
+ * key bytes when they are equal, and splitting a bucket doesn't need to read the keys.
  */
 class TMHashMap {
 public:
+    static const size_t MAX_INLINE_VALUE = 256;
+
     struct Node {
-        PSlice              key;  // Immutable after node creation, so no need for persist<PSlice>
-        PSlice              val;  // Mutates only when put() replaces the key
-        TM_TYPE<Node*>      next {nullptr};
-        Node(const Slice& k, const Slice& v):key{k},val{v}{}
+        TM_TYPE<Node*>      next;
+        TM_TYPE<uint64_t>   hash;      // hashOf() the key
+        TM_TYPE<uint64_t>   sizes;     // Size of the key in the low 32 bits, size of the value in the high 32 bits
+        TM_TYPE<char*>      outValue;  // The value if it is not inline, otherwise nullptr
+        // Followed by the key and, if outValue is nullptr, by the value
+
+        // User-provided so that 'new Node()' doesn't zero the node with stores that bypass the PTM
+        Node(uint64_t h, size_t keySize, size_t valueSize)
+            : next{nullptr}, hash{h}, sizes{keySize | ((uint64_t)valueSize << 32)}, outValue{nullptr} { }
+
+        size_t keySize() const { return sizes.pload() & 0xFFFFFFFFULL; }
+        size_t valueSize() const { return sizes.pload() >> 32; }
+        // Pointers to the copy read by the current transaction
+        const char* keyData() const { return replica(reinterpret_cast<const char*>(this+1)); }
+        const char* valueData() const {
+            char* out = outValue.pload();
+            if (out != nullptr) return replica(out);
+            return keyData() + keySize();
+        }
+
+        bool keyEquals(const Slice& key) const {
+            return keySize() == key.size() && std::memcmp(keyData(), key.data(), key.size()) == 0;
+        }
+
+        // Same as keyEquals(), where 'h' is hashOf(key)
+        bool matches(uint64_t h, const Slice& key) const {
+            return hash.pload() == h && keyEquals(key);
+        }
     };
 
+    static const int  SEGMENT_BITS = 10;
+    static const long SEGMENT_SIZE = 1L << SEGMENT_BITS;
 
-    TM_TYPE<long>                         capacity;
+    TM_TYPE<long>                         capacity;           // Number of buckets in use
     TM_TYPE<long>                         sizeHM = 0;
     TM_TYPE<double>                       loadFactor = 2;
-    alignas(128) TM_TYPE<TM_TYPE<Node*>*> buckets;      // An array of pointers to Nodes
+    TM_TYPE<long>                         mask;               // Number of buckets at the start of the round, minus one
+    TM_TYPE<long>                         split {0};          // Next bucket to split
+    TM_TYPE<long>                         dirSize;            // Number of entries in the directory
+    alignas(128) TM_TYPE<TM_TYPE<TM_TYPE<Node*>*>*> directory; // An array of pointers to segments of buckets
 
 
 public:
-    TMHashMap(int capacity=10*1024*1024) : capacity{capacity} {
+    // The initial number of buckets is rounded up to a power of two, and to at least one segment
+    TMHashMap(long initialCapacity=64*1024) {
+        long cap = SEGMENT_SIZE;
+        while (cap < initialCapacity) cap *= 2;
 #ifdef PTMDB_CAPTURE_BY_COPY
         PTM_UPDATE_TX<bool>([=] () {
-            buckets = (TM_TYPE<Node*>*)TM_PMALLOC(capacity*sizeof(TM_TYPE<Node*>));
-            for (int i = 0; i < capacity; i++) buckets[i]=nullptr;
+            init(cap);
             return true;
         });
 #else
         PTM_UPDATE_TX([&] () {
-            buckets = (TM_TYPE<Node*>*)TM_PMALLOC(capacity*sizeof(TM_TYPE<Node*>));
-            for (int i = 0; i < capacity; i++) buckets[i]=nullptr;
+            init(cap);
         });
 #endif
     }
@@ -48,28 +103,12 @@ public:
     ~TMHashMap() {
 #ifdef PTMDB_CAPTURE_BY_COPY
         PTM_UPDATE_TX<bool>([=] () {
-            for(int i = 0; i < capacity; i++){
-                Node* node = buckets[i];
-                while (node!=nullptr) {
-                    Node* next = node->next;
-                    PTM_DELETE(node);
-                    node = next;
-                }
-            }
-            TM_PFREE(buckets);
+            destroy();
             return true;
         });
 #else
         PTM_UPDATE_TX([&] () {
-            for(int i = 0; i < capacity; i++){
-                Node* node = buckets[i];
-                while (node!=nullptr) {
-                    Node* next = node->next;
-                    PTM_DELETE(node);
-                    node = next;
-                }
-            }
-            TM_PFREE(buckets);
+            destroy();
         });
 #endif
     }
@@ -78,29 +117,6 @@ public:
     std::string className() { return TM_NAME() + "-HashMap"; }
 
 
-    void rebuild() {
-        int newcapacity = 2*capacity;
-        printf("Extending Hashmap to %d buckets\n", newcapacity);
-        TM_TYPE<Node*>* newbuckets = (TM_TYPE<Node*>*)TM_PMALLOC(newcapacity*sizeof(TM_TYPE<Node*>));
-        assert(newbuckets != nullptr);
-        for (int i = 0; i < newcapacity; i++) newbuckets[i] = nullptr;
-        for (int i = 0; i < capacity; i++) {
-            Node* node = buckets[i];
-            while(node!=nullptr){
-                Node* next = node->next;
-                // TODO: humm we should use only has of Slice for simplicity
-                auto h = std::hash<PSlice>{}(node->key) % newcapacity;
-                node->next = newbuckets[h];
-                newbuckets[h] = node;
-                node = next;
-            }
-        }
-        TM_PFREE(buckets);
-        buckets = newbuckets;
-        capacity = newcapacity;
-    }
-
-
     /*
      * Adds a node with a key if the key is not present, otherwise replaces the value.
      * If saveOldValue is set, it will set 'oldValue' to the previous value, iff there was already a mapping.
@@ -108,30 +124,40 @@ public:
      * Returns true if there was no mapping for the key, false if there was already a value and it was replaced.
      */
     bool innerPut(const Slice& key, const Slice& value) {
-        // TODO: re-enable hashmap rebuild
-        //if (sizeHM > (long)(capacity.pload()*loadFactor)) rebuild();
-        auto h = std::hash<Slice>{}(key) % capacity;
-        Node* node = buckets[h];
-        Node* prev = node;
-        while (true) {
-            if (node == nullptr) {
-                Node* newnode = PTM_NEW<Node>(key,value);
-                assert(newnode != nullptr);
-                if (node == prev) {
-                    buckets[h] = newnode;
-                } else {
-                    prev->next = newnode;
-                }
-                //sizeHM++;
-                return true;  // New insertion
-            }
-            if (node->key == key) {
-                node->val = value;
-                return false; // Replace value for existing key
-            }
-            prev = node;
-            node = node->next;
+        const uint64_t h = hashOf(key);
+        TM_TYPE<Node*>& bucket = bucketAt(bucketOfHash(h));
+        Node* prev;
+        Node* node = findNode(bucket, h, key, &prev);
+        if (node == nullptr) {
+            insertNode(bucket, prev, h, key, value);
+            return true;  // New insertion
+        }
+        replaceValue(bucket, prev, node, key, value);
+        return false; // Replace value for existing key
+    }
+
+
+    /*
+     * Sets the value of the key to the result of 'mergeOp' on its current value (if any) and 'operand',
+     * with a single walk of the chain.
+     *
+     * Returns false if the merge operator failed, in which case nothing is modified.
+     */
+    bool innerMerge(const Slice& key, const Slice& operand, const MergeOperator* mergeOp) {
+        const uint64_t h = hashOf(key);
+        TM_TYPE<Node*>& bucket = bucketAt(bucketOfHash(h));
+        Node* prev;
+        Node* node = findNode(bucket, h, key, &prev);
+        std::string newValue;
+        if (node == nullptr) {
+            if (!mergeOp->Merge(key, nullptr, operand, &newValue)) return false;
+            insertNode(bucket, prev, h, key, newValue);
+            return true;
         }
+        const Slice oldValue(node->valueData(), node->valueSize());
+        if (!mergeOp->Merge(key, &oldValue, operand, &newValue)) return false;
+        replaceValue(bucket, prev, node, key, newValue);
+        return true;
     }
 
 
@@ -142,19 +168,20 @@ public:
      * Returns returns true if a matching key was found
      */
     bool innerRemove(const Slice& key) {
-        auto h = std::hash<Slice>{}(key) % capacity;
-        Node* node = buckets[h];
+        const uint64_t h = hashOf(key);
+        TM_TYPE<Node*>& bucket = bucketAt(bucketOfHash(h));
+        Node* node = bucket;
         Node* prev = node;
         while (true) {
             if (node == nullptr) return false;
-            if (node->key == key) {
+            if (node->matches(h, key)) {
                 if (node == prev) {
-                    buckets[h] = node->next;
+                    bucket = node->next;
                 } else {
                     prev->next = node->next;
                 }
-                //sizeHM--;
-                PTM_DELETE(node);
+                sizeHM--;
+                deleteNode(node);
                 return true;
             }
             prev = node;
@@ -167,20 +194,252 @@ public:
      * Returns true if key is present. Saves a copy of 'value' in 'oldValue' if 'saveOldValue' is set.
      */
     bool innerGet(const Slice& key, std::string* oldValue) {
-        auto h = std::hash<Slice>{}(key) % capacity;
-        Node* node = buckets[h];
+        const uint64_t h = hashOf(key);
+        Node* node = bucketAt(bucketOfHash(h));
         while (true) {
             if (node == nullptr) return false;
-            if (node->key == key) {
-                oldValue->assign(node->val.data(), node->val.size());  // Makes a copy of V
+            if (node->matches(h, key)) {
+                oldValue->assign(node->valueData(), node->valueSize());  // Makes a copy of V
                 return true;
             }
             node = node->next;
         }
     }
     
-    int getBucket(const Slice& key) {
-        return std::hash<Slice>{}(key) % capacity;
+    /*
+     * Returns true if key is present, and sets 'data' and 'size' to the value in the replica read by the
+     * current transaction, which is valid only while that replica can't be modified.
+     */
+    bool innerGetPointer(const Slice& key, const char** data, size_t* size) {
+        const uint64_t h = hashOf(key);
+        for (Node* node = bucketAt(bucketOfHash(h)); node != nullptr; node = node->next) {
+            if (node->matches(h, key)) {
+                *data = node->valueData();
+                *size = node->valueSize();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /*
+     * Looks up 'n' keys. For each key, sets found[i] and, if found, a copy of the value in values[i].
+     * Keys are done in groups: first the hashes of all keys of the group and a prefetch of their buckets,
+     * then a prefetch of the first node of each bucket, and only then the comparisons, so that the
+     * cache misses of the different keys overlap instead of being one after the other.
+     */
+    void innerMultiGet(const Slice* keys, size_t n, std::string* values, bool* found) {
+        static const size_t GROUP = 32;
+        uint64_t hashes[GROUP];
+        TM_TYPE<Node*>* lbuckets[GROUP];
+        Node* heads[GROUP];
+        for (size_t g = 0; g < n; g += GROUP) {
+            const size_t gsize = std::min(GROUP, n-g);
+            for (size_t i = 0; i < gsize; i++) {
+                hashes[i] = hashOf(keys[g+i]);
+                lbuckets[i] = std::addressof(bucketAt(bucketOfHash(hashes[i])));
+                prefetch(lbuckets[i]);
+            }
+            for (size_t i = 0; i < gsize; i++) {
+                heads[i] = *lbuckets[i];
+                if (heads[i] != nullptr) prefetch(heads[i]);
+            }
+            for (size_t i = 0; i < gsize; i++) {
+                found[g+i] = false;
+                for (Node* node = heads[i]; node != nullptr; node = node->next) {
+                    if (node->matches(hashes[i], keys[g+i])) {
+                        values[g+i].assign(node->valueData(), node->valueSize());
+                        found[g+i] = true;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    // Bucket of 'key', in [0, capacity)
+    long getBucket(const Slice& key) {
+        return bucketOfHash(hashOf(key));
+    }
+
+    TM_TYPE<Node*>& bucketAt(long bucket) {
+        TM_TYPE<Node*>* segment = directory[bucket >> SEGMENT_BITS];
+        return segment[bucket & (SEGMENT_SIZE-1)];
+    }
+
+private:
+    // The low bits of the hash are used as a bucket number, Hash64() mixes all the bits of the key into them
+    static uint64_t hashOf(const Slice& key) {
+        return Hash64(key.data(), key.size());
+    }
+
+    // Returns the node of the key in 'bucket', or nullptr, and sets 'prev' to the node before it (or to the last
+    // node of the bucket), nullptr if there is none
+    Node* findNode(TM_TYPE<Node*>& bucket, uint64_t h, const Slice& key, Node** prev) {
+        *prev = nullptr;
+        Node* node = bucket;
+        while (node != nullptr && !node->matches(h, key)) {
+            *prev = node;
+            node = node->next;
+        }
+        return node;
+    }
+
+    void insertNode(TM_TYPE<Node*>& bucket, Node* prev, uint64_t h, const Slice& key, const Slice& value) {
+        Node* newnode = newNode(h, key, value);
+        if (prev == nullptr) {
+            bucket = newnode;
+        } else {
+            prev->next = newnode;
+        }
+        sizeHM++;
+        if (sizeHM > (long)(capacity*loadFactor)) splitBucket();
+    }
+
+    // Overwrites the value in place if it has the same size and is inline, otherwise replaces the node
+    void replaceValue(TM_TYPE<Node*>& bucket, Node* prev, Node* node, const Slice& key, const Slice& value) {
+        if (value.size() > MAX_INLINE_VALUE) {
+            setOutValue(node, value);
+        } else if (node->outValue.pload() == nullptr && node->valueSize() == value.size()) {
+            writePaddedBytes(node+1, key, value);
+        } else {
+            // Does not fit in the node, replace the node
+            Node* newnode = newNode(node->hash, key, value);
+            newnode->next = node->next.pload();
+            if (prev == nullptr) {
+                bucket = newnode;
+            } else {
+                prev->next = newnode;
+            }
+            deleteNode(node);
+        }
+    }
+
+    long bucketOfHash(uint64_t h) {
+        const long lmask = mask;
+        long bucket = h & lmask;
+        if (bucket < split) bucket = h & (2*lmask+1);
+        return bucket;
+    }
+
+    void init(long cap) {
+        const long numSegments = cap >> SEGMENT_BITS;
+        directory = (TM_TYPE<TM_TYPE<Node*>*>*)TM_PMALLOC(numSegments*sizeof(TM_TYPE<TM_TYPE<Node*>*>));
+        assert(directory != nullptr);
+        for (long i = 0; i < numSegments; i++) directory[i] = newSegment();
+        dirSize = numSegments;
+        capacity = cap;
+        mask = cap-1;
+    }
+
+    void destroy() {
+        const long lcapacity = capacity;
+        for (long i = 0; i < lcapacity; i++) {
+            Node* node = bucketAt(i);
+            while (node != nullptr) {
+                Node* next = node->next;
+                deleteNode(node);
+                node = next;
+            }
+        }
+        for (long i = 0; i < (lcapacity + SEGMENT_SIZE-1) >> SEGMENT_BITS; i++) TM_PFREE(directory[i]);
+        TM_PFREE(directory);
+    }
+
+    static TM_TYPE<Node*>* newSegment() {
+        TM_TYPE<Node*>* segment = (TM_TYPE<Node*>*)TM_PMALLOC(SEGMENT_SIZE*sizeof(TM_TYPE<Node*>));
+        assert(segment != nullptr);
+        for (long i = 0; i < SEGMENT_SIZE; i++) segment[i] = nullptr;
+        return segment;
+    }
+
+    /*
+     * Adds one bucket at the end and moves to it the nodes of bucket 'split' that belong there.
+     * The nodes keep their relative order and only the links that change are written.
+     */
+    void splitBucket() {
+        const long lmask = mask;
+        const long from = split;
+        const long to = from + lmask + 1;
+        if ((to & (SEGMENT_SIZE-1)) == 0) {
+            const long seg = to >> SEGMENT_BITS;
+            const long ldirSize = dirSize;
+            if (seg == ldirSize) {
+                TM_TYPE<TM_TYPE<Node*>*>* newdir = (TM_TYPE<TM_TYPE<Node*>*>*)TM_PMALLOC(2*ldirSize*sizeof(TM_TYPE<TM_TYPE<Node*>*>));
+                assert(newdir != nullptr);
+                for (long i = 0; i < ldirSize; i++) newdir[i] = directory[i];
+                TM_PFREE(directory);
+                directory = newdir;
+                dirSize = 2*ldirSize;
+            }
+            directory[seg] = newSegment();
+        }
+        TM_TYPE<Node*>* keepLink = std::addressof(bucketAt(from));
+        TM_TYPE<Node*>* moveLink = std::addressof(bucketAt(to));
+        Node* node = *keepLink;
+        while (node != nullptr) {
+            TM_TYPE<Node*>*& link = (node->hash.pload() & (2*lmask+1)) == (uint64_t)from ? keepLink : moveLink;
+            if (*link != node) *link = node;
+            link = std::addressof(node->next);
+            node = node->next;
+        }
+        if (*keepLink != nullptr) *keepLink = nullptr;
+        if (*moveLink != nullptr) *moveLink = nullptr;
+        capacity = to+1;
+        if (from == lmask) {
+            mask = 2*lmask+1;
+            split = 0;
+        } else {
+            split = from+1;
+        }
+    }
+
+
+    static inline const char* replica(const char* addr) {
+        return addr + replicaOffset();
+    }
+
+    // Prefetches the copy of 'addr' that the current transaction is reading
+    static inline void prefetch(const void* addr) {
+        __builtin_prefetch((const uint8_t*)addr + replicaOffset());
+    }
+
+    static Node* newNode(uint64_t h, const Slice& key, const Slice& value) {
+        assert(key.size() <= 0xFFFFFFFFULL && value.size() <= 0xFFFFFFFFULL);
+        const bool inlineValue = value.size() <= MAX_INLINE_VALUE;
+        const size_t payload = roundToWord(key.size() + (inlineValue ? value.size() : 0));
+        void* addr = TM_PMALLOC(sizeof(Node) + payload);
+        assert(addr != nullptr);
+        Node* node = new (addr) Node(h, key.size(), value.size());
+        if (inlineValue) {
+            writePaddedBytes(node+1, key, value);
+        } else {
+            writePaddedBytes(node+1, key, Slice());
+            setOutValue(node, value);
+        }
+        return node;
+    }
+
+    // Puts 'value' out of the node, in an allocation of its own. The current one is reused if it has the same size.
+    static void setOutValue(Node* node, const Slice& value) {
+        char* old = node->outValue.pload();
+        if (old != nullptr && roundToWord(node->valueSize()) == roundToWord(value.size())) {
+            writePaddedBytes(old, value, Slice());
+        } else {
+            if (old != nullptr) TM_PFREE(old);
+            char* out = (char*)TM_PMALLOC(roundToWord(value.size()));
+            assert(out != nullptr);
+            writePaddedBytes(out, value, Slice());
+            node->outValue = out;
+        }
+        if (node->valueSize() != value.size()) node->sizes = node->keySize() | ((uint64_t)value.size() << 32);
+    }
+
+    static void deleteNode(Node* node) {
+        char* out = node->outValue.pload();
+        if (out != nullptr) TM_PFREE(out);
+        node->~Node();
+        TM_PFREE(node);
     }
 };
 
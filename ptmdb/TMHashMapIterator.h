@@ -15,180 +15,235 @@
 #ifndef _TM_HASHMAP_ITERATOR_H_
 #define _TM_HASHMAP_ITERATOR_H_
 
+#include <algorithm>
+#include <climits>
+#include <string>
+#include <utility>
+#include <vector>
 #include "slice.h"
 #include "status.h"
 #include "iterator.h"
+#include "snapshot.h"
+#include "TMHashMap.hpp"
 
 namespace ptmdb {
 
 
+// Iterator over the hash index, in the order of the buckets. The entries
+// are copied in chunks, each chunk in one read transaction on the snapshot
+// of the iterator, so the iterator never follows node pointers outside of a
+// transaction. The position between chunks is the bucket and the key of the
+// last entry (of the first one, going backward), and a chunk stops early after
+// scanning MAX_SCAN buckets so that the empty buckets of a large table don't
+// make a long transaction.
+// The first chunk after a Seek is small, for short scans, and the size of the
+// chunks doubles up to MAX_CHUNK while the scan goes on, in both directions.
+// Without a pinned snapshot, a bucket split done by another thread between
+// two chunks may move keys that were already returned to a later bucket, so
+// such a scan can return a key more than once.
 class TMHashMapIterator : public Iterator {
  public:
-  TMHashMap* db_hashmap = nullptr;
-  // The state of the iterator is kept in the 'bucket' and 'node'
-  long bucket = -1;
-  TMHashMap::Node* node = nullptr;
-
-  TMHashMapIterator(TMHashMap* db_hashmap) : db_hashmap{db_hashmap} {
+  // Uses 'snapshot' if it is not nullptr, otherwise takes a snapshot of its own
+  TMHashMapIterator(TMHashMap* db_hashmap, const Snapshot* snapshot) : db_hashmap{db_hashmap} {
+      if (snapshot == nullptr) {
+          ownSnapshot = new SnapshotImpl();
+          snap = ownSnapshot;
+      } else {
+          snap = static_cast<const SnapshotImpl*>(snapshot);
+      }
   };
 
   ~TMHashMapIterator() {
+      delete ownSnapshot;
   }
 
-  // An iterator is either positioned at a key/value pair, or
-  // not valid.  This method returns true iff the iterator is valid.
-  bool Valid() const{
-      if(bucket==-1) return false;
-      return true;
+  bool Valid() const {
+      return pos < entries.size();
   }
 
-  // Position at the first key in the source.  The iterator is Valid()
-  // after this call iff the source is not empty.
-  void SeekToFirst(){
-      if(db_hashmap->sizeHM.pload()==0){
-          bucket = -1;
-          return;
-      }
-      for(int i=0;i< db_hashmap->capacity;i++){
-          if(db_hashmap->buckets[i]!=nullptr){
-              bucket = i;
-              node = db_hashmap->buckets[i];
-              return;
-          }
-      }
+  void SeekToFirst() {
+      chunk = MIN_CHUNK;
+      fillForward(0, nullptr);
   }
 
-  // Position at the last key in the source.  The iterator is
-  // Valid() after this call iff the source is not empty.
-  void SeekToLast(){
-      if(db_hashmap->sizeHM.pload()==0){
-          bucket = -1;
-          return;
-      }
-      for(int i=db_hashmap->capacity-1; i >= 0; i--){
-        if(db_hashmap->buckets[i]!=nullptr){
-            bucket = i;
-            TMHashMap::Node* nodeLast = db_hashmap->buckets[i];
-            while(nodeLast!=nullptr){
-                if(nodeLast->next==nullptr){
-                    node = nodeLast;
-                    return;
-                }
-                nodeLast = nodeLast->next;
-            }
-        }
-      }
+  void SeekToLast() {
+      chunk = MIN_CHUNK;
+      fillBackward(LAST_BUCKET, nullptr);
   }
 
-  // Position at the first key in the source that is at or past target.
-  // The iterator is Valid() after this call iff the source contains
-  // an entry that comes at or past target.
-  void Seek(const Slice& target){
-      if(db_hashmap->sizeHM.pload()==0){
-          bucket = -1;
-          return;
-      }
-      auto h = db_hashmap->getBucket(target);
-      TMHashMap::Node* nodeSeek = db_hashmap->buckets[h];
-      TMHashMap::Node* prev = nodeSeek;
-      while(nodeSeek!=nullptr){
-          if(nodeSeek->key == target){
-              bucket = h;
-              node = nodeSeek;
-              return;
+  // The iterator goes over the keys in hash order, where a missing key has no position.
+  // If 'target' is present the iterator is positioned at it, otherwise at the first key
+  // of the buckets after the bucket of 'target'.
+  void Seek(const Slice& target) {
+      chunk = MIN_CHUNK;
+      const std::string key = target.ToString();
+      long bucket = 0;
+      bool found = false;
+      snapshotReadTx(snap, [&] () {
+          bucket = db_hashmap->getBucket(Slice(key));
+          found = false;
+          for (TMHashMap::Node* node = db_hashmap->bucketAt(bucket); node != nullptr; node = node->next) {
+              if (node->keyEquals(Slice(key))) {
+                  found = true;
+                  break;
+              }
           }
-          prev = nodeSeek;
-          nodeSeek = nodeSeek->next;
-      }
-      if(prev == nullptr) {
-          bucket = -1;
-          return;
+      });
+      if (found) {
+          fillForward(bucket, &key, true);
+      } else {
+          fillForward(bucket+1, nullptr);
       }
-      bucket = h;
-      node = prev;
-  }
-
-  // Moves to the next entry in the source.  After this call, Valid() is
-  // true iff the iterator was not positioned at the last entry in the source.
-  // REQUIRES: Valid()
-  void Next(){
-      if(bucket == -1) return;
-      TMHashMap::Node* next = node->next;
-      if(next!=nullptr){
-          node = next;
+  }
+
+  void Next() {
+      if (!Valid()) return;
+      pos++;
+      if (pos < entries.size()) return;
+      const std::string after = std::move(entries.back().first);
+      if (chunk < MAX_CHUNK) chunk *= 2;
+      fillForward(entryBuckets.back(), &after);
+  }
+
+  void Prev() {
+      if (!Valid()) return;
+      if (pos > 0) {
+          pos--;
           return;
       }
-      const int cap = db_hashmap->capacity;
-      for(int i=bucket+1; i<cap ;i++){
-          next = db_hashmap->buckets[i];
-          if(next!=nullptr){
-              bucket = i;
-              node = next;
-              return;
-          }
-      }
-      bucket = -1;
-  }
-
-  // Moves to the previous entry in the source.  After this call, Valid() is
-  // true iff the iterator was not positioned at the first entry in source.
-  // REQUIRES: Valid()
-  void Prev(){
-      if(bucket == -1) return;
-      TMHashMap::Node* nodeAt = db_hashmap->buckets[bucket];
-      if(node==nodeAt){
-          while(true){
-              bucket--;
-              if(bucket==-1) return;
-              nodeAt = db_hashmap->buckets[bucket];
-              if(nodeAt!=nullptr)break;
-          }
-          while(true){
-              if(nodeAt->next==nullptr){
-                  node = nodeAt;
-                  return;
-              }
-              nodeAt = nodeAt->next;
-          }
+      const std::string before = std::move(entries[pos].first);
+      if (chunk < MAX_CHUNK) chunk *= 2;
+      fillBackward(entryBuckets[pos], &before);
+  }
+
+  Slice key() const {
+      return Slice(entries[pos].first);
+  }
+
+  Slice value() const {
+      return Slice(entries[pos].second);
+  }
+
+  Status status() const {
+      return Status{};
+  }
+
+ private:
+  static const size_t MIN_CHUNK = 8;
+  static const size_t MAX_CHUNK = 256;
+  static const long MAX_SCAN = 64*1024;
+  // Bucket of fillBackward() for the last bucket of the table, whose capacity is read in the transaction
+  static const long LAST_BUCKET = LONG_MAX;
+
+  TMHashMap* db_hashmap = nullptr;
+  const SnapshotImpl* snap = nullptr;
+  SnapshotImpl* ownSnapshot = nullptr;
+  // Copies of the entries of the current chunk and their buckets, the iterator is at entries[pos]
+  std::vector<std::pair<std::string,std::string>> entries;
+  std::vector<long> entryBuckets;
+  size_t pos = 0;
+  size_t chunk = MIN_CHUNK;
+
+  // Loads the chunk that starts in 'bucket' after the key 'after' (or at it, if 'inclusive'),
+  // or at the start of 'bucket' if 'after' is nullptr. Keeps going while the chunks are empty.
+  void fillForward(long bucket, const std::string* after, bool inclusive = false) {
+      long nextBucket = bucket;
+      while (true) {
+          snapshotReadTx(snap, [&] () {
+              nextBucket = loadForward(bucket, after, inclusive);
+          });
+          if (!entries.empty() || nextBucket < 0) return;
+          bucket = nextBucket;
+          after = nullptr;
       }
-      while(nodeAt!=node){
-          if(nodeAt->next==node){
-              node = nodeAt;
+  }
+
+  // Loads the chunk that ends in 'bucket' before the key 'before', or at the end of 'bucket' if 'before'
+  // is nullptr. Keeps going while the chunks are empty. The iterator is at the last entry of the chunk.
+  void fillBackward(long bucket, const std::string* before) {
+      long nextBucket = bucket;
+      while (true) {
+          snapshotReadTx(snap, [&] () {
+              nextBucket = loadBackward(bucket, before);
+          });
+          if (!entries.empty()) {
+              pos = entries.size()-1;
               return;
           }
-          nodeAt = nodeAt->next;
+          if (nextBucket < 0) return;
+          bucket = nextBucket;
+          before = nullptr;
       }
   }
 
-  // Return the key for the current entry.  The underlying storage for
-  // the returned slice is valid only until the next modification of
-  // the iterator.
-  // REQUIRES: Valid()
-  Slice key() const{
-      return node->key.data();
+  void clear() {
+      entries.clear();
+      entryBuckets.clear();
+      pos = 0;
   }
 
-  // Return the value for the current entry.  The underlying storage for
-  // the returned slice is valid only until the next modification of
-  // the iterator.
-  // REQUIRES: Valid()
-  Slice value() const{
-      return node->val.data();
+  void add(TMHashMap::Node* node, long bucket) {
+      entries.emplace_back(std::string(node->keyData(), node->keySize()),
+                           std::string(node->valueData(), node->valueSize()));
+      entryBuckets.push_back(bucket);
   }
 
-  // If an error has occurred, return it.  Else return an ok status.
-  Status status() const{
-      return Status{};
+  // Called inside a read transaction, which may be executed more than once.
+  // Returns the bucket where the scan stopped, or -1 if it reached the end of the table.
+  long loadForward(long bucket, const std::string* after, bool inclusive) {
+      clear();
+      const long capacity = db_hashmap->capacity;
+      TMHashMap::Node* node = nullptr;
+      if (bucket < capacity) {
+          node = db_hashmap->bucketAt(bucket);
+          if (after != nullptr) {
+              // If the key was removed there is no way to know where it was, skip the rest of the bucket
+              while (node != nullptr && !node->keyEquals(Slice(*after))) node = node->next;
+              if (node != nullptr && !inclusive) node = node->next;
+          }
+      }
+      long scanned = 0;
+      while (entries.size() < chunk) {
+          while (node == nullptr) {
+              if (++bucket >= capacity) return -1;
+              if (++scanned >= MAX_SCAN) return bucket;
+              node = db_hashmap->bucketAt(bucket);
+          }
+          add(node, bucket);
+          node = node->next;
+      }
+      return bucket;
   }
 
-  // Clients are allowed to register function/arg1/arg2 triples that
-  // will be invoked when this iterator is destroyed.
-  //
-  // Note that unlike all of the preceding methods, this method is
-  // not abstract and therefore clients should not override it.
-  //typedef void (*CleanupFunction)(void* arg1, void* arg2);
-  void RegisterCleanup(CleanupFunction function, void* arg1, void* arg2){
-
+  // Called inside a read transaction, like loadForward(). The chunk has the whole buckets before 'bucket',
+  // and the entries of 'bucket' before the key 'before' (all of them if 'before' is nullptr), so it can be
+  // a little larger than 'chunk'. Returns the bucket where the next chunk ends, or -1 if the scan reached
+  // the start of the table.
+  long loadBackward(long bucket, const std::string* before) {
+      clear();
+      if (bucket >= db_hashmap->capacity) bucket = db_hashmap->capacity-1;
+      std::vector<TMHashMap::Node*> nodes;
+      long scanned = 0;
+      while (entries.size() < chunk && bucket >= 0 && scanned++ < MAX_SCAN) {
+          nodes.clear();
+          bool found = false;
+          for (TMHashMap::Node* node = db_hashmap->bucketAt(bucket); node != nullptr; node = node->next) {
+              if (before != nullptr && node->keyEquals(Slice(*before))) {
+                  found = true;
+                  break;
+              }
+              nodes.push_back(node);
+          }
+          // If the key was removed there is no way to know where it was, skip the rest of the bucket
+          if (before != nullptr && !found) nodes.clear();
+          before = nullptr;
+          // The entries are added in reverse order, and the chunk is reversed at the end
+          for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) add(*it, bucket);
+          bucket--;
+      }
+      std::reverse(entries.begin(), entries.end());
+      std::reverse(entryBuckets.begin(), entryBuckets.end());
+      return bucket;
   }
 
   // No copying allowed
@@ -0,0 +1,282 @@
+#ifndef _TM_SKIPLIST_MAP_H_
+#define _TM_SKIPLIST_MAP_H_
+
+#include <memory>
+#include <new>
+#include <string>
+
+#include "ptmdb.h"
+#include "slice.h"
+#include "comparator.h"
+#include "merge_operator.h"
+
+namespace ptmdb {
+
+/**
+ * <h1> An ordered Map (Skip List) for usage in CX-Redo </h1>
+ *
+ * Keys are kept in the order of the Comparator passed to each method. The comparator is not stored in the
+ * map because the map is in persistent memory, so all the calls on the same map must use the same comparator.
+ *
+ * The level of a node is derived from the hash of its key and not from a random number generator.
+ * Some PTMs execute the same transaction more than once (on each replica, or again after a failed attempt)
+ * and each execution must do exactly the same modifications.
+ *
+ * All methods must be called inside a transaction.
+ */
+class TMSkipListMap {
+public:
+    static const int MAX_LEVEL = 16;
+
+    struct Node {
+        PSlice              key;  // Immutable after node creation, so no need for persist<PSlice>
+        PSlice              val;  // Mutates only when put() replaces the key
+        TM_TYPE<Node*>      next[1];  // Has one entry per level of the node, allocated with the node
+        Node(const int levels, const Slice& k, const Slice& v) : key{k}, val{v} {
+            for (int i = 0; i < levels; i++) next[i] = nullptr;
+        }
+    };
+
+    TM_TYPE<long>       sizeSL {0};
+    TM_TYPE<long>       level {1};             // Number of levels in use
+    TM_TYPE<Node*>      head[MAX_LEVEL];
+
+
+public:
+    TMSkipListMap() {
+        for (int i = 0; i < MAX_LEVEL; i++) head[i] = nullptr;
+    }
+
+
+    ~TMSkipListMap() {
+        Node* node = head[0];
+        while (node != nullptr) {
+            Node* next = node->next[0];
+            deleteNode(node);
+            node = next;
+        }
+    }
+
+
+    std::string className() { return TM_NAME() + "-SkipListMap"; }
+
+
+    /*
+     * Adds a node with a key if the key is not present, otherwise replaces the value.
+     *
+     * Returns true if there was no mapping for the key, false if there was already a value and it was replaced.
+     */
+    bool innerPut(const Slice& key, const Slice& value, const Comparator* cmp) {
+        TM_TYPE<Node*>* prevs[MAX_LEVEL];
+        Node* node = findLinks(key, cmp, prevs);
+        if (node != nullptr && cmp->Compare(toSlice(node->key), key) == 0) {
+            node->val = value;
+            return false; // Replace value for existing key
+        }
+        insertNode(key, value, prevs);
+        return true;  // New insertion
+    }
+
+
+    /*
+     * Sets the value of the key to the result of 'mergeOp' on its current value (if any) and 'operand',
+     * with a single search of the key.
+     *
+     * Returns false if the merge operator failed, in which case nothing is modified.
+     */
+    bool innerMerge(const Slice& key, const Slice& operand, const MergeOperator* mergeOp, const Comparator* cmp) {
+        TM_TYPE<Node*>* prevs[MAX_LEVEL];
+        Node* node = findLinks(key, cmp, prevs);
+        std::string newValue;
+        if (node != nullptr && cmp->Compare(toSlice(node->key), key) == 0) {
+            const Slice oldValue(node->val.data(), node->val.size());
+            if (!mergeOp->Merge(key, &oldValue, operand, &newValue)) return false;
+            node->val = Slice(newValue);
+            return true;
+        }
+        if (!mergeOp->Merge(key, nullptr, operand, &newValue)) return false;
+        insertNode(key, Slice(newValue), prevs);
+        return true;
+    }
+
+
+    /*
+     * Removes a key and its mapping.
+     *
+     * Returns returns true if a matching key was found
+     */
+    bool innerRemove(const Slice& key, const Comparator* cmp) {
+        TM_TYPE<Node*>* prevs[MAX_LEVEL];
+        Node* node = findLinks(key, cmp, prevs);
+        if (node == nullptr || cmp->Compare(toSlice(node->key), key) != 0) return false;
+        const long curLevel = level;
+        for (int i = 0; i < curLevel; i++) {
+            if (*prevs[i] != node) break;
+            *prevs[i] = node->next[i];
+        }
+        deleteNode(node);
+        long newLevel = curLevel;
+        while (newLevel > 1 && head[newLevel-1] == nullptr) newLevel--;
+        if (newLevel != curLevel) level = newLevel;
+        sizeSL--;
+        return true;
+    }
+
+
+    /*
+     * Returns true if key is present. Saves a copy of 'value' in 'oldValue'.
+     */
+    bool innerGet(const Slice& key, std::string* oldValue, const Comparator* cmp) {
+        Node* node = lowerBound(key, cmp);
+        if (node == nullptr || cmp->Compare(toSlice(node->key), key) != 0) return false;
+        oldValue->assign(node->val.data(), node->val.size());  // Makes a copy of V
+        return true;
+    }
+
+
+    /*
+     * Returns true if key is present, and sets 'data' and 'size' to the value in the replica read by the
+     * current transaction, which is valid only while that replica can't be modified.
+     */
+    bool innerGetPointer(const Slice& key, const char** data, size_t* size, const Comparator* cmp) {
+        Node* node = lowerBound(key, cmp);
+        if (node == nullptr || cmp->Compare(toSlice(node->key), key) != 0) return false;
+        *data = node->val.data();
+        *size = node->val.size();
+        return true;
+    }
+
+    /*
+     * Looks up 'n' keys. For each key, sets found[i] and, if found, a copy of the value in values[i].
+     */
+    void innerMultiGet(const Slice* keys, size_t n, std::string* values, bool* found, const Comparator* cmp) {
+        for (size_t i = 0; i < n; i++) found[i] = innerGet(keys[i], &values[i], cmp);
+    }
+
+
+    // First node of the map, nullptr if the map is empty
+    Node* first() {
+        return head[0];
+    }
+
+    // Last node of the map, nullptr if the map is empty
+    Node* last() {
+        TM_TYPE<Node*>* links = head;
+        Node* lastNode = nullptr;
+        for (int i = level-1; i >= 0; i--) {
+            Node* node = links[i];
+            while (node != nullptr) {
+                lastNode = node;
+                links = node->next;
+                node = links[i];
+            }
+        }
+        return lastNode;
+    }
+
+    // First node with a key equal or greater than 'key', nullptr if there is none
+    Node* lowerBound(const Slice& key, const Comparator* cmp) {
+        TM_TYPE<Node*>* links = head;
+        Node* node = nullptr;
+        for (int i = level-1; i >= 0; i--) {
+            node = links[i];
+            while (node != nullptr && cmp->Compare(toSlice(node->key), key) < 0) {
+                links = node->next;
+                node = links[i];
+            }
+        }
+        return node;
+    }
+
+    // First node with a key greater than 'key', nullptr if there is none
+    Node* upperBound(const Slice& key, const Comparator* cmp) {
+        Node* node = lowerBound(key, cmp);
+        if (node != nullptr && cmp->Compare(toSlice(node->key), key) == 0) node = node->next[0];
+        return node;
+    }
+
+    // Last node with a key smaller than 'key', nullptr if there is none
+    Node* lessThan(const Slice& key, const Comparator* cmp) {
+        TM_TYPE<Node*>* links = head;
+        Node* prev = nullptr;
+        for (int i = level-1; i >= 0; i--) {
+            Node* node = links[i];
+            while (node != nullptr && cmp->Compare(toSlice(node->key), key) < 0) {
+                prev = node;
+                links = node->next;
+                node = links[i];
+            }
+        }
+        return prev;
+    }
+
+    static Slice toSlice(const PSlice& psl) {
+        return Slice(psl.data(), psl.size());
+    }
+
+private:
+    /*
+     * Fills prevs[i] with the link at level i that points to the first node with a key equal or greater
+     * than 'key', for each level in use. Returns that node at level 0, or nullptr if there is none.
+     */
+    Node* findLinks(const Slice& key, const Comparator* cmp, TM_TYPE<Node*>** prevs) {
+        TM_TYPE<Node*>* links = head;
+        Node* node = nullptr;
+        for (int i = level-1; i >= 0; i--) {
+            node = links[i];
+            while (node != nullptr && cmp->Compare(toSlice(node->key), key) < 0) {
+                links = node->next;
+                node = links[i];
+            }
+            prevs[i] = std::addressof(links[i]);
+        }
+        return node;
+    }
+
+    // Inserts a node for a key that is not in the map, 'prevs' are the links filled by findLinks()
+    void insertNode(const Slice& key, const Slice& value, TM_TYPE<Node*>** prevs) {
+        const int lvl = levelOf(key);
+        const long curLevel = level;
+        if (lvl > curLevel) {
+            for (int i = curLevel; i < lvl; i++) prevs[i] = std::addressof(head[i]);
+            level = lvl;
+        }
+        Node* newnode = newNode(lvl, key, value);
+        for (int i = 0; i < lvl; i++) {
+            newnode->next[i] = *prevs[i];
+            *prevs[i] = newnode;
+        }
+        sizeSL++;
+    }
+
+    // Level of a node is 1 + the number of times the (mixed) hash of the key ends with two zero bits
+    static int levelOf(const Slice& key) {
+        uint64_t h = key.toHash();
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        int lvl = 1;
+        while (lvl < MAX_LEVEL && (h & 3) == 0) {
+            lvl++;
+            h >>= 2;
+        }
+        return lvl;
+    }
+
+    static Node* newNode(const int levels, const Slice& key, const Slice& value) {
+        void* addr = TM_PMALLOC(sizeof(Node) + (levels-1)*sizeof(TM_TYPE<Node*>));
+        assert(addr != nullptr);
+        return new (addr) Node(levels, key, value);
+    }
+
+    static void deleteNode(Node* node) {
+        node->~Node();
+        TM_PFREE(node);
+    }
+};
+
+} // end of namespace ptmdb
+
+#endif /* _TM_SKIPLIST_MAP_H_ */
@@ -0,0 +1,178 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef _TM_SKIPLIST_MAP_ITERATOR_H_
+#define _TM_SKIPLIST_MAP_ITERATOR_H_
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+#include "slice.h"
+#include "status.h"
+#include "iterator.h"
+#include "comparator.h"
+#include "snapshot.h"
+#include "TMSkipListMap.hpp"
+
+namespace ptmdb {
+
+
+// Iterator over the ordered index (TMSkipListMap). Each positioning method
+// runs in its own read transaction on the snapshot of the iterator and copies
+// the entries it lands on, so the iterator never holds pointers to nodes
+// between calls. Next() resumes after the last key it returned, and Prev()
+// before the first one. If the snapshot is not pinned (see SnapshotImpl), it
+// sees the keys inserted by other threads after (or before) that key.
+//
+// The scans copy the entries in batches, in both directions, starting with a
+// small batch for short (prefix or range) scans and doubling it while the scan
+// goes on.
+class TMSkipListMapIterator : public Iterator {
+ public:
+  // Uses 'snapshot' if it is not nullptr, otherwise takes a snapshot of its own
+  TMSkipListMapIterator(TMSkipListMap* db_skiplist, const Comparator* cmp, const Snapshot* snapshot)
+      : db_skiplist{db_skiplist}, cmp{cmp} {
+      if (snapshot == nullptr) {
+          ownSnapshot = new SnapshotImpl();
+          snap = ownSnapshot;
+      } else {
+          snap = static_cast<const SnapshotImpl*>(snapshot);
+      }
+  };
+
+  ~TMSkipListMapIterator() {
+      delete ownSnapshot;
+  }
+
+  bool Valid() const {
+      return pos < entries.size();
+  }
+
+  void SeekToFirst() {
+      batch = MIN_BATCH;
+      fillForward(nullptr, true);
+  }
+
+  void SeekToLast() {
+      batch = MIN_BATCH;
+      fillBackward(nullptr);
+  }
+
+  void Seek(const Slice& target) {
+      batch = MIN_BATCH;
+      const std::string from = target.ToString();
+      fillForward(&from, true);
+  }
+
+  void Next() {
+      if (!Valid()) return;
+      pos++;
+      if (pos < entries.size()) return;
+      const std::string from = std::move(entries.back().first);
+      if (batch < MAX_BATCH) batch *= 2;
+      fillForward(&from, false);
+  }
+
+  void Prev() {
+      if (!Valid()) return;
+      if (pos > 0) {
+          pos--;
+          return;
+      }
+      const std::string before = std::move(entries[pos].first);
+      if (batch < MAX_BATCH) batch *= 2;
+      fillBackward(&before);
+  }
+
+  Slice key() const {
+      return Slice(entries[pos].first);
+  }
+
+  Slice value() const {
+      return Slice(entries[pos].second);
+  }
+
+  Status status() const {
+      return Status{};
+  }
+
+ private:
+  static const size_t MIN_BATCH = 8;
+  static const size_t MAX_BATCH = 256;
+
+  TMSkipListMap* db_skiplist = nullptr;
+  const Comparator* cmp = nullptr;
+  const SnapshotImpl* snap = nullptr;
+  SnapshotImpl* ownSnapshot = nullptr;
+  // Copies of the entries of the current batch, the iterator is at entries[pos]
+  std::vector<std::pair<std::string,std::string>> entries;
+  size_t pos = 0;
+  size_t batch = MIN_BATCH;
+
+  // Loads up to 'batch' entries starting at 'from' (or the first entry, if 'from' is nullptr)
+  void fillForward(const std::string* from, bool inclusive) {
+      snapshotReadTx(snap, [&] () {
+          loadForward(from, inclusive);
+      });
+  }
+
+  // Loads up to 'batch' entries before 'before' (or the last ones, if 'before' is nullptr),
+  // the iterator is at the last of them
+  void fillBackward(const std::string* before) {
+      snapshotReadTx(snap, [&] () {
+          loadBackward(before);
+      });
+  }
+
+  void add(TMSkipListMap::Node* node) {
+      entries.emplace_back(std::string(node->key.data(), node->key.size()),
+                           std::string(node->val.data(), node->val.size()));
+  }
+
+  // Called inside a read transaction, which may be executed more than once
+  void loadForward(const std::string* from, bool inclusive) {
+      entries.clear();
+      pos = 0;
+      TMSkipListMap::Node* node;
+      if (from == nullptr) {
+          node = db_skiplist->first();
+      } else if (inclusive) {
+          node = db_skiplist->lowerBound(Slice(*from), cmp);
+      } else {
+          node = db_skiplist->upperBound(Slice(*from), cmp);
+      }
+      for (size_t i = 0; i < batch && node != nullptr; i++) {
+          add(node);
+          node = node->next[0];
+      }
+  }
+
+  // The nodes have no link to the previous one, each step back is a search from the head
+  void loadBackward(const std::string* before) {
+      entries.clear();
+      pos = 0;
+      TMSkipListMap::Node* node;
+      if (before == nullptr) {
+          node = db_skiplist->last();
+      } else {
+          node = db_skiplist->lessThan(Slice(*before), cmp);
+      }
+      for (size_t i = 0; i < batch && node != nullptr; i++) {
+          add(node);
+          node = db_skiplist->lessThan(TMSkipListMap::toSlice(node->key), cmp);
+      }
+      if (entries.empty()) return;
+      std::reverse(entries.begin(), entries.end());
+      pos = entries.size()-1;
+  }
+
+  // No copying allowed
+  TMSkipListMapIterator(const TMSkipListMapIterator&);
+  void operator=(const TMSkipListMapIterator&);
+};
+
+}  // namespace ptmdb
+
+#endif  // _TM_SKIPLIST_MAP_ITERATOR_H_
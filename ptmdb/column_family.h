@@ -0,0 +1,219 @@
+/*
+ * Copyright 2017-2020
+ *   Andreia Correia <andreia.veiga@unine.ch>
+ *   Pedro Ramalhete <pramalhe@gmail.com>
+ *   Pascal Felber <pascal.felber@unine.ch>
+ *
+ * This work is published under the MIT license. See LICENSE.txt
+ */
+#ifndef _PTMDB_DB_COLUMN_FAMILY_H_
+#define _PTMDB_DB_COLUMN_FAMILY_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include "db.h"
+#include "ptmdb.h"
+#include "slice.h"
+#include "snapshot.h"
+#include "TMHashMap.hpp"
+#include "TMHashMapIterator.h"
+#include "TMSkipListMap.hpp"
+#include "TMSkipListMapIterator.h"
+
+namespace ptmdb {
+
+// Maximum number of column families of a database, including the default one
+static const uint32_t kMaxColumnFamilies = 64;
+
+/*
+ * Persistent list of the column families of a database, other than the default one, in the root
+ * ColumnFamilyCatalog::ROOT. The default column family is in the roots 0 (hash index) and 1 (ordered index),
+ * like the databases without column families.
+ * The family with id 'i' is in entries[i-1]. An entry is free when it has no index, the name of a free
+ * entry is the one of the last family that used it, and it is replaced when the entry is reused.
+ * All methods must be called inside a transaction.
+ */
+struct ColumnFamilyCatalog {
+    static const int ROOT = 2;
+
+    // Results of open() that are not an id
+    static const long FULL = -1;
+    static const long WRONG_INDEX_TYPE = -2;
+
+    struct Entry {
+        PSlice                   name;
+        TM_TYPE<TMHashMap*>      hashMap;
+        TM_TYPE<TMSkipListMap*>  skipList;
+
+        // User-provided so that 'new ColumnFamilyCatalog()' doesn't zero the entries with stores that bypass the PTM
+        Entry() : hashMap{nullptr}, skipList{nullptr} { }
+
+        bool used() const { return hashMap.pload() != nullptr || skipList.pload() != nullptr; }
+    };
+
+    Entry entries[kMaxColumnFamilies-1];
+
+    ColumnFamilyCatalog() { }
+
+    ~ColumnFamilyCatalog() {
+        for (uint32_t id = 1; id < kMaxColumnFamilies; id++) drop(id);
+    }
+
+    // Returns the id of the family 'name', after creating it with a new index if it doesn't exist.
+    // Returns FULL if there is no free entry, and WRONG_INDEX_TYPE if the family has the other index type.
+    long open(const Slice& name, bool ordered, long hashBuckets) {
+        Entry* free = nullptr;
+        for (uint32_t i = 0; i < kMaxColumnFamilies-1; i++) {
+            Entry& entry = entries[i];
+            if (!entry.used()) {
+                if (free == nullptr) free = &entry;
+                continue;
+            }
+            if (entry.name == name) {
+                if ((entry.skipList.pload() != nullptr) != ordered) return WRONG_INDEX_TYPE;
+                return i+1;
+            }
+        }
+        if (free == nullptr) return FULL;
+        free->name = name;
+        if (ordered) {
+            free->skipList = PTM_NEW<TMSkipListMap>();
+        } else {
+            free->hashMap = PTM_NEW<TMHashMap>(hashBuckets);
+        }
+        return (free - entries) + 1;
+    }
+
+    // Deletes the index of the family 'id', which frees its entry
+    void drop(uint32_t id) {
+        Entry& entry = entries[id-1];
+        if (entry.hashMap.pload() != nullptr) {
+            PTM_DELETE(entry.hashMap.pload());
+            entry.hashMap = nullptr;
+        }
+        if (entry.skipList.pload() != nullptr) {
+            PTM_DELETE(entry.skipList.pload());
+            entry.skipList = nullptr;
+        }
+    }
+};
+
+
+/*
+ * A column family of a DBImpl: a set of keys with an index of its own, that can have another index type,
+ * capacity, comparator and merge operator than the other families of the database.
+ * The handles are owned by the DBImpl, the index pointers are set by the DBImpl when the family is opened,
+ * and set back to nullptr when it is dropped: a transaction that still has the handle of a dropped family
+ * sees an empty family, and its updates are ignored.
+ * The methods of the index must be called inside a transaction, except size() and newIterator().
+ */
+class ColumnFamilyImpl : public ColumnFamilyHandle {
+ public:
+    // Only one of the two indexes is used
+    std::atomic<TMHashMap*> hashMap {nullptr};
+    std::atomic<TMSkipListMap*> skipList {nullptr};
+
+    ColumnFamilyImpl(uint32_t id, const std::string& name, const Options& options)
+        : id_{id}, name_{name}, comparator_{options.comparator}, merge_operator_{options.merge_operator},
+          ordered_{options.index_type == kOrderedIndex}, hashBuckets_{(long)options.hash_index_buckets} { }
+
+    ~ColumnFamilyImpl() { }
+
+    const std::string& GetName() const { return name_; }
+    uint32_t GetID() const { return id_; }
+
+    bool ordered() const { return ordered_; }
+    long hashBuckets() const { return hashBuckets_; }
+    const MergeOperator* mergeOperator() const { return merge_operator_; }
+
+    bool put(const Slice& key, const Slice& value) {
+        TMSkipListMap* sl = skipList.load();
+        if (sl != nullptr) return sl->innerPut(key, value, comparator_);
+        TMHashMap* hm = hashMap.load();
+        return hm != nullptr && hm->innerPut(key, value);
+    }
+
+    bool remove(const Slice& key) {
+        TMSkipListMap* sl = skipList.load();
+        if (sl != nullptr) return sl->innerRemove(key, comparator_);
+        TMHashMap* hm = hashMap.load();
+        return hm != nullptr && hm->innerRemove(key);
+    }
+
+    bool merge(const Slice& key, const Slice& operand) {
+        if (merge_operator_ == nullptr) return false;
+        TMSkipListMap* sl = skipList.load();
+        if (sl != nullptr) return sl->innerMerge(key, operand, merge_operator_, comparator_);
+        TMHashMap* hm = hashMap.load();
+        return hm != nullptr && hm->innerMerge(key, operand, merge_operator_);
+    }
+
+    bool get(const Slice& key, std::string* value) {
+        TMSkipListMap* sl = skipList.load();
+        if (sl != nullptr) return sl->innerGet(key, value, comparator_);
+        TMHashMap* hm = hashMap.load();
+        return hm != nullptr && hm->innerGet(key, value);
+    }
+
+    bool getPointer(const Slice& key, const char** data, size_t* size) {
+        TMSkipListMap* sl = skipList.load();
+        if (sl != nullptr) return sl->innerGetPointer(key, data, size, comparator_);
+        TMHashMap* hm = hashMap.load();
+        return hm != nullptr && hm->innerGetPointer(key, data, size);
+    }
+
+    void multiGet(const Slice* keys, size_t n, std::string* values, bool* found) {
+        TMSkipListMap* sl = skipList.load();
+        TMHashMap* hm = hashMap.load();
+        if (sl != nullptr) {
+            sl->innerMultiGet(keys, n, values, found, comparator_);
+        } else if (hm != nullptr) {
+            hm->innerMultiGet(keys, n, values, found);
+        } else {
+            for (size_t i = 0; i < n; i++) found[i] = false;
+        }
+    }
+
+    // In a read transaction of its own: outside of one, the counter is the value in the main replica, which can
+    // be behind the last committed transaction
+    long size() {
+        long n = 0;
+        snapshotReadTx(nullptr, [&] () {
+            TMSkipListMap* sl = skipList.load();
+            TMHashMap* hm = hashMap.load();
+            if (sl != nullptr) {
+                n = sl->sizeSL;
+            } else if (hm != nullptr) {
+                n = hm->sizeHM;
+            }
+        });
+        return n;
+    }
+
+    // Not in a transaction, the iterator does its own transactions. The iterators of a family must be deleted
+    // before the family is dropped.
+    Iterator* newIterator(const Snapshot* snapshot) {
+        TMSkipListMap* sl = skipList.load();
+        if (sl != nullptr) return new TMSkipListMapIterator(sl, comparator_, snapshot);
+        TMHashMap* hm = hashMap.load();
+        if (hm != nullptr) return new TMHashMapIterator(hm, snapshot);
+        return NewErrorIterator(Status::InvalidArgument("column family is not open"));
+    }
+
+ private:
+    const uint32_t id_;
+    const std::string name_;
+    const Comparator* const comparator_;
+    const MergeOperator* const merge_operator_;
+    const bool ordered_;
+    const long hashBuckets_;
+
+    // No copying allowed
+    ColumnFamilyImpl(const ColumnFamilyImpl&);
+    void operator=(const ColumnFamilyImpl&);
+};
+
+}  // namespace ptmdb
+
+#endif  // _PTMDB_DB_COLUMN_FAMILY_H_
@@ -0,0 +1,200 @@
+/*
+ * Copyright 2017-2020
+ *   Andreia Correia <andreia.veiga@unine.ch>
+ *   Pedro Ramalhete <pramalhe@gmail.com>
+ *   Pascal Felber <pascal.felber@unine.ch>
+ *
+ * This work is published under the MIT license. See LICENSE.txt
+ */
+#ifndef _PHASE_PROFILER_H_
+#define _PHASE_PROFILER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include "pfences.h"     // asm_rdtsc() and cpuCyclesPerNs()
+
+/**
+ * <h1> Phase Profiler </h1>
+ *
+ * Measures the time spent in each phase of a PTM (copy, flush, apply of the redo logs, etc) with rdtsc.
+ * It is meant to be always on, so that the breakdown can be looked at on a live system.
+ *
+ * Each thread has its own slot with, for each phase, the number of calls, the sum of the cycles, and a
+ * histogram of the latencies with one bucket per power of two of cycles. A slot is written only by its
+ * own thread, with a relaxed load and store, which means there are no locked instructions when timing.
+ * snapshot() sums the slots of all threads and can be called at any time by any thread.
+ * reset() does not write on the slots (that would race with the owners), it saves the current totals,
+ * and the next snapshots are taken relative to them.
+ *
+ * Usage:
+ *   {
+ *       PhaseProfiler<...>::Timer timer {profiler, tid, PHASE_COPY};
+ *       ... // code of the phase
+ *   }
+ * or start() and stop() when the phase doesn't match a scope.
+ */
+template<int NUM_PHASES, int MAX_THREADS>
+class PhaseProfiler {
+
+public:
+    // Bucket i has the latencies in [2^i, 2^(i+1)) cycles, the last one has everything above
+    static const int NUM_BUCKETS = 40;
+
+    struct PhaseStats {
+        uint64_t calls {0};
+        uint64_t cycles {0};
+        uint64_t buckets[NUM_BUCKETS] {};
+
+        double avgNs() const {
+            if (calls == 0) return 0;
+            return cycles / cpuCyclesPerNs() / calls;
+        }
+
+        // Upper bound of the bucket that has the percentile 'p' (between 0 and 1), in nanoseconds
+        double percentileNs(double p) const {
+            if (calls == 0) return 0;
+            const uint64_t target = (uint64_t)(p * calls);
+            uint64_t sum = 0;
+            for (int i = 0; i < NUM_BUCKETS; i++) {
+                sum += buckets[i];
+                if (sum > target) return (double)(2ULL << i) / cpuCyclesPerNs();
+            }
+            return (double)(2ULL << (NUM_BUCKETS-1)) / cpuCyclesPerNs();
+        }
+    };
+
+    struct Snapshot {
+        PhaseStats phases[NUM_PHASES];
+
+        // One line per phase that was called at least once
+        std::string toString(const char* const names[]) const {
+            std::string s;
+            char buf[256];
+            snprintf(buf, sizeof(buf), "%-20s %12s %14s %10s %10s %10s %10s\n",
+                     "phase", "calls", "total(ms)", "avg(ns)", "p50(ns)", "p99(ns)", "p99.9(ns)");
+            s += buf;
+            for (int i = 0; i < NUM_PHASES; i++) {
+                const PhaseStats& ps = phases[i];
+                if (ps.calls == 0) continue;
+                snprintf(buf, sizeof(buf), "%-20s %12llu %14.3f %10.0f %10.0f %10.0f %10.0f\n",
+                         names[i], (unsigned long long)ps.calls, ps.cycles / cpuCyclesPerNs() / 1000000,
+                         ps.avgNs(), ps.percentileNs(0.5), ps.percentileNs(0.99), ps.percentileNs(0.999));
+                s += buf;
+            }
+            return s;
+        }
+    };
+
+private:
+    struct PhaseCounters {
+        std::atomic<uint64_t> calls {0};
+        std::atomic<uint64_t> cycles {0};
+        std::atomic<uint64_t> buckets[NUM_BUCKETS] {};
+    };
+
+    struct alignas(128) ThreadSlot {
+        PhaseCounters phases[NUM_PHASES];
+    };
+
+    ThreadSlot slots[MAX_THREADS];
+    // Totals at the time of the last reset()
+    PhaseStats base[NUM_PHASES];
+    mutable std::atomic<bool> resetLock {false};
+
+    static inline void add(std::atomic<uint64_t>& counter, uint64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static inline int bucketOf(uint64_t cycles) {
+        if (cycles < 2) return 0;
+        const int b = 63 - __builtin_clzll(cycles);
+        return b < NUM_BUCKETS ? b : NUM_BUCKETS-1;
+    }
+
+    // Sums the slots of all threads, without the base
+    Snapshot totals() const {
+        Snapshot snap;
+        for (int tid = 0; tid < MAX_THREADS; tid++) {
+            for (int i = 0; i < NUM_PHASES; i++) {
+                const PhaseCounters& pc = slots[tid].phases[i];
+                PhaseStats& ps = snap.phases[i];
+                ps.calls += pc.calls.load(std::memory_order_relaxed);
+                ps.cycles += pc.cycles.load(std::memory_order_relaxed);
+                for (int b = 0; b < NUM_BUCKETS; b++) ps.buckets[b] += pc.buckets[b].load(std::memory_order_relaxed);
+            }
+        }
+        return snap;
+    }
+
+    void lockBase() const {
+        bool tmp = false;
+        while (!resetLock.compare_exchange_weak(tmp, true)) { tmp = false; std::this_thread::yield(); }
+    }
+
+    void unlockBase() const {
+        resetLock.store(false, std::memory_order_release);
+    }
+
+public:
+    // Timer for a phase. Starts on construction, stops on destruction or on stop(), whichever comes first.
+    class Timer {
+        PhaseProfiler& prof;
+        const int tid;
+        const int phase;
+        uint64_t startTSC;
+        bool running {true};
+    public:
+        Timer(PhaseProfiler& prof, const int tid, const int phase) : prof{prof}, tid{tid}, phase{phase}, startTSC{asm_rdtsc()} { }
+        ~Timer() { stop(); }
+        inline void stop() {
+            if (!running) return;
+            running = false;
+            prof.record(tid, phase, asm_rdtsc() - startTSC);
+        }
+    };
+
+    PhaseProfiler() { }
+
+    inline uint64_t start() const { return asm_rdtsc(); }
+
+    inline void stop(const int tid, const int phase, uint64_t startTSC) {
+        record(tid, phase, asm_rdtsc() - startTSC);
+    }
+
+    inline void record(const int tid, const int phase, uint64_t cycles) {
+        PhaseCounters& pc = slots[tid].phases[phase];
+        add(pc.calls, 1);
+        add(pc.cycles, cycles);
+        add(pc.buckets[bucketOf(cycles)], 1);
+    }
+
+    // Totals of all threads since the last reset()
+    Snapshot snapshot() const {
+        Snapshot snap = totals();
+        lockBase();
+        for (int i = 0; i < NUM_PHASES; i++) {
+            PhaseStats& ps = snap.phases[i];
+            const PhaseStats& bs = base[i];
+            // A thread may be in the middle of a record(), don't let the counters go below the base
+            ps.calls = ps.calls > bs.calls ? ps.calls - bs.calls : 0;
+            ps.cycles = ps.cycles > bs.cycles ? ps.cycles - bs.cycles : 0;
+            for (int b = 0; b < NUM_BUCKETS; b++) {
+                ps.buckets[b] = ps.buckets[b] > bs.buckets[b] ? ps.buckets[b] - bs.buckets[b] : 0;
+            }
+        }
+        unlockBase();
+        return snap;
+    }
+
+    void reset() {
+        Snapshot snap = totals();
+        lockBase();
+        for (int i = 0; i < NUM_PHASES; i++) base[i] = snap.phases[i];
+        unlockBase();
+    }
+};
+
+#endif /* _PHASE_PROFILER_H_ */
@@ -14,13 +14,17 @@
  * "Preserving Happens-before in Persistent Memory" by Izraelevitz, Mendes, and Scott
  * https://www.cs.rochester.edu/u/jhi1/papers/2016-spaa-transform
  *
- * We have five different definitions of pwb/pfence/psync:
+ * We have six different definitions of pwb/pfence/psync:
  * - Emulated: We introduce a delay on stores, like Mnemosyne does
  * - Nothing: only works with process restart persistency, i.e. process failures, but not system failure
  * - Define pwb as clflush (Broadwell cpus)
  * - Define pwb as clflushopt (most x86 cpus)
  * - Define pwb as clwb (only very recent cpus have this instruction)
+ * - Runtime: pick the best of the three above at startup, with CPUID. This is the default.
+ * With PM_EMULATION, the runtime pwb is used and the timing of persistent memory is emulated on top of it.
  */
+#include <chrono>
+#include <cstdint>
 
 /*
  * We copied the methods from Mnemosyne:
@@ -33,10 +37,25 @@ static inline unsigned long long asm_rdtsc(void)
     return ( (unsigned long long)lo)|( ((unsigned long long)hi)<<32 );
 }
 
-// Change this depending on the clock cycle of your cpu. For Cervino it's 2100, for my laptop it's 2712.
-#define EMULATED_CPUFREQ  2100
+// Cycles of rdtsc per nanosecond, measured against steady_clock the first time it's needed
+inline double cpuCyclesPerNs() {
+    static const double cyclesPerNs = [] {
+        auto startTime = std::chrono::steady_clock::now();
+        uint64_t startTSC = asm_rdtsc();
+        auto stopTime = startTime;
+        while (stopTime - startTime < std::chrono::milliseconds(20)) stopTime = std::chrono::steady_clock::now();
+        uint64_t stopTSC = asm_rdtsc();
+        return (double)(stopTSC - startTSC) / std::chrono::duration_cast<std::chrono::nanoseconds>(stopTime - startTime).count();
+    }();
+    return cyclesPerNs;
+}
 
+// Define EMULATED_CPUFREQ (in MHz) to use a fixed clock instead of the measured one. For Cervino it's 2100.
+#ifdef EMULATED_CPUFREQ
 #define NS2CYCLE(__ns) ((__ns) * EMULATED_CPUFREQ / 1000)
+#else
+#define NS2CYCLE(__ns) ((uint64_t)((__ns) * cpuCyclesPerNs()))
+#endif
 
 static inline void emulate_latency_ns(int ns) {
     uint64_t stop;
@@ -54,10 +73,257 @@ static inline void emulate_latency_ns(int ns) {
 }
 
 
-#ifdef MEASURE_PWB
+#if defined(PM_EMULATION) && (defined(PWB_IS_CLFLUSH) || defined(PWB_IS_CLFLUSHOPT) || defined(PWB_IS_CLWB) || defined(PWB_IS_NOP))
+#error "PM_EMULATION uses the pwb chosen at runtime, it can not be used with PWB_IS_CLFLUSH/CLFLUSHOPT/CLWB/NOP"
+#endif
 
+// PM_EMULATION also gets here and uses PWB_IS_RUNTIME
+#if !defined(PWB_IS_RUNTIME) && !defined(PWB_IS_CLFLUSH) && !defined(PWB_IS_CLFLUSHOPT) && !defined(PWB_IS_CLWB) && !defined(PWB_IS_NOP)
+#define PWB_IS_RUNTIME
+#endif
+
+#ifdef MEASURE_PWB
 extern thread_local uint64_t tl_num_pwbs;
 extern thread_local uint64_t tl_num_pfences;
+#endif
+
+#ifdef PWB_IS_RUNTIME
+/*
+ * The flavor of pwb is chosen with CPUID when the program starts: CLWB if the cpu has it, otherwise CLFLUSHOPT,
+ * otherwise CLFLUSH. The pfence/psync match the flavor, SFENCE for CLWB and CLFLUSHOPT, nothing for CLFLUSH.
+ * PWB() does a switch on the flavor, which is a branch that always goes the same way. Loops with many
+ * pwbs can do the switch only once, with withPwbFlavor(), and have the pwb of the flavor inlined in the loop.
+ */
+#include <cpuid.h>
+
+#define PWB_FLAVOR_CLFLUSH     0
+#define PWB_FLAVOR_CLFLUSHOPT  1
+#define PWB_FLAVOR_CLWB        2
+
+static inline int detectPwbFlavor() {
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        if (ebx & (1U << 24)) return PWB_FLAVOR_CLWB;
+        if (ebx & (1U << 23)) return PWB_FLAVOR_CLFLUSHOPT;
+    }
+    return PWB_FLAVOR_CLFLUSH;
+}
+
+// Each translation unit has its own copy, set during static initialization
+static const int g_pwb_flavor = detectPwbFlavor();
+
+template<int FLAVOR> struct PwbFlavor {
+    static inline void pwb(const volatile void* addr) {
+        if (FLAVOR == PWB_FLAVOR_CLWB) {
+            asm volatile(".byte 0x66; xsaveopt %0" : "+m" (*(volatile char *)(addr)));  // clwb
+        } else if (FLAVOR == PWB_FLAVOR_CLFLUSHOPT) {
+            asm volatile(".byte 0x66; clflush %0" : "+m" (*(volatile char *)(addr)));   // clflushopt
+        } else {
+            asm volatile("clflush (%0)" :: "r" (addr) : "memory");
+        }
+#ifdef MEASURE_PWB
+        tl_num_pwbs++;
+#endif
+    }
+    static inline void pfence() {
+        if (FLAVOR != PWB_FLAVOR_CLFLUSH) asm volatile("sfence" : : : "memory");
+#ifdef MEASURE_PWB
+        tl_num_pfences++;
+#endif
+    }
+};
+
+static inline void pwbRuntime(const volatile void* addr) {
+    switch (g_pwb_flavor) {
+    case PWB_FLAVOR_CLWB:       PwbFlavor<PWB_FLAVOR_CLWB>::pwb(addr); break;
+    case PWB_FLAVOR_CLFLUSHOPT: PwbFlavor<PWB_FLAVOR_CLFLUSHOPT>::pwb(addr); break;
+    default:                    PwbFlavor<PWB_FLAVOR_CLFLUSH>::pwb(addr); break;
+    }
+}
+
+static inline void pfenceRuntime() {
+    if (g_pwb_flavor == PWB_FLAVOR_CLFLUSH) {
+        PwbFlavor<PWB_FLAVOR_CLFLUSH>::pfence();
+    } else {
+        PwbFlavor<PWB_FLAVOR_CLWB>::pfence();
+    }
+}
+
+static inline const char* pwbFlavorName() {
+    if (g_pwb_flavor == PWB_FLAVOR_CLWB) return "clwb";
+    if (g_pwb_flavor == PWB_FLAVOR_CLFLUSHOPT) return "clflushopt";
+    return "clflush";
+}
+
+#ifndef PM_EMULATION
+// Calls 'func' with an instance of PwbFlavor<> for the flavor of this cpu
+template<typename F> static inline void withPwbFlavor(F&& func) {
+    switch (g_pwb_flavor) {
+    case PWB_FLAVOR_CLWB:       func(PwbFlavor<PWB_FLAVOR_CLWB>()); break;
+    case PWB_FLAVOR_CLFLUSHOPT: func(PwbFlavor<PWB_FLAVOR_CLFLUSHOPT>()); break;
+    default:                    func(PwbFlavor<PWB_FLAVOR_CLFLUSH>()); break;
+    }
+}
+
+  #define PWB(addr)              pwbRuntime(addr)
+  #define PFENCE()               pfenceRuntime()
+  #define PSYNC()                pfenceRuntime()
+
+#else // PM_EMULATION
+/*
+ * Emulation of the timing of persistent memory, to benchmark on hosts that have only DRAM.
+ * Each pwb, and each 64 bytes of non-temporal stores, is a write of a cache line to the device. The writes are
+ * counted per thread and sent to the device on the next pfence/psync, which waits until the device has accepted
+ * them, at PM_EMU_BANDWIDTH_MBS shared by all threads (0 is unlimited), plus PM_EMU_WRITE_NS for them to be
+ * durable (the latencies of the writes between two fences overlap), plus PM_EMU_FENCE_NS to drain the write
+ * pending queue. The pwb and the fence are still executed with the flavor of the cpu, the emulated time is added
+ * by spinning on rdtsc, and the device is reserved once per fence to keep the overhead of the emulation low.
+ * The parameters can be changed at startup with environment variables of the same name. The totals of
+ * the emulation are shown when the process exits.
+ */
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+
+#ifndef PM_EMU_WRITE_NS
+#define PM_EMU_WRITE_NS       100
+#endif
+#ifndef PM_EMU_FENCE_NS
+#define PM_EMU_FENCE_NS       50
+#endif
+#ifndef PM_EMU_BANDWIDTH_MBS
+#define PM_EMU_BANDWIDTH_MBS  2000
+#endif
+
+struct PmEmulator {
+    uint64_t writeNs;
+    uint64_t fenceNs;
+    uint64_t bandwidthMBs;
+    uint64_t writeCycles;
+    uint64_t fenceCycles;
+    uint64_t lineCycles;                        // Cycles for the device to accept one cache line, 0 if unlimited
+    std::atomic<uint64_t> deviceClock {0};      // rdtsc at which the device has accepted all the writes so far
+    // Totals of the threads that have exited
+    std::atomic<uint64_t> numWrites {0};
+    std::atomic<uint64_t> numFences {0};
+    std::atomic<uint64_t> ntBytes {0};
+    std::atomic<uint64_t> stallCycles {0};
+
+    static uint64_t getEnv(const char* name, uint64_t defaultValue) {
+        const char* value = std::getenv(name);
+        if (value == nullptr || *value == 0) return defaultValue;
+        return std::strtoull(value, nullptr, 10);
+    }
+
+    PmEmulator() {
+        writeNs = getEnv("PM_EMU_WRITE_NS", PM_EMU_WRITE_NS);
+        fenceNs = getEnv("PM_EMU_FENCE_NS", PM_EMU_FENCE_NS);
+        bandwidthMBs = getEnv("PM_EMU_BANDWIDTH_MBS", PM_EMU_BANDWIDTH_MBS);
+        writeCycles = NS2CYCLE(writeNs);
+        fenceCycles = NS2CYCLE(fenceNs);
+        lineCycles = (bandwidthMBs == 0) ? 0 : NS2CYCLE(64*1000/(double)bandwidthMBs);
+    }
+
+    ~PmEmulator() { report(stdout); }
+
+    void report(FILE* out) {
+        const double cyclesPerNs = NS2CYCLE(1000000.0)/1000000.0;
+        std::fprintf(out, "PM emulation: cpu=%.0fMHz pwb=%s write=%lluns fence=%lluns bandwidth=%lluMB/s\n",
+                cyclesPerNs*1000, pwbFlavorName(), (unsigned long long)writeNs, (unsigned long long)fenceNs, (unsigned long long)bandwidthMBs);
+        std::fprintf(out, "PM emulation: writes=%llu fences=%llu ntBytes=%llu emulatedTime=%.3fms (sum of all threads)\n",
+                (unsigned long long)numWrites.load(), (unsigned long long)numFences.load(), (unsigned long long)ntBytes.load(),
+                stallCycles.load()/cyclesPerNs/1000000);
+    }
+};
+
+// One instance for the whole process
+inline PmEmulator& pmEmulator() {
+    static PmEmulator emulator;
+    return emulator;
+}
+
+// Per-thread state of the emulation, added to the totals of PmEmulator when the thread exits
+struct PmEmuThread {
+    uint64_t pendingLines {0};                  // Cache lines flushed since the last fence
+    uint64_t ntPending {0};                     // Bytes of non-temporal stores since the last fence
+    uint64_t numWrites {0};
+    uint64_t numFences {0};
+    uint64_t ntBytes {0};
+    uint64_t stallCycles {0};
+
+    ~PmEmuThread() {
+        PmEmulator& emu = pmEmulator();
+        emu.numWrites.fetch_add(numWrites);
+        emu.numFences.fetch_add(numFences);
+        emu.ntBytes.fetch_add(ntBytes);
+        emu.stallCycles.fetch_add(stallCycles);
+    }
+};
+
+inline PmEmuThread& pmEmuThread() {
+    static thread_local PmEmuThread emuThread;
+    return emuThread;
+}
+
+// Reserves the device for 'lines' cache lines and returns the rdtsc at which they have been accepted
+static inline uint64_t pmEmuReserve(PmEmulator& emu, uint64_t now, uint64_t lines) {
+    if (emu.lineCycles == 0) return now;
+    uint64_t clock = emu.deviceClock.load(std::memory_order_relaxed);
+    uint64_t accepted;
+    do {
+        accepted = std::max(now, clock) + lines*emu.lineCycles;
+    } while (!emu.deviceClock.compare_exchange_weak(clock, accepted, std::memory_order_relaxed));
+    return accepted;
+}
+
+static inline void pmEmuPwb(const volatile void* addr) {
+    pwbRuntime(addr);
+    pmEmuThread().pendingLines++;
+}
+
+static inline void pmEmuNtStore(uint64_t bytes) {
+    pmEmuThread().ntPending += bytes;
+}
+
+// Waits for the writes of this thread, without the fence instruction
+static inline void pmEmuDrain() {
+    PmEmulator& emu = pmEmulator();
+    PmEmuThread& emuThread = pmEmuThread();
+    const uint64_t lines = emuThread.pendingLines + (emuThread.ntPending + 63)/64;
+    uint64_t start = asm_rdtsc();
+    uint64_t stop = start + emu.fenceCycles;
+    if (lines != 0) stop += pmEmuReserve(emu, start, lines) - start + emu.writeCycles;
+    uint64_t now = start;
+    while (now < stop) now = asm_rdtsc();
+    emuThread.stallCycles += now - start;
+    emuThread.numWrites += lines;
+    emuThread.numFences++;
+    emuThread.ntBytes += emuThread.ntPending;
+    emuThread.pendingLines = 0;
+    emuThread.ntPending = 0;
+}
+
+static inline void pmEmuFence() {
+    pfenceRuntime();
+    pmEmuDrain();
+}
+
+struct PwbEmulatedFlavor {
+    static inline void pwb(const volatile void* addr) { pmEmuPwb(addr); }
+    static inline void pfence() { pmEmuFence(); }
+};
+
+template<typename F> static inline void withPwbFlavor(F&& func) { func(PwbEmulatedFlavor()); }
+
+  #define PWB(addr)              pmEmuPwb(addr)
+  #define PFENCE()               pmEmuFence()
+  #define PSYNC()                pmEmuFence()
+  #define PFENCE_BY_CAS()        pmEmuDrain()
+
+#endif // PM_EMULATION
+
+#elif defined(MEASURE_PWB)
 
 #ifdef PWB_IS_CLFLUSH
   /*
@@ -111,11 +377,39 @@ extern thread_local uint64_t tl_num_pfences;
   #define PWB(addr)              asm volatile(".byte 0x66; clflush %0" : "+m" (*(volatile char *)(addr)))    // clflushopt (Kaby Lake)
   #define PFENCE()               asm volatile("sfence" : : : "memory")
   #define PSYNC()                asm volatile("sfence" : : : "memory")
-#else
-#error "You must define what PWB is. Choose PWB_IS_CLFLUSHOPT if you don't know what your CPU is capable of"
 #endif
 
-#endif // MEASURE_PWB
+#endif // PWB_IS_RUNTIME / MEASURE_PWB
+
+/*
+ * Placed where a pfence is not needed because the CAS that follows is a locked instruction, which orders the
+ * previous pwbs. With PM_EMULATION it has the cost of the fence, otherwise it does nothing.
+ */
+#ifndef PFENCE_BY_CAS
+  #define PFENCE_BY_CAS()        {}
+#endif
+
+#ifndef PWB_IS_RUNTIME
+// The flavor of pwb is fixed at compile time, withPwbFlavor() just calls 'func' with PWB/PFENCE
+struct PwbFixedFlavor {
+    static inline void pwb(const volatile void* addr) { PWB(addr); }
+    static inline void pfence() { PFENCE(); }
+};
+
+template<typename F> static inline void withPwbFlavor(F&& func) { func(PwbFixedFlavor()); }
+
+static inline const char* pwbFlavorName() {
+#if defined(PWB_IS_CLFLUSH)
+    return "clflush";
+#elif defined(PWB_IS_CLFLUSHOPT)
+    return "clflushopt";
+#elif defined(PWB_IS_CLWB)
+    return "clwb";
+#else
+    return "nop";
+#endif
+}
+#endif
 
 
 // 8 byte non-temporal store
@@ -126,6 +420,9 @@ inline void ntstore(void* _dst, void* _src) {
         "movnti  %%r8,   (%1)\n"
         :: "r" (src), "r" (dst)
         : "memory", "r8");
+#ifdef PM_EMULATION
+    pmEmuNtStore(8);
+#endif
 }
 
 // 4x8 byte non-temporal store
@@ -158,13 +455,18 @@ inline void quadntstore(void* _dst, void* _src) {
     	"movntq %%mm7, 56(%1)\n"
         :: "r" (src), "r" (dst)
         : "memory");
+#ifdef PM_EMULATION
+    pmEmuNtStore(64);
+#endif
 }
 
 // Flush each cache line in a range
 static inline void flushFromTo(void* from, void* to) noexcept {
     const uint64_t cache_line_size = 64;
-    uint8_t* ptr = (uint8_t*)(((uint64_t)from) & (~(cache_line_size-1)));
-    for (; ptr < (uint8_t*)to; ptr += cache_line_size) PWB(ptr);
+    uint8_t* start = (uint8_t*)(((uint64_t)from) & (~(cache_line_size-1)));
+    withPwbFlavor([&](auto flavor) {
+        for (uint8_t* ptr = start; ptr < (uint8_t*)to; ptr += cache_line_size) flavor.pwb(ptr);
+    });
 }
 
 
@@ -0,0 +1,48 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef _PTMDB_INCLUDE_COMPARATOR_H_
+#define _PTMDB_INCLUDE_COMPARATOR_H_
+
+#include "slice.h"
+
+namespace ptmdb {
+
+// A Comparator object provides a total order across slices that are
+// used as keys in the ordered index.  A Comparator implementation
+// must be thread-safe since ptmdb may invoke its methods concurrently
+// from multiple threads.
+// Inside a transaction it may be called more than once for the same keys,
+// so it must not have side effects.
+class Comparator {
+ public:
+  virtual ~Comparator() { }
+
+  // Three-way comparison.  Returns value:
+  //   < 0 iff "a" < "b",
+  //   == 0 iff "a" == "b",
+  //   > 0 iff "a" > "b"
+  virtual int Compare(const Slice& a, const Slice& b) const = 0;
+
+  // The name of the comparator.  The client of the DB must use the same
+  // comparator each time the DB is opened.
+  virtual const char* Name() const = 0;
+};
+
+// Return a builtin comparator that uses lexicographic byte-wise
+// ordering.  The result remains the property of this module and
+// must not be deleted.
+inline const Comparator* BytewiseComparator() {
+  class BytewiseComparatorImpl : public Comparator {
+   public:
+    int Compare(const Slice& a, const Slice& b) const { return a.compare(b); }
+    const char* Name() const { return "ptmdb.BytewiseComparator"; }
+  };
+  static const BytewiseComparatorImpl singleton;
+  return &singleton;
+}
+
+}  // namespace ptmdb
+
+#endif  // _PTMDB_INCLUDE_COMPARATOR_H_
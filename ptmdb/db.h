@@ -9,6 +9,9 @@
 #ifndef _PTMDB_INCLUDE_DB_H_
 #define _PTMDB_INCLUDE_DB_H_
 
+#include <cstdint>
+#include <string>
+#include <vector>
 #include "iterator.h"
 #include "options.h"
 #include "ptmdb.h"
@@ -33,6 +36,20 @@ class Snapshot {
   virtual ~Snapshot();
 };
 
+// Name of the column family of the keys that are written without a column family
+extern const char* const kDefaultColumnFamilyName;
+
+// Handle of a column family: a set of keys with an index of its own, see
+// DB::CreateColumnFamily().  The handles are owned by the DB.
+class ColumnFamilyHandle {
+ public:
+  virtual const std::string& GetName() const = 0;
+  virtual uint32_t GetID() const = 0;
+
+ protected:
+  virtual ~ColumnFamilyHandle();
+};
+
 // A range of keys
 struct Range {
   Slice start;          // Included in the range
@@ -65,15 +82,35 @@ class DB {
   virtual Status Put(const WriteOptions& options,
                      const Slice& key,
                      const Slice& value) = 0;
+  virtual Status Put(const WriteOptions& options,
+                     ColumnFamilyHandle* column_family,
+                     const Slice& key,
+                     const Slice& value) = 0;
 
   // Remove the database entry (if any) for "key".  Returns OK on
   // success, and a non-OK status on error.  It is not an error if "key"
   // did not exist in the database.
   // Note: consider setting options.sync = true.
   virtual Status Delete(const WriteOptions& options, const Slice& key) = 0;
-
-  // Apply the specified updates to the database.
-  // Returns OK on success, non-OK on failure.
+  virtual Status Delete(const WriteOptions& options,
+                        ColumnFamilyHandle* column_family,
+                        const Slice& key) = 0;
+
+  // Set the database entry for "key" to the result of options.merge_operator
+  // on its current value (if any) and "operand", in a single transaction.
+  // Returns NotSupported if there is no merge operator, and InvalidArgument
+  // if the merge operator fails, in which case the entry is unchanged.
+  // Note: consider setting options.sync = true.
+  virtual Status Merge(const WriteOptions& options, const Slice& key,
+                       const Slice& operand) = 0;
+  virtual Status Merge(const WriteOptions& options,
+                       ColumnFamilyHandle* column_family,
+                       const Slice& key, const Slice& operand) = 0;
+
+  // Apply the specified updates to the database, in a single transaction
+  // even when they are in several column families.
+  // Returns OK on success, non-OK on failure, in which case none of the
+  // updates are applied.
   // Note: consider setting options.sync = true.
   virtual Status Write(const WriteOptions& options, WriteBatch* updates) = 0;
 
@@ -87,6 +124,32 @@ class DB {
   // May return some other Status on an error.
   virtual Status Get(const ReadOptions& options,
                      const Slice& key, std::string* value) = 0;
+  virtual Status Get(const ReadOptions& options,
+                     ColumnFamilyHandle* column_family,
+                     const Slice& key, std::string* value) = 0;
+
+  // Same as Get() above, but without a copy of the value when the PTM can
+  // pin a replica (see PinnableSlice). If options.snapshot is pinned, the
+  // value refers to the replica of the snapshot and is valid until the
+  // snapshot is released, otherwise the value pins the current replica with
+  // the read lock of the calling thread, and must be reset (or destroyed) by
+  // that same thread. The pins of a thread share one replica.
+  // If there is no entry for "key", *value is empty.
+  // Pinning costs more than copying a small value, use it for large values.
+  virtual Status Get(const ReadOptions& options,
+                     const Slice& key, PinnableSlice* value) = 0;
+  virtual Status Get(const ReadOptions& options,
+                     ColumnFamilyHandle* column_family,
+                     const Slice& key, PinnableSlice* value) = 0;
+
+  // Looks up all the "keys" in a single read transaction, which is much faster
+  // than calling Get() for each key. On return, values and statuses have one
+  // entry per key: the status is OK and the value is set if the key was found,
+  // otherwise the status is NotFound and the value is empty.
+  virtual void MultiGet(const ReadOptions& options,
+                        const std::vector<Slice>& keys,
+                        std::vector<std::string>* values,
+                        std::vector<Status>* statuses) = 0;
 
   // Return a heap-allocated iterator over the contents of the database.
   // The result of NewIterator() is initially invalid (caller must
@@ -95,6 +158,65 @@ class DB {
   // Caller should delete the iterator when it is no longer needed.
   // The returned iterator should be deleted before this db is deleted.
   virtual Iterator* NewIterator(const ReadOptions& options) = 0;
+  virtual Iterator* NewIterator(const ReadOptions& options,
+                                ColumnFamilyHandle* column_family) = 0;
+
+  // Opens the column family "name", after creating it if it doesn't exist,
+  // and stores its handle in *handle.  Each column family has its own index,
+  // with the index_type, hash_index_buckets, comparator and merge_operator of
+  // "options" (the other fields are ignored), so that a small set of hot keys
+  // doesn't share the buckets of a large one.  The snapshots and the
+  // WriteBatches of the DB cover all of its column families.
+  // Returns InvalidArgument if the column family exists with another index
+  // type, or if the DB already has the maximum number of column families
+  // (64, including the default one).  If the column family is
+  // already open, the same handle is returned and "options" is ignored.
+  // The handle of kDefaultColumnFamilyName is DefaultColumnFamily().
+  virtual Status CreateColumnFamily(const Options& options,
+                                    const std::string& name,
+                                    ColumnFamilyHandle** handle) = 0;
+
+  // Deletes the column family and all of its keys.  After this call the
+  // methods that take the handle return InvalidArgument (NewIterator()
+  // returns an iterator with that status).  The iterators of the column
+  // family must be deleted before this call.
+  // The default column family can not be dropped.
+  virtual Status DropColumnFamily(ColumnFamilyHandle* column_family) = 0;
+
+  // The column family of the methods that don't take a column family
+  virtual ColumnFamilyHandle* DefaultColumnFamily() = 0;
+
+  // Return a handle to the current DB state.  Iterators created with
+  // this handle will all observe a stable snapshot of the current DB
+  // state.  The caller must call ReleaseSnapshot(result) when the
+  // snapshot is no longer needed.
+  // A snapshot keeps one replica of the PTM pinned, release it soon.
+  virtual const Snapshot* GetSnapshot() = 0;
+
+  // Release a previously acquired snapshot.  The caller must not
+  // use "snapshot" after this call.
+  virtual void ReleaseSnapshot(const Snapshot* snapshot) = 0;
+
+  // DB implementations can export properties about their state
+  // via this method.  If "property" is a valid property understood by this
+  // DB implementation, fills "*value" with its current value and returns
+  // true.  Otherwise returns false.
+  //
+  //
+  // Valid property names include:
+  //
+  //  "ptmdb.num-entries" - returns the number of keys in the DB.
+  //  "ptmdb.stats" - returns a multi-line string with the counters of the
+  //     PTM: pwbs, pfences, bytes copied with non-temporal stores, redo log
+  //     entries applied, full copies of a replica, and transactions.
+  //  "ptmdb.pwbs", "ptmdb.pfences", "ptmdb.nt-bytes", "ptmdb.redo-entries",
+  //  "ptmdb.full-copies", "ptmdb.update-txs", "ptmdb.read-txs" - returns
+  //     one of the counters above, as a decimal number.
+  //  "ptmdb.phases" - returns a multi-line string with the time spent in
+  //     each phase of the transactions (copy, apply of the redo logs, etc).
+  //
+  // The counters are only available when the PTM has them (RedoOpt).
+  virtual bool GetProperty(const Slice& property, std::string* value) = 0;
 
 
  private:
@@ -44,9 +44,12 @@ using namespace chrono;
 //      fill100K      -- write N/1000 100K values in random order in async mode
 //      deleteseq     -- delete N keys in sequential order
 //      deleterandom  -- delete N keys in random order
+//      mergerandom   -- add 1 to N counters in random order with Merge() and UInt64AddOperator()
 //      readseq       -- read N times sequentially
 //      readreverse   -- read N times in reverse order
 //      readrandom    -- read N times in random order
+//      multireadrandom -- read N times in random order, 100 keys per MultiGet()
+//      readrandompinned -- read N times in random order, with Get() to a PinnableSlice
 //      readmissing   -- read N missing keys in random order
 //      readhot       -- read N times in random order from 1% section of DB
 //      seekrandom    -- N random seeks
@@ -57,6 +60,7 @@ using namespace chrono;
 //      compact     -- Compact the entire DB  (Pedro: disabled)
 //      stats       -- Print DB stats
 //      sstables    -- Print sstable info
+//      phases      -- Print the time spent in each phase of the PTM
 //      heapprofile -- Dump a heap profile (if supported by this port)
 static const char* FLAGS_benchmarks =
         "fillseq,"
@@ -84,6 +88,16 @@ static int FLAGS_reads = -1;
 // Number of concurrent threads to run.
 static int FLAGS_threads = 1;
 
+// Number of dedicated combiner threads of the PTM (0 means the threads
+// of the benchmark do the combining themselves).
+static int FLAGS_combiners = 0;
+
+// If true, use the ordered index (skip list) instead of the hash index
+static bool FLAGS_ordered_index = false;
+
+// Number of buckets of the hash index when the DB is created (0 means the default)
+static int FLAGS_hash_buckets = 0;
+
 // Size of each value
 static int FLAGS_value_size = 104;
 
@@ -193,6 +207,7 @@ private:
     double finish_;
     double seconds_;
     uint64_t done_;
+    uint64_t pwbs_;
     int next_report_;
     int64_t bytes_;
     double last_op_finish_;
@@ -207,6 +222,7 @@ public:
         last_op_finish_ = start_;
         hist_.Clear();
         done_ = 0;
+        pwbs_ = 0;
         bytes_ = 0;
         seconds_ = 0;
         start_ = g_env->NowMicros();
@@ -217,6 +233,7 @@ public:
     void Merge(const Stats& other) {
         hist_.Merge(other.hist_);
         done_ += other.done_;
+        pwbs_ += other.pwbs_;
         bytes_ += other.bytes_;
         seconds_ += other.seconds_;
         if (other.start_ < start_) start_ = other.start_;
@@ -267,6 +284,10 @@ public:
         bytes_ += n;
     }
 
+    void AddPwbs(uint64_t n) {
+        pwbs_ += n;
+    }
+
     void Report(const Slice& name) {
         // Pretend at least one op was done in case we are running a benchmark
         // that does not call FinishedSingleOp().
@@ -282,6 +303,11 @@ public:
                     (bytes_ / 1048576.0) / elapsed);
             extra = rate;
         }
+        if (pwbs_ > 0) {
+            char rate[100];
+            snprintf(rate, sizeof(rate), "%.1f pwbs/op", (double)pwbs_ / done_);
+            AppendWithSpace(&extra, rate);
+        }
         AppendWithSpace(&extra, message_);
 
         fprintf(stdout, "%-12s : %11.3f micros/op;%s%s\n",
@@ -501,6 +527,11 @@ public:
                 method = &Benchmark::ReadReverse;
             } else if (name == Slice("readrandom")) {
                 method = &Benchmark::ReadRandom;
+            } else if (name == Slice("readrandompinned")) {
+                method = &Benchmark::ReadRandomPinned;
+            } else if (name == Slice("multireadrandom")) {
+                entries_per_batch_ = 100;
+                method = &Benchmark::MultiReadRandom;
             } else if (name == Slice("readmissing")) {
                 method = &Benchmark::ReadMissing;
             } else if (name == Slice("seekrandom")) {
@@ -514,6 +545,8 @@ public:
                 method = &Benchmark::DeleteSeq;
             } else if (name == Slice("deleterandom")) {
                 method = &Benchmark::DeleteRandom;
+            } else if (name == Slice("mergerandom")) {
+                method = &Benchmark::MergeRandom;
             } else if (name == "fillseekseq") {
                 method = &Benchmark::WriteSeqSeekSeq;
             } else if (name == Slice("readwhilewriting")) {
@@ -528,9 +561,11 @@ public:
             } else if (name == Slice("heapprofile")) {
                 HeapProfile();
             } else if (name == Slice("stats")) {
-                PrintStats("leveldb.stats");
+                PrintStats("ptmdb.stats");
             } else if (name == Slice("sstables")) {
-                PrintStats("leveldb.sstables");
+                PrintStats("ptmdb.sstables");
+            } else if (name == Slice("phases")) {
+                PrintStats("ptmdb.phases");
             } else {
                 if (name != Slice()) {  // No error message for empty name
                     fprintf(stderr, "unknown benchmark '%s'\n", name.ToString().c_str());
@@ -600,6 +635,7 @@ private:
         shared.num_done = 0;
         shared.start = false;
 
+        const uint64_t pwbs = NumPwbs();
         ThreadArg* arg = new ThreadArg[n];
         for (int i = 0; i < n; i++) {
             arg[i].bm = this;
@@ -625,6 +661,7 @@ private:
         for (int i = 1; i < n; i++) {
             arg[0].thread->stats.Merge(arg[i].thread->stats);
         }
+        arg[0].thread->stats.AddPwbs(NumPwbs() - pwbs);
         arg[0].thread->stats.Report(name);
 
         for (int i = 0; i < n; i++) {
@@ -708,6 +745,9 @@ private:
         options.max_open_files = FLAGS_open_files;
         //options.filter_policy = filter_policy_;
         options.reuse_logs = FLAGS_reuse_logs;
+        options.index_type = FLAGS_ordered_index ? kOrderedIndex : kHashIndex;
+        options.merge_operator = UInt64AddOperator();
+        if (FLAGS_hash_buckets > 0) options.hash_index_buckets = FLAGS_hash_buckets;
         Status s = DB::Open(options, FLAGS_db, &db_);
         if (!s.ok()) {
             fprintf(stderr, "open error: %s\n", s.ToString().c_str());
@@ -887,6 +927,56 @@ private:
         thread->stats.AddMessage(msg);
     }
 
+    void ReadRandomPinned(ThreadState* thread) {
+        ReadOptions options;
+        PinnableSlice value;
+        int found = 0;
+        int64_t bytes = 0;
+        for (int i = 0; i < reads_; i++) {
+            char key[100];
+            const int k = thread->rand.Next() % FLAGS_num;
+            snprintf(key, sizeof(key), "%016d", k);
+            if (db_->Get(options, key, &value).ok()) {
+                found++;
+                bytes += value.size();
+            }
+            value.Reset();
+            thread->stats.FinishedSingleOp();
+        }
+        char msg[100];
+        snprintf(msg, sizeof(msg), "(%d of %d found)", found, num_);
+        thread->stats.AddMessage(msg);
+        thread->stats.AddBytes(bytes);
+    }
+
+    void MultiReadRandom(ThreadState* thread) {
+        ReadOptions options;
+        std::vector<std::string> values;
+        std::vector<Status> statuses;
+        std::vector<Slice> keys;
+        std::vector<std::string> keyBufs(entries_per_batch_);
+        keys.reserve(entries_per_batch_);
+        int found = 0;
+        for (int i = 0; i < reads_; i += entries_per_batch_) {
+            keys.clear();
+            for (int j = 0; j < entries_per_batch_; j++) {
+                char key[100];
+                const int k = thread->rand.Next() % FLAGS_num;
+                snprintf(key, sizeof(key), "%016d", k);
+                keyBufs[j] = key;
+                keys.emplace_back(keyBufs[j]);
+            }
+            db_->MultiGet(options, keys, &values, &statuses);
+            for (int j = 0; j < entries_per_batch_; j++) {
+                if (statuses[j].ok()) found++;
+                thread->stats.FinishedSingleOp();
+            }
+        }
+        char msg[100];
+        snprintf(msg, sizeof(msg), "(%d of %d found)", found, num_);
+        thread->stats.AddMessage(msg);
+    }
+
     void ReadMissing(ThreadState* thread) {
         ReadOptions options;
         std::string value;
@@ -973,6 +1063,24 @@ private:
     }
 
 
+    void MergeRandom(ThreadState* thread) {
+        const uint64_t one = 1;
+        const Slice operand(reinterpret_cast<const char*>(&one), sizeof(one));
+        Status s;
+        for (int i = 0; i < num_; i++) {
+            const int k = thread->rand.Next() % FLAGS_num;
+            char key[100];
+            snprintf(key, sizeof(key), "counter%016d", k);
+            s = db_->Merge(write_options_, key, operand);
+            if (!s.ok()) {
+                fprintf(stderr, "merge error: %s\n", s.ToString().c_str());
+                exit(1);
+            }
+            thread->stats.FinishedSingleOp();
+        }
+    }
+
+
     void WriteSeqSeekSeq(ThreadState* thread) {
         writes_ = FLAGS_num;
         DoWrite(thread, true);
@@ -1070,7 +1178,18 @@ private:
     }
 
     void PrintStats(const char* key) {
-        fprintf(stdout, "\nStats not implemented in PTM-DB\n");
+        std::string stats;
+        if (db_ == NULL || !db_->GetProperty(key, &stats)) {
+            stats = "(failed)";
+        }
+        fprintf(stdout, "\n%s\n", stats.c_str());
+    }
+
+    // Number of pwbs done by the PTM so far, zero if the PTM doesn't count them
+    uint64_t NumPwbs() {
+        std::string value;
+        if (db_ == NULL || !db_->GetProperty("ptmdb.pwbs", &value)) return 0;
+        return strtoull(value.c_str(), NULL, 10);
     }
 
     static void WriteToFile(void* arg, const char* buf, int n) {
@@ -1121,12 +1240,19 @@ int main(int argc, char** argv) {
         } else if (sscanf(argv[i], "--reuse_logs=%d%c", &n, &junk) == 1 &&
                 (n == 0 || n == 1)) {
             FLAGS_reuse_logs = n;
+        } else if (sscanf(argv[i], "--ordered_index=%d%c", &n, &junk) == 1 &&
+                (n == 0 || n == 1)) {
+            FLAGS_ordered_index = n;
+        } else if (sscanf(argv[i], "--hash_buckets=%d%c", &n, &junk) == 1) {
+            FLAGS_hash_buckets = n;
         } else if (sscanf(argv[i], "--num=%d%c", &n, &junk) == 1) {
             FLAGS_num = n;
         } else if (sscanf(argv[i], "--reads=%d%c", &n, &junk) == 1) {
             FLAGS_reads = n;
         } else if (sscanf(argv[i], "--threads=%d%c", &n, &junk) == 1) {
             FLAGS_threads = n;
+        } else if (sscanf(argv[i], "--combiners=%d%c", &n, &junk) == 1) {
+            FLAGS_combiners = n;
         } else if (sscanf(argv[i], "--value_size=%d%c", &n, &junk) == 1) {
             FLAGS_value_size = n;
         } else if (sscanf(argv[i], "--write_buffer_size=%d%c", &n, &junk) == 1) {
@@ -1158,6 +1284,15 @@ int main(int argc, char** argv) {
         FLAGS_db = default_db_path.c_str();
     }
 
+    if (FLAGS_combiners > 0) {
+#ifdef PTM_START_COMBINERS
+        PTM_START_COMBINERS(FLAGS_combiners);
+#else
+        fprintf(stderr, "--combiners is not supported by this PTM\n");
+        exit(1);
+#endif
+    }
+
     ptmdb::Benchmark benchmark;
     benchmark.Run();
     //printf("g_pwb_counter = %ld\n", g_pwb_counter);
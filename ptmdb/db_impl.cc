@@ -7,6 +7,7 @@
  * This work is published under the MIT license. See LICENSE.txt
  */
 #include <algorithm>
+#include <cassert>
 #include <set>
 #include <string>
 #include <stdio.h>
@@ -18,9 +19,47 @@
 
 namespace ptmdb {
 
+const char* const kDefaultColumnFamilyName = "default";
+
+Snapshot::~Snapshot() { }
+
+ColumnFamilyHandle::~ColumnFamilyHandle() { }
+
+namespace {
+class EmptyIterator : public Iterator {
+ public:
+  EmptyIterator(const Status& s) : status_(s) { }
+  bool Valid() const { return false; }
+  void Seek(const Slice& target) { }
+  void SeekToFirst() { }
+  void SeekToLast() { }
+  void Next() { assert(false); }
+  void Prev() { assert(false); }
+  Slice key() const { assert(false); return Slice(); }
+  Slice value() const { assert(false); return Slice(); }
+  Status status() const { return status_; }
+ private:
+  Status status_;
+};
+}  // namespace
+
+Iterator* NewEmptyIterator() {
+  return new EmptyIterator(Status::OK());
+}
+
+Iterator* NewErrorIterator(const Status& status) {
+  return new EmptyIterator(status);
+}
+
 Status DB::Open(const Options& options, const std::string& dbname, DB** dbptr) {
-    *dbptr = new DBImpl(options, dbname);
-    return Status::OK();
+    DBImpl* impl = new DBImpl(options, dbname);
+    Status s = impl->openStatus_;
+    if (!s.ok()) {
+        delete impl;
+        impl = nullptr;
+    }
+    *dbptr = impl;
+    return s;
 }
 
 Status DestroyDB(const std::string& dbname, const Options& options) {
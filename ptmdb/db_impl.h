@@ -9,53 +9,57 @@
 #ifndef _PTMDB_DB_DB_IMPL_H_
 #define _PTMDB_DB_DB_IMPL_H_
 
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <string>
+#include <utility>
+#include <vector>
 #include "db.h"
 #include "write_batch.h"
 #include "ptmdb.h"
-#include "TMHashMap.hpp"
-#include "TMHashMapIterator.h"
+#include "column_family.h"
+#include "snapshot.h"
 
 namespace ptmdb {
 
 
 class DBImpl : public DB {
 public:
-    DBImpl(const Options& raw_options, const std::string& dbname) {
+    DBImpl(const Options& raw_options, const std::string& dbname)
+        : defaultFamily_{0, kDefaultColumnFamilyName, raw_options} {
         dbname_ = dbname;
+        families_[0] = &defaultFamily_;
+        for (uint32_t id = 1; id < kMaxColumnFamilies; id++) families_[id] = nullptr;
         // Create the ds
 #ifdef PTMDB_CAPTURE_BY_COPY
-        PTM_UPDATE_TX<bool>([=] () {
-            // We expect the root pointer zero to be the hashmap
-            hashMap = PTM_GET_ROOT<TMHashMap>(0);
-            if (hashMap == nullptr) {
-                hashMap = PTM_NEW<TMHashMap>();
-                PTM_PUT_ROOT(0, hashMap);
-            }
-            return true;
+        const bool created = PTM_UPDATE_TX<bool>([=] () {
+            return createIndex();
         });
 #else
+        bool created;
         PTM_UPDATE_TX([&] () {
-            // We expect the root pointer zero to be the hashmap
-            hashMap = PTM_GET_ROOT<TMHashMap>(0);
-            if (hashMap == nullptr) {
-                hashMap = PTM_NEW<TMHashMap>();
-                PTM_PUT_ROOT(0, hashMap);
-            }
+            created = createIndex();
         });
 #endif
+        if (!created) openStatus_ = Status::InvalidArgument(dbname, "was created with another index_type");
     }
 
     ~DBImpl() {
-        // delete the hashmap
+        // Nothing was created when the DB failed to open
+        if (!openStatus_.ok()) return;
+        // delete the indexes, of all the column families
 #ifdef PTMDB_CAPTURE_BY_COPY
         PTM_UPDATE_TX<bool>([=] () {
-           PTM_DELETE(hashMap);
+           deleteIndex();
            return true;
         });
 #else
         PTM_UPDATE_TX([&] () {
-           PTM_DELETE(hashMap);
+           deleteIndex();
         });
 #endif
     }
@@ -63,15 +67,21 @@ public:
     // Set the database entry for "key" to "value".  Returns OK on success,
     // and a non-OK status on error.
     // Note: consider setting options.sync = true.
-    Status Put(const WriteOptions&, const Slice& k, const Slice& v) {
+    Status Put(const WriteOptions& options, const Slice& k, const Slice& v) {
+        return Put(options, &defaultFamily_, k, v);
+    }
+
+    Status Put(const WriteOptions&, ColumnFamilyHandle* column_family, const Slice& k, const Slice& v) {
+        ColumnFamilyImpl* family = openFamilyOf(column_family);
+        if (family == nullptr) return Status::InvalidArgument("column family is not open");
 #ifdef PTMDB_CAPTURE_BY_COPY
-        PTM_UPDATE_TX<bool>([this,key = k, val = v] () {
-            hashMap->innerPut(key,val);
+        PTM_UPDATE_TX<bool>([family,key = k, val = v] () {
+            family->put(key,val);
            return true;
         });
 #else
         PTM_UPDATE_TX([&] () {
-            hashMap->innerPut(k,v);
+            family->put(k,v);
         });
 #endif
         return Status::OK();
@@ -82,53 +92,73 @@ public:
     // did not exist in the database.
     // Note: consider setting options.sync = true.
     Status Delete(const WriteOptions& options, const Slice& k) {
+        return Delete(options, &defaultFamily_, k);
+    }
+
+    Status Delete(const WriteOptions& options, ColumnFamilyHandle* column_family, const Slice& k) {
+        ColumnFamilyImpl* family = openFamilyOf(column_family);
+        if (family == nullptr) return Status::InvalidArgument("column family is not open");
 #ifdef PTMDB_CAPTURE_BY_COPY
-        bool found = PTM_UPDATE_TX<bool>([this,key = k] () {
-            return hashMap->innerRemove(key);
+        bool found = PTM_UPDATE_TX<bool>([family,key = k] () {
+            return family->remove(key);
         });
 #else
         bool found;
         PTM_UPDATE_TX([&] () {
-            found = hashMap->innerRemove(k);
+            found = family->remove(k);
         });
 #endif
         if (!found) return Status::NotFound("key Not Found");
         return Status::OK();
     }
 
+    // The merge operator runs inside the transaction, on the value of the replica that the transaction modifies
+    Status Merge(const WriteOptions& options, const Slice& k, const Slice& operand) {
+        return Merge(options, &defaultFamily_, k, operand);
+    }
+
+    Status Merge(const WriteOptions& options, ColumnFamilyHandle* column_family, const Slice& k, const Slice& operand) {
+        ColumnFamilyImpl* family = openFamilyOf(column_family);
+        if (family == nullptr) return Status::InvalidArgument("column family is not open");
+        if (family->mergeOperator() == nullptr) return Status::NotSupported("no merge operator");
+#ifdef PTMDB_CAPTURE_BY_COPY
+        bool ok = PTM_UPDATE_TX<bool>([family,key = k, op = operand] () {
+            return family->merge(key, op);
+        });
+#else
+        bool ok;
+        PTM_UPDATE_TX([&] () {
+            ok = family->merge(k, operand);
+        });
+#endif
+        if (!ok) return Status::InvalidArgument("merge operator failed");
+        return Status::OK();
+    }
+
     // Apply the specified updates to the database.
     // Returns OK on success, non-OK on failure.
+    // All the updates of the batch are done in a single transaction, in the order they were added, or none of
+    // them: if a merge of the batch fails, or an update is of a column family that is not open (or was dropped),
+    // Write() returns InvalidArgument and the database is unchanged.
     Status Write(const WriteOptions& options, WriteBatch* my_batch) {
-        std::vector<WriteBatch::Op>& vec = my_batch->getTransaction();
+        if (my_batch->Count() == 0) return Status::OK();
 #ifdef PTMDB_CAPTURE_BY_COPY
-            while (!vec.empty()) {
-                PTM_UPDATE_TX<bool>([this,oper = vec[vec.size()-1]] () {
-					if(oper.operation){
-						hashMap->innerPut(oper.key, oper.value);
-					}else{
-						hashMap->innerRemove(oper.key);
-					}
-					return true;
-                });
-                vec.pop_back();
-            }
+        // Capture the contents and not the batch, the lambda may be executed after we return
+        const int res = PTM_UPDATE_TX<int>([this,rep = my_batch->Contents()] () {
+            return applyBatch(*rep);
+        });
 #else
+        const std::shared_ptr<const std::string> rep = my_batch->Contents();
+        int res;
         PTM_UPDATE_TX([&] () {
-            for(int i=0;i<vec.size();i++){
-                WriteBatch::Op& operat = vec[i];
-                if(operat.operation){
-                    hashMap->innerPut(operat.key, operat.value);
-                }else{
-                    hashMap->innerRemove(operat.key);
-                }
-            }
+            res = applyBatch(*rep);
         });
 #endif
-        return Status::OK();
+        return batchStatus(res);
     }
 
     long size() {
-       return hashMap->sizeHM;
+        return defaultFamily_.size();
     }
 
     // If the database contains an entry for "key" store the
@@ -139,21 +169,79 @@ public:
     //
     // May return some other Status on an error.
     Status Get(const ReadOptions& options, const Slice& k, std::string* svalue) {
-#ifdef PTMDB_CAPTURE_BY_COPY
+        return Get(options, &defaultFamily_, k, svalue);
+    }
+
+    Status Get(const ReadOptions& options, ColumnFamilyHandle* column_family, const Slice& k, std::string* svalue) {
+        ColumnFamilyImpl* family = openFamilyOf(column_family);
+        if (family == nullptr) return Status::InvalidArgument("column family is not open");
         // ERROR   ERROR   ERROR: We can not have multiple threads changing the string svalue, it creates races and possibly memory reclamation issues
-        bool found = PTM_READ_TX<bool>([this,key = k,svalue] () {
-            return hashMap->innerGet(key,svalue);
-        });
-#else
         bool found;
-        PTM_READ_TX([&] () {
-            found = hashMap->innerGet(k,svalue);
+        snapshotReadTx(static_cast<const SnapshotImpl*>(options.snapshot), [&] () {
+            found = family->get(k,svalue);
         });
-#endif
         if (!found) return Status::NotFound("key Not Found");
         return Status::OK();
     }
 
+    // The value is read on a pinned replica, the one of options.snapshot or, without a snapshot, the current one
+    // pinned by this thread (PTM_PIN_REPLICA) until the PinnableSlice is released, which must be done by the same
+    // thread. The lambda only sets local pointers, the value is never copied by another thread.
+    // If no replica can be pinned, it's the same as the other Get().
+    Status Get(const ReadOptions& options, const Slice& k, PinnableSlice* value) {
+        return Get(options, &defaultFamily_, k, value);
+    }
+
+    Status Get(const ReadOptions& options, ColumnFamilyHandle* column_family, const Slice& k, PinnableSlice* value) {
+        value->Reset();
+        ColumnFamilyImpl* family = openFamilyOf(column_family);
+        if (family == nullptr) return Status::InvalidArgument("column family is not open");
+        const SnapshotImpl* snap = static_cast<const SnapshotImpl*>(options.snapshot);
+        const char* data = nullptr;
+        size_t size = 0;
+        bool found;
+        if (snap != nullptr && snap->pinned()) {
+            snapshotReadTx(snap, [&] () {
+                found = family->getPointer(k, &data, &size);
+            });
+            if (!found) return Status::NotFound("key Not Found");
+            value->PinSlice(Slice(data, size), nullptr, nullptr);
+            return Status::OK();
+        }
+#ifdef PTM_PIN_REPLICA
+        if (PTM_PIN_REPLICA()) {
+            found = PTM_PINNED_READ_TX<bool>([&] () {
+                return family->getPointer(k, &data, &size);
+            });
+            if (!found) {
+                PTM_UNPIN_REPLICA();
+                return Status::NotFound("key Not Found");
+            }
+            value->PinSlice(Slice(data, size), releaseReplica, nullptr);
+            return Status::OK();
+        }
+#endif
+        Status s = Get(options, column_family, k, value->GetSelf());
+        value->PinSelf();
+        return s;
+    }
+
+    void MultiGet(const ReadOptions& options, const std::vector<Slice>& keys,
+                  std::vector<std::string>* values, std::vector<Status>* statuses) {
+        const size_t n = keys.size();
+        values->assign(n, std::string());
+        std::unique_ptr<bool[]> found {new bool[n]};
+        // Same as in Get(), the lambda writes on our values
+        snapshotReadTx(static_cast<const SnapshotImpl*>(options.snapshot), [&] () {
+            defaultFamily_.multiGet(keys.data(), n, values->data(), found.get());
+        });
+        statuses->clear();
+        statuses->reserve(n);
+        for (size_t i = 0; i < n; i++) {
+            statuses->push_back(found[i] ? Status::OK() : Status::NotFound("key Not Found"));
+        }
+    }
+
     // Return a heap-allocated iterator over the contents of the database.
     // The result of NewIterator() is initially invalid (caller must
     // call one of the Seek methods on the iterator before using it).
@@ -161,11 +249,140 @@ public:
     // Caller should delete the iterator when it is no longer needed.
     // The returned iterator should be deleted before this db is deleted.
     Iterator* NewIterator(const ReadOptions& options) {
-        return new TMHashMapIterator(hashMap);
+        return defaultFamily_.newIterator(options.snapshot);
     }
 
+    Iterator* NewIterator(const ReadOptions& options, ColumnFamilyHandle* column_family) {
+        ColumnFamilyImpl* family = openFamilyOf(column_family);
+        if (family == nullptr) return NewErrorIterator(Status::InvalidArgument("column family is not open"));
+        return family->newIterator(options.snapshot);
+    }
 
-    //virtual bool GetProperty(const Slice& property, std::string* value);
+    // The families other than the default one are in the ColumnFamilyCatalog. Creating or dropping a family is
+    // a transaction of its own, and the handles are never deleted before the DB, so that the transactions of
+    // a Write() that refer to a family that is being dropped don't use a deleted handle.
+    Status CreateColumnFamily(const Options& options, const std::string& name, ColumnFamilyHandle** handle) {
+        *handle = nullptr;
+        const bool ordered = options.index_type == kOrderedIndex;
+        std::lock_guard<std::mutex> lock(familiesMutex_);
+        for (uint32_t id = 0; id < kMaxColumnFamilies; id++) {
+            ColumnFamilyImpl* family = families_[id].load();
+            if (family == nullptr || family->GetName() != name) continue;
+            if (family->ordered() != ordered) return Status::InvalidArgument("column family has another index type");
+            *handle = family;
+            return Status::OK();
+        }
+        const long hashBuckets = options.hash_index_buckets;
+#ifdef PTMDB_CAPTURE_BY_COPY
+        const long res = PTM_UPDATE_TX<long>([n = name, ordered, hashBuckets] () {
+            return openFamily(n, ordered, hashBuckets);
+        });
+#else
+        long res;
+        PTM_UPDATE_TX([&] () {
+            res = openFamily(name, ordered, hashBuckets);
+        });
+#endif
+        if (res == ColumnFamilyCatalog::FULL) return Status::InvalidArgument("too many column families");
+        if (res == ColumnFamilyCatalog::WRONG_INDEX_TYPE) {
+            return Status::InvalidArgument("column family has another index type");
+        }
+        ColumnFamilyImpl* family = new ColumnFamilyImpl((uint32_t)res, name, options);
+        handles_.emplace_back(family);
+        snapshotReadTx(nullptr, [&] () {
+            ColumnFamilyCatalog::Entry& entry = PTM_GET_ROOT<ColumnFamilyCatalog>(ColumnFamilyCatalog::ROOT)->entries[res-1];
+            family->hashMap = entry.hashMap.pload();
+            family->skipList = entry.skipList.pload();
+        });
+        families_[res] = family;
+        *handle = family;
+        return Status::OK();
+    }
+
+    Status DropColumnFamily(ColumnFamilyHandle* column_family) {
+        const uint32_t id = column_family->GetID();
+        if (id == 0) return Status::InvalidArgument("the default column family can not be dropped");
+        std::lock_guard<std::mutex> lock(familiesMutex_);
+        if (families_[id].load() != column_family) return Status::InvalidArgument("column family is not open");
+        families_[id] = nullptr;
+        // The transactions that loaded the handle before it was removed from families_ see an empty family
+        ColumnFamilyImpl* family = static_cast<ColumnFamilyImpl*>(column_family);
+        family->hashMap = nullptr;
+        family->skipList = nullptr;
+#ifdef PTMDB_CAPTURE_BY_COPY
+        PTM_UPDATE_TX<bool>([id] () {
+            PTM_GET_ROOT<ColumnFamilyCatalog>(ColumnFamilyCatalog::ROOT)->drop(id);
+            return true;
+        });
+#else
+        PTM_UPDATE_TX([&] () {
+            PTM_GET_ROOT<ColumnFamilyCatalog>(ColumnFamilyCatalog::ROOT)->drop(id);
+        });
+#endif
+        return Status::OK();
+    }
+
+    ColumnFamilyHandle* DefaultColumnFamily() {
+        return &defaultFamily_;
+    }
+
+    const Snapshot* GetSnapshot() {
+        return new SnapshotImpl();
+    }
+
+    void ReleaseSnapshot(const Snapshot* snapshot) {
+        delete static_cast<const SnapshotImpl*>(snapshot);
+    }
+
+
+    bool GetProperty(const Slice& property, std::string* value) {
+        value->clear();
+        // Copies of a Slice own their bytes, so work on a std::string instead
+        const std::string prefix("ptmdb.");
+        if (!property.starts_with(prefix)) return false;
+        const std::string in = property.ToString().substr(prefix.size());
+
+        if (in == "num-entries") {
+            *value = std::to_string(size());
+            return true;
+        }
+#ifdef PTM_STATS
+        auto stats = PTM_STATS();
+        if (in == "stats") {
+            char buf[512];
+            snprintf(buf, sizeof(buf),
+                     "                               PTM counters\n"
+                     "pwbs        pfences     ntBytes     redoEntries fullCopies  updateTxs   readTxs     pwbs/update\n"
+                     "--------------------------------------------------------------------------------------------------\n"
+                     "%-11llu %-11llu %-11llu %-11llu %-11llu %-11llu %-11llu %.2f\n",
+                     (unsigned long long)stats.pwbs, (unsigned long long)stats.pfences,
+                     (unsigned long long)stats.ntBytes, (unsigned long long)stats.redoEntries,
+                     (unsigned long long)stats.fullCopies, (unsigned long long)stats.updateTxs,
+                     (unsigned long long)stats.readTxs,
+                     stats.updateTxs == 0 ? 0.0 : (double)stats.pwbs/stats.updateTxs);
+            value->append(buf);
+            return true;
+        }
+        const std::pair<const char*, uint64_t> counters[] = {
+            {"pwbs", stats.pwbs}, {"pfences", stats.pfences}, {"nt-bytes", stats.ntBytes},
+            {"redo-entries", stats.redoEntries}, {"full-copies", stats.fullCopies},
+            {"update-txs", stats.updateTxs}, {"read-txs", stats.readTxs},
+        };
+        for (auto& counter : counters) {
+            if (in == counter.first) {
+                *value = std::to_string(counter.second);
+                return true;
+            }
+        }
+#endif
+#ifdef PTM_PHASES
+        if (in == "phases") {
+            *value = PTM_PHASES();
+            return true;
+        }
+#endif
+        return false;
+    }
     //virtual void GetApproximateSizes(const Range* range, int n, uint64_t* sizes);
 
     // Record a sample of bytes read at the specified internal key.
@@ -185,7 +402,207 @@ private:
     bool owns_info_log_;
     bool owns_cache_;
     std::string dbname_;
-    TMHashMap* hashMap {nullptr};
+    // Not OK if the constructor could not open the database, returned by DB::Open()
+    Status openStatus_;
+    // The default column family: the hashmap is in root 0 and the skip list in root 1
+    ColumnFamilyImpl defaultFamily_;
+    // The open column families, by id. Read without the mutex by the transactions of Write().
+    std::atomic<ColumnFamilyImpl*> families_[kMaxColumnFamilies];
+    // All the handles of CreateColumnFamily(), including the ones of dropped families
+    std::vector<std::unique_ptr<ColumnFamilyImpl>> handles_;
+    std::mutex familiesMutex_;
+
+    // Results of the transaction of Write()
+    static const int BATCH_OK = 0;
+    static const int BATCH_MALFORMED = 1;
+    static const int BATCH_MERGE_FAILED = 2;
+    static const int BATCH_UNKNOWN_FAMILY = 3;
+
+    static Status batchStatus(int res) {
+        if (res == BATCH_MALFORMED) return Status::Corruption("malformed WriteBatch");
+        if (res == BATCH_UNKNOWN_FAMILY) return Status::InvalidArgument("column family is not open");
+        if (res == BATCH_MERGE_FAILED) return Status::InvalidArgument("merge operator failed");
+        return Status::OK();
+    }
+
+    // The open family with the id 'id', nullptr if there is none. Also called by the transactions of Write().
+    ColumnFamilyImpl* familyOf(uint32_t id) {
+        return id < kMaxColumnFamilies ? families_[id].load() : nullptr;
+    }
+
+    // The family of a handle given by the user, nullptr if it is not open (it was dropped)
+    ColumnFamilyImpl* openFamilyOf(ColumnFamilyHandle* column_family) {
+        ColumnFamilyImpl* family = static_cast<ColumnFamilyImpl*>(column_family);
+        return familyOf(family->GetID()) == family ? family : nullptr;
+    }
+
+    // Called inside the transaction of Write(). The whole batch is checked before the first update, so that a
+    // batch with an error has no effect: the PTMs can't abort a transaction.
+    int applyBatch(const std::string& rep) {
+        BatchChecker checker {this};
+        if (!WriteBatch::iterateRecords(rep, &checker).ok()) return BATCH_MALFORMED;
+        if (checker.result() != BATCH_OK) return checker.result();
+        if (!checker.merged.empty()) {
+            MergeChecker merges {this, checker.merged};
+            WriteBatch::iterateRecords(rep, &merges);
+            if (merges.mergeFailed) return BATCH_MERGE_FAILED;
+        }
+        BatchApplier applier {this};
+        WriteBatch::iterateRecords(rep, &applier);
+        return BATCH_OK;
+    }
+
+    // First pass of applyBatch(), which doesn't modify the indexes: decodes the whole batch, checks that the
+    // families of the updates are open and that the families of the merges have a merge operator, and keeps
+    // the keys that are merged.
+    struct BatchChecker : public WriteBatch::Handler {
+        DBImpl* db;
+        bool mergeFailed {false};
+        bool unknownFamily {false};
+        // Keys of the merges of the batch, by family id
+        std::set<std::pair<uint32_t,std::string>> merged;
+        BatchChecker(DBImpl* db) : db{db} { }
+        void Put(const Slice& key, const Slice& value) { }
+        void Delete(const Slice& key) { }
+        void Merge(const Slice& key, const Slice& operand) { MergeCF(0, key, operand); }
+        void PutCF(uint32_t id, const Slice& key, const Slice& value) { checkFamily(id); }
+        void DeleteCF(uint32_t id, const Slice& key) { checkFamily(id); }
+        void MergeCF(uint32_t id, const Slice& key, const Slice& operand) {
+            ColumnFamilyImpl* family = checkFamily(id);
+            if (family == nullptr) return;
+            if (family->mergeOperator() == nullptr) {
+                mergeFailed = true;
+                return;
+            }
+            merged.emplace(id, key.ToString());
+        }
+        ColumnFamilyImpl* checkFamily(uint32_t id) {
+            ColumnFamilyImpl* family = db->familyOf(id);
+            if (family == nullptr) unknownFamily = true;
+            return family;
+        }
+        int result() const {
+            if (unknownFamily) return BATCH_UNKNOWN_FAMILY;
+            return mergeFailed ? BATCH_MERGE_FAILED : BATCH_OK;
+        }
+    };
+
+    // Pass of applyBatch() between the BatchChecker and the BatchApplier, only for a batch with merges: checks
+    // that the merges succeed. The merges are done on copies of the values of the merged keys, which have the
+    // updates of the batch that come before them. The updates of the other keys are skipped.
+    struct MergeChecker : public WriteBatch::Handler {
+        DBImpl* db;
+        const std::set<std::pair<uint32_t,std::string>>& merged;
+        bool mergeFailed {false};
+        // Values of the merged keys updated so far, by family id and key. The first member is false when the
+        // key was deleted.
+        std::map<std::pair<uint32_t,std::string>, std::pair<bool,std::string>> values;
+        MergeChecker(DBImpl* db, const std::set<std::pair<uint32_t,std::string>>& merged) : db{db}, merged{merged} { }
+        void Put(const Slice& key, const Slice& value) { PutCF(0, key, value); }
+        void Delete(const Slice& key) { DeleteCF(0, key); }
+        void Merge(const Slice& key, const Slice& operand) { MergeCF(0, key, operand); }
+        void PutCF(uint32_t id, const Slice& key, const Slice& value) {
+            auto k = std::make_pair(id, key.ToString());
+            if (merged.count(k) != 0) values[std::move(k)] = std::make_pair(true, value.ToString());
+        }
+        void DeleteCF(uint32_t id, const Slice& key) {
+            auto k = std::make_pair(id, key.ToString());
+            if (merged.count(k) != 0) values[std::move(k)] = std::make_pair(false, std::string());
+        }
+        void MergeCF(uint32_t id, const Slice& key, const Slice& operand) {
+            ColumnFamilyImpl* family = db->familyOf(id);
+            if (family == nullptr || mergeFailed) return;
+            auto k = std::make_pair(id, key.ToString());
+            auto it = values.find(k);
+            if (it == values.end()) {
+                std::string value;
+                const bool found = family->get(key, &value);
+                it = values.emplace(std::move(k), std::make_pair(found, std::move(value))).first;
+            }
+            const Slice existing(it->second.second);
+            std::string newValue;
+            if (!family->mergeOperator()->Merge(key, it->second.first ? &existing : nullptr, operand, &newValue)) {
+                mergeFailed = true;
+                return;
+            }
+            it->second = std::make_pair(true, std::move(newValue));
+        }
+    };
+
+    // Last pass of applyBatch(), after the checks. If a family is dropped between the passes its updates are
+    // skipped, which is the same as doing them before the drop.
+    struct BatchApplier : public WriteBatch::Handler {
+        DBImpl* db;
+        BatchApplier(DBImpl* db) : db{db} { }
+        void Put(const Slice& key, const Slice& value) { db->defaultFamily_.put(key, value); }
+        void Delete(const Slice& key) { db->defaultFamily_.remove(key); }
+        void Merge(const Slice& key, const Slice& operand) { db->defaultFamily_.merge(key, operand); }
+        void PutCF(uint32_t id, const Slice& key, const Slice& value) {
+            ColumnFamilyImpl* family = db->familyOf(id);
+            if (family != nullptr) family->put(key, value);
+        }
+        void DeleteCF(uint32_t id, const Slice& key) {
+            ColumnFamilyImpl* family = db->familyOf(id);
+            if (family != nullptr) family->remove(key);
+        }
+        void MergeCF(uint32_t id, const Slice& key, const Slice& operand) {
+            ColumnFamilyImpl* family = db->familyOf(id);
+            if (family != nullptr) family->merge(key, operand);
+        }
+    };
+
+    // Must be called inside a transaction. Returns false, without creating anything, if the default family
+    // already has an index of the other type: root 0 is the hashmap and root 1 the skip list.
+    bool createIndex() {
+        if (defaultFamily_.ordered()) {
+            if (PTM_GET_ROOT<TMHashMap>(0) != nullptr) return false;
+            defaultFamily_.skipList = PTM_GET_ROOT<TMSkipListMap>(1);
+            if (defaultFamily_.skipList == nullptr) {
+                defaultFamily_.skipList = PTM_NEW<TMSkipListMap>();
+                PTM_PUT_ROOT(1, defaultFamily_.skipList.load());
+            }
+        } else {
+            // We expect the root pointer zero to be the hashmap
+            if (PTM_GET_ROOT<TMSkipListMap>(1) != nullptr) return false;
+            defaultFamily_.hashMap = PTM_GET_ROOT<TMHashMap>(0);
+            if (defaultFamily_.hashMap == nullptr) {
+                defaultFamily_.hashMap = PTM_NEW<TMHashMap>(defaultFamily_.hashBuckets());
+                PTM_PUT_ROOT(0, defaultFamily_.hashMap.load());
+            }
+        }
+        return true;
+    }
+
+    void deleteIndex() {
+        if (defaultFamily_.skipList != nullptr) {
+            PTM_DELETE(defaultFamily_.skipList.load());
+            PTM_PUT_ROOT<TMSkipListMap>(1, nullptr);
+        } else {
+            PTM_DELETE(defaultFamily_.hashMap.load());
+            PTM_PUT_ROOT<TMHashMap>(0, nullptr);
+        }
+        ColumnFamilyCatalog* catalog = PTM_GET_ROOT<ColumnFamilyCatalog>(ColumnFamilyCatalog::ROOT);
+        if (catalog != nullptr) {
+            PTM_DELETE(catalog);
+            PTM_PUT_ROOT<ColumnFamilyCatalog>(ColumnFamilyCatalog::ROOT, nullptr);
+        }
+    }
+
+    // Must be called inside a transaction. Returns the id of the family or one of the errors of ColumnFamilyCatalog::open()
+    static long openFamily(const std::string& name, bool ordered, long hashBuckets) {
+        ColumnFamilyCatalog* catalog = PTM_GET_ROOT<ColumnFamilyCatalog>(ColumnFamilyCatalog::ROOT);
+        if (catalog == nullptr) {
+            catalog = PTM_NEW<ColumnFamilyCatalog>();
+            PTM_PUT_ROOT(ColumnFamilyCatalog::ROOT, catalog);
+        }
+        return catalog->open(Slice(name), ordered, hashBuckets);
+    }
+
+#ifdef PTM_PIN_REPLICA
+    static void releaseReplica(void*) {
+        PTM_UNPIN_REPLICA();
+    }
+#endif
 
     // No copying allowed
     DBImpl(const DBImpl&);
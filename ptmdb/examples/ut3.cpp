@@ -0,0 +1,799 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "db.h"
+#include "ptmdb.h"
+
+
+// Value of the property ptmdb.num-entries
+static long numEntries(ptmdb::DB* db) {
+    std::string value;
+    bool found = db->GetProperty("ptmdb.num-entries", &value);
+    assert(found);
+    return atol(value.c_str());
+}
+
+// Overwrites and deletes, with the number of entries checked after each step
+static void testNumEntries(ptmdb::DB* db) {
+    const int N = 20000;
+    ptmdb::Status s{};
+    std::string value;
+
+    printf("Number of entries\n");
+    assert(numEntries(db) == 0);
+    s = db->Put(ptmdb::WriteOptions(), "first", "value");
+    assert(s.ok());
+    assert(numEntries(db) == 1);
+    s = db->Delete(ptmdb::WriteOptions(), "first");
+    assert(s.ok());
+    assert(numEntries(db) == 0);
+
+    for (int i = 0; i < N; i++) {
+        s = db->Put(ptmdb::WriteOptions(), std::to_string(i), std::to_string(i));
+        assert(s.ok());
+    }
+    assert(numEntries(db) == N);
+
+    // Overwrites, with values of another size and out of line
+    for (int i = 0; i < N; i += 3) {
+        s = db->Put(ptmdb::WriteOptions(), std::to_string(i), std::string(300, 'a' + i%26));
+        assert(s.ok());
+    }
+    assert(numEntries(db) == N);
+    for (int i = 0; i < N; i++) {
+        s = db->Get(ptmdb::ReadOptions(), std::to_string(i), &value);
+        assert(s.ok());
+        assert(value == (i % 3 == 0 ? std::string(300, 'a' + i%26) : std::to_string(i)));
+    }
+
+    // Deletes, and deletes of keys that are no longer there
+    for (int i = 0; i < N; i += 2) {
+        s = db->Delete(ptmdb::WriteOptions(), std::to_string(i));
+        assert(s.ok());
+    }
+    for (int i = 0; i < N; i += 4) {
+        s = db->Delete(ptmdb::WriteOptions(), std::to_string(i));
+        assert(s.IsNotFound());
+    }
+    assert(numEntries(db) == N/2);
+
+    for (int i = 0; i < N; i++) {
+        s = db->Delete(ptmdb::WriteOptions(), std::to_string(i));
+        assert(s.ok() == (i % 2 == 1));
+    }
+    assert(numEntries(db) == 0);
+}
+
+// The keys of a scan of 'it', from the first to the last one or the other way around
+static std::vector<std::string> scan(ptmdb::Iterator* it, bool forward) {
+    std::vector<std::string> keys;
+    if (forward) {
+        for (it->SeekToFirst(); it->Valid(); it->Next()) keys.push_back(it->key().ToString());
+    } else {
+        for (it->SeekToLast(); it->Valid(); it->Prev()) keys.push_back(it->key().ToString());
+    }
+    assert(it->status().ok());
+    return keys;
+}
+
+// Forward and reverse scans of an ordered column family, and of a Seek() followed by Prev()
+static void testOrderedScans(ptmdb::DB* db) {
+    const int N = 3000;
+    ptmdb::Status s{};
+    char key[32];
+
+    printf("Ordered scans\n");
+    ptmdb::Options options {};
+    options.index_type = ptmdb::kOrderedIndex;
+    ptmdb::ColumnFamilyHandle* ordered;
+    s = db->CreateColumnFamily(options, "scans", &ordered);
+    assert(s.ok());
+    for (int i = 0; i < N; i++) {
+        snprintf(key, sizeof(key), "key%05d", (i*7919) % N);
+        s = db->Put(ptmdb::WriteOptions(), ordered, key, std::string("v") + key);
+        assert(s.ok());
+    }
+
+    // The keys are in order, in both directions
+    ptmdb::Iterator* it = db->NewIterator(ptmdb::ReadOptions(), ordered);
+    std::vector<std::string> forward = scan(it, true);
+    std::vector<std::string> reverse = scan(it, false);
+    assert(forward.size() == (size_t)N);
+    assert(std::is_sorted(forward.begin(), forward.end()));
+    std::reverse(reverse.begin(), reverse.end());
+    assert(forward == reverse);
+    // Back and forth around a key in the middle
+    it->Seek("key01500");
+    assert(it->Valid() && it->key().ToString() == "key01500");
+    assert(it->value().ToString() == "vkey01500");
+    for (int i = 1; i <= 300; i++) {
+        it->Prev();
+        snprintf(key, sizeof(key), "key%05d", 1500-i);
+        assert(it->Valid() && it->key().ToString() == key);
+    }
+    it->Next();
+    assert(it->Valid() && it->key().ToString() == "key01201");
+    delete it;
+
+    s = db->DropColumnFamily(ordered);
+    assert(s.ok());
+}
+
+// Forward and reverse scans of the hash index: each key once, in the same order in both directions
+static void testHashScans(ptmdb::DB* db) {
+    const int N = 3000;
+    ptmdb::Status s{};
+    char key[32];
+
+    printf("Hash index scans\n");
+    for (int i = 0; i < N; i++) {
+        snprintf(key, sizeof(key), "key%05d", i);
+        s = db->Put(ptmdb::WriteOptions(), key, std::string("v") + key);
+        assert(s.ok());
+    }
+    ptmdb::Iterator* it = db->NewIterator(ptmdb::ReadOptions());
+    std::vector<std::string> forward = scan(it, true);
+    std::vector<std::string> reverse = scan(it, false);
+    assert(forward.size() == (size_t)N);
+    std::reverse(reverse.begin(), reverse.end());
+    assert(forward == reverse);
+    std::sort(forward.begin(), forward.end());
+    assert(std::unique(forward.begin(), forward.end()) == forward.end());
+    delete it;
+
+    for (int i = 0; i < N; i++) {
+        snprintf(key, sizeof(key), "key%05d", i);
+        s = db->Delete(ptmdb::WriteOptions(), key);
+        assert(s.ok());
+    }
+}
+
+// The reads on a snapshot don't see the updates done after it was taken
+static void testSnapshots(ptmdb::DB* db) {
+    ptmdb::Status s{};
+    std::string value;
+
+    printf("Snapshots\n");
+    s = db->Put(ptmdb::WriteOptions(), "snap-a", "old");
+    assert(s.ok());
+    s = db->Put(ptmdb::WriteOptions(), "snap-b", "old");
+    assert(s.ok());
+    const ptmdb::Snapshot* snapshot = db->GetSnapshot();
+    ptmdb::ReadOptions atSnapshot {};
+    atSnapshot.snapshot = snapshot;
+
+    s = db->Put(ptmdb::WriteOptions(), "snap-a", "new");
+    assert(s.ok());
+    s = db->Delete(ptmdb::WriteOptions(), "snap-b");
+    assert(s.ok());
+    s = db->Put(ptmdb::WriteOptions(), "snap-c", "new");
+    assert(s.ok());
+
+    s = db->Get(atSnapshot, "snap-a", &value);
+    assert(s.ok() && value == "old");
+    s = db->Get(atSnapshot, "snap-b", &value);
+    assert(s.ok() && value == "old");
+    s = db->Get(atSnapshot, "snap-c", &value);
+    assert(s.IsNotFound());
+    ptmdb::Iterator* it = db->NewIterator(atSnapshot);
+    std::vector<std::string> keys = scan(it, true);
+    std::sort(keys.begin(), keys.end());
+    assert(keys == std::vector<std::string>({"snap-a", "snap-b"}));
+    delete it;
+    db->ReleaseSnapshot(snapshot);
+
+    s = db->Get(ptmdb::ReadOptions(), "snap-a", &value);
+    assert(s.ok() && value == "new");
+    s = db->Get(ptmdb::ReadOptions(), "snap-b", &value);
+    assert(s.IsNotFound());
+    s = db->Delete(ptmdb::WriteOptions(), "snap-a");
+    assert(s.ok());
+    s = db->Delete(ptmdb::WriteOptions(), "snap-c");
+    assert(s.ok());
+}
+
+// MultiGet() of present and missing keys, in more than one group of lookups
+static void testMultiGet(ptmdb::DB* db) {
+    const int N = 100;
+    ptmdb::Status s{};
+
+    printf("MultiGet\n");
+    // The even keys are present, some with values too large to be in the node
+    for (int i = 0; i < N; i += 2) {
+        s = db->Put(ptmdb::WriteOptions(), "mget" + std::to_string(i), std::string(i < N/2 ? 10 : 300, 'a' + i%26));
+        assert(s.ok());
+    }
+    std::vector<std::string> keys;
+    for (int i = 0; i < N; i++) keys.push_back("mget" + std::to_string(i));
+    keys.push_back("mget0");
+    std::vector<ptmdb::Slice> slices(keys.begin(), keys.end());
+    std::vector<std::string> values(1, "stale");
+    std::vector<ptmdb::Status> statuses;
+    db->MultiGet(ptmdb::ReadOptions(), slices, &values, &statuses);
+    assert(values.size() == keys.size() && statuses.size() == keys.size());
+    for (int i = 0; i < N; i++) {
+        if (i % 2 == 0) {
+            assert(statuses[i].ok());
+            assert(values[i] == std::string(i < N/2 ? 10 : 300, 'a' + i%26));
+        } else {
+            assert(statuses[i].IsNotFound());
+            assert(values[i].empty());
+        }
+    }
+    assert(statuses[N].ok() && values[N] == values[0]);
+
+    for (int i = 0; i < N; i += 2) {
+        s = db->Delete(ptmdb::WriteOptions(), "mget" + std::to_string(i));
+        assert(s.ok());
+    }
+}
+
+// Get() into a PinnableSlice, with values that stay the same while they are pinned, after they are
+// overwritten or deleted. Without a snapshot, more values are pinned than there are snapshots.
+static void testPinnedGet(ptmdb::DB* db) {
+    const int N = 20;
+    ptmdb::Status s{};
+    auto valueOf = [] (int i) { return std::string(300 + i, 'a' + i%26); };
+
+    printf("Pinned Get\n");
+    for (int i = 0; i < N; i++) {
+        s = db->Put(ptmdb::WriteOptions(), "pin" + std::to_string(i), valueOf(i));
+        assert(s.ok());
+    }
+    ptmdb::PinnableSlice pinned[N];
+    for (int i = 0; i < N; i++) {
+        s = db->Get(ptmdb::ReadOptions(), "pin" + std::to_string(i), &pinned[i]);
+        assert(s.ok());
+        assert(pinned[i].ToString() == valueOf(i));
+#ifdef PTM_PIN_REPLICA
+        assert(pinned[i].IsPinned());
+#endif
+    }
+    ptmdb::PinnableSlice missing;
+    s = db->Get(ptmdb::ReadOptions(), "pin-missing", &missing);
+    assert(s.IsNotFound() && missing.size() == 0);
+
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < N; i++) {
+            s = db->Put(ptmdb::WriteOptions(), "pin" + std::to_string(i), std::string(300 + i, 'z'));
+            assert(s.ok());
+        }
+    }
+    for (int i = 0; i < N; i += 2) {
+        s = db->Delete(ptmdb::WriteOptions(), "pin" + std::to_string(i));
+        assert(s.ok());
+    }
+    for (int i = 0; i < N; i++) assert(pinned[i].ToString() == valueOf(i));
+
+    // A new Get sees the updates, the pins of the old values are kept
+    ptmdb::PinnableSlice after;
+    s = db->Get(ptmdb::ReadOptions(), "pin1", &after);
+    assert(s.ok() && after.ToString() == std::string(301, 'z'));
+    s = db->Get(ptmdb::ReadOptions(), "pin0", &after);
+    assert(s.IsNotFound() && after.size() == 0);
+    assert(pinned[0].ToString() == valueOf(0));
+
+    for (int i = 0; i < N; i++) pinned[i].Reset();
+    for (int i = 1; i < N; i += 2) {
+        s = db->Delete(ptmdb::WriteOptions(), "pin" + std::to_string(i));
+        assert(s.ok());
+    }
+}
+
+// The value of the counters of UInt64AddOperator()
+static std::string u64(uint64_t v) {
+    return std::string((const char*)&v, sizeof(v));
+}
+
+static uint64_t toU64(const std::string& s) {
+    uint64_t v;
+    assert(s.size() == sizeof(v));
+    std::memcpy(&v, s.data(), sizeof(v));
+    return v;
+}
+
+// Merges of counters, and the merges that fail
+static void testMerge(ptmdb::DB* db) {
+    ptmdb::Status s{};
+    std::string value;
+
+    printf("Merge\n");
+    s = db->Merge(ptmdb::WriteOptions(), "counter", u64(1));
+    assert(s.IsNotSupportedError());
+    ptmdb::Options options {};
+    options.merge_operator = ptmdb::UInt64AddOperator();
+    ptmdb::ColumnFamilyHandle* counters;
+    s = db->CreateColumnFamily(options, "counters", &counters);
+    assert(s.ok());
+
+    for (int i = 0; i < 100; i++) {
+        s = db->Merge(ptmdb::WriteOptions(), counters, "counter", u64(i));
+        assert(s.ok());
+    }
+    s = db->Get(ptmdb::ReadOptions(), counters, "counter", &value);
+    assert(s.ok() && toU64(value) == 4950);
+    // An operand or a value of another size fails the merge, and the value is unchanged
+    s = db->Merge(ptmdb::WriteOptions(), counters, "counter", "x");
+    assert(s.IsInvalidArgument());
+    s = db->Put(ptmdb::WriteOptions(), counters, "text", "abc");
+    assert(s.ok());
+    s = db->Merge(ptmdb::WriteOptions(), counters, "text", u64(1));
+    assert(s.IsInvalidArgument());
+    s = db->Get(ptmdb::ReadOptions(), counters, "counter", &value);
+    assert(s.ok() && toU64(value) == 4950);
+    s = db->Get(ptmdb::ReadOptions(), counters, "text", &value);
+    assert(s.ok() && value == "abc");
+
+    s = db->DropColumnFamily(counters);
+    assert(s.ok());
+}
+
+// A WriteBatch is applied entirely or not at all
+static void testBatch(ptmdb::DB* db) {
+    ptmdb::Status s{};
+    std::string value;
+
+    printf("WriteBatch\n");
+    ptmdb::Options options {};
+    options.merge_operator = ptmdb::UInt64AddOperator();
+    ptmdb::ColumnFamilyHandle* counters;
+    s = db->CreateColumnFamily(options, "batch", &counters);
+    assert(s.ok());
+
+    // The merges see the updates that come before them in the batch
+    ptmdb::WriteBatch batch;
+    batch.Put("batch-a", "a");
+    batch.Put(counters, "c", u64(5));
+    batch.Merge(counters, "c", u64(1));
+    batch.Delete(counters, "d");
+    batch.Merge(counters, "d", u64(7));
+    s = db->Write(ptmdb::WriteOptions(), &batch);
+    assert(s.ok());
+    s = db->Get(ptmdb::ReadOptions(), "batch-a", &value);
+    assert(s.ok() && value == "a");
+    s = db->Get(ptmdb::ReadOptions(), counters, "c", &value);
+    assert(s.ok() && toU64(value) == 6);
+    s = db->Get(ptmdb::ReadOptions(), counters, "d", &value);
+    assert(s.ok() && toU64(value) == 7);
+
+    // A merge that fails, after a Put that would make it fail: nothing is applied
+    batch.Clear();
+    batch.Put("batch-b", "b");
+    batch.Delete("batch-a");
+    batch.Merge(counters, "c", u64(1));
+    batch.Put(counters, "d", "abc");
+    batch.Merge(counters, "d", u64(1));
+    s = db->Write(ptmdb::WriteOptions(), &batch);
+    assert(s.IsInvalidArgument());
+    s = db->Get(ptmdb::ReadOptions(), "batch-b", &value);
+    assert(s.IsNotFound());
+    s = db->Get(ptmdb::ReadOptions(), "batch-a", &value);
+    assert(s.ok() && value == "a");
+    s = db->Get(ptmdb::ReadOptions(), counters, "c", &value);
+    assert(s.ok() && toU64(value) == 6);
+    s = db->Get(ptmdb::ReadOptions(), counters, "d", &value);
+    assert(s.ok() && toU64(value) == 7);
+
+    // An update of a family that was dropped: nothing is applied
+    batch.Clear();
+    batch.Put("batch-b", "b");
+    batch.Put(counters, "e", u64(1));
+    s = db->DropColumnFamily(counters);
+    assert(s.ok());
+    s = db->Write(ptmdb::WriteOptions(), &batch);
+    assert(s.IsInvalidArgument());
+    s = db->Get(ptmdb::ReadOptions(), "batch-b", &value);
+    assert(s.IsNotFound());
+
+    s = db->Delete(ptmdb::WriteOptions(), "batch-a");
+    assert(s.ok());
+}
+
+// The handle of a dropped column family is refused, and the family is empty when it's created again
+static void testDroppedFamily(ptmdb::DB* db) {
+    ptmdb::Status s{};
+    std::string value;
+    ptmdb::PinnableSlice pinned;
+
+    printf("Dropped column family\n");
+    ptmdb::ColumnFamilyHandle* family;
+    s = db->CreateColumnFamily(ptmdb::Options(), "dropped", &family);
+    assert(s.ok());
+    s = db->Put(ptmdb::WriteOptions(), family, "key", "value");
+    assert(s.ok());
+    s = db->DropColumnFamily(family);
+    assert(s.ok());
+    s = db->DropColumnFamily(family);
+    assert(s.IsInvalidArgument());
+    s = db->DropColumnFamily(db->DefaultColumnFamily());
+    assert(s.IsInvalidArgument());
+
+    s = db->Put(ptmdb::WriteOptions(), family, "key", "value");
+    assert(s.IsInvalidArgument());
+    s = db->Delete(ptmdb::WriteOptions(), family, "key");
+    assert(s.IsInvalidArgument());
+    s = db->Merge(ptmdb::WriteOptions(), family, "key", u64(1));
+    assert(s.IsInvalidArgument());
+    s = db->Get(ptmdb::ReadOptions(), family, "key", &value);
+    assert(s.IsInvalidArgument());
+    s = db->Get(ptmdb::ReadOptions(), family, "key", &pinned);
+    assert(s.IsInvalidArgument());
+    ptmdb::Iterator* it = db->NewIterator(ptmdb::ReadOptions(), family);
+    it->SeekToFirst();
+    assert(!it->Valid() && it->status().IsInvalidArgument());
+    delete it;
+
+    ptmdb::ColumnFamilyHandle* again;
+    s = db->CreateColumnFamily(ptmdb::Options(), "dropped", &again);
+    assert(s.ok());
+    s = db->Get(ptmdb::ReadOptions(), again, "key", &value);
+    assert(s.IsNotFound());
+    s = db->DropColumnFamily(again);
+    assert(s.ok());
+}
+
+// Opening the database with the other index type fails, and leaves the open database as it was
+static void testIndexType(ptmdb::DB* db) {
+    ptmdb::Status s{};
+    std::string value;
+
+    printf("Index type\n");
+    s = db->Put(ptmdb::WriteOptions(), "index", "hash");
+    assert(s.ok());
+    ptmdb::Options options {};
+    options.create_if_missing = true;
+    options.index_type = ptmdb::kOrderedIndex;
+    ptmdb::DB* other = db;
+    s = ptmdb::DB::Open(options, "/tmp/testdb", &other);
+    assert(s.IsInvalidArgument());
+    assert(other == nullptr);
+    s = db->Get(ptmdb::ReadOptions(), "index", &value);
+    assert(s.ok() && value == "hash");
+    s = db->Delete(ptmdb::WriteOptions(), "index");
+    assert(s.ok());
+}
+
+// Bytes in use in the heap of the PTM, 0 if the PTM doesn't tell
+static uint64_t usedSize() {
+#ifdef USE_REDOOPT
+    return PTM_READ_TX<uint64_t>([] () {
+        return redoopt::gRedo.esloco.getUsedSize();
+    });
+#else
+    return 0;
+#endif
+}
+
+// The memory of the deleted keys is reused by the next ones: the same keys and values written again
+// after being deleted don't use more memory. Each round has 8 MB of values, which the heap would grow
+// by if they were not reused.
+static void testAllocator(ptmdb::DB* db) {
+    const int N = 2000;
+    const uint64_t slack = 1024*1024;
+    ptmdb::Status s{};
+
+    printf("Allocator\n");
+    uint64_t usedAfterPut = 0;
+    uint64_t usedAfterDelete = 0;
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < N; i++) {
+            s = db->Put(ptmdb::WriteOptions(), std::to_string(i), std::string(4000 + i%100, 'a' + round));
+            assert(s.ok());
+        }
+        const uint64_t putSize = usedSize();
+        for (int i = 0; i < N; i++) {
+            s = db->Delete(ptmdb::WriteOptions(), std::to_string(i));
+            assert(s.ok());
+        }
+        const uint64_t deleteSize = usedSize();
+        if (round == 0) {
+            usedAfterPut = putSize;
+            usedAfterDelete = deleteSize;
+        }
+        assert(putSize <= usedAfterPut + slack);
+        assert(deleteSize <= usedAfterDelete + slack);
+    }
+    assert(numEntries(db) == 0);
+}
+
+
+#ifdef USE_REDOOPT
+// Bytes in use in the heap, to be called inside a transaction
+static uint64_t txUsedSize() {
+    return redoopt::gRedo.esloco.getUsedSize();
+}
+
+// Objects of up to 7 KB come from slabs: the memory of the objects of a class that are freed is reused
+// by the next allocations of that class, and two objects of the last class (7 KB) share a slab of 16 KB.
+// trim() gives back the slabs that are left empty.
+static void testSlabs() {
+    const int N = 500;
+
+    printf("Slabs\n");
+    bool ok = PTM_UPDATE_TX<bool>([&] () {
+        const uint64_t used0 = txUsedSize();
+        std::vector<void*> objs(N);
+        for (int i = 0; i < N; i++) objs[i] = TM_PMALLOC(100);
+        const uint64_t used1 = txUsedSize();
+        for (int i = 0; i < N; i++) TM_PFREE(objs[i]);
+        for (int i = 0; i < N; i++) objs[i] = TM_PMALLOC(100);
+        if (txUsedSize() != used1) return false;
+        for (int i = 0; i < N; i++) TM_PFREE(objs[i]);
+        void* big1 = TM_PMALLOC(7000);
+        void* big2 = TM_PMALLOC(7000);
+        const int64_t dist = (uint8_t*)big2 - (uint8_t*)big1;
+        if (dist < -16*1024 || dist > 16*1024) return false;
+        TM_PFREE(big1);
+        TM_PFREE(big2);
+        redoopt::RedoOpt::ptrim();
+        return txUsedSize() <= used0;
+    });
+    assert(ok);
+}
+
+// Blocks are merged with their free buddies and the top of the heap is lowered on free(), so the used
+// size goes back to what it was once all the blocks are freed, in any order.
+static void testCoalescing() {
+    const int N = 256;
+
+    printf("Coalescing\n");
+    bool ok = PTM_UPDATE_TX<bool>([&] () {
+        const uint64_t used0 = txUsedSize();
+        std::vector<void*> blocks(N);
+        // 12 KB and 20 KB take blocks of 16 KB and 32 KB, they don't fit in a slab
+        for (int i = 0; i < N; i++) blocks[i] = TM_PMALLOC(i%2 == 0 ? 12*1024 : 20*1024);
+        if (txUsedSize() < used0 + N/2*(16+32)*1024) return false;
+        for (int i = 0; i < N; i += 2) TM_PFREE(blocks[i]);
+        for (int i = N-1; i > 0; i -= 2) TM_PFREE(blocks[i]);
+        return txUsedSize() <= used0;
+    });
+    assert(ok);
+}
+
+// Objects of more than 16 KB are extents in an arena: a freed extent is reused by the next one that
+// fits, and the arenas go back to the heap when all their extents are freed.
+static void testExtents() {
+    const int N = 40;
+    const size_t MB = 1024*1024;
+
+    printf("Extents\n");
+    bool ok = PTM_UPDATE_TX<bool>([&] () {
+        const uint64_t used0 = txUsedSize();
+        void* ext1 = TM_PMALLOC(MB);
+        TM_PFREE(ext1);
+        void* ext2 = TM_PMALLOC(MB);
+        if (ext2 != ext1) return false;
+        TM_PFREE(ext2);
+        std::vector<void*> exts(N);
+        for (int i = 0; i < N; i++) {
+            exts[i] = TM_PMALLOC(i*37*1024 + 17*1024);
+            *(TM_TYPE<uint64_t>*)exts[i] = i;
+        }
+        for (int i = 0; i < N; i++) {
+            if (((TM_TYPE<uint64_t>*)exts[i])->pload() != (uint64_t)i) return false;
+        }
+        for (int i = 0; i < N; i += 3) TM_PFREE(exts[i]);
+        for (int i = 1; i < N; i += 3) TM_PFREE(exts[i]);
+        for (int i = 2; i < N; i += 3) TM_PFREE(exts[i]);
+        return txUsedSize() <= used0;
+    });
+    assert(ok);
+}
+
+// With lease mode on, more threads than MAX_THREADS use the database, each leasing a tid only for
+// the duration of its transactions
+static void testLeaseMode(ptmdb::DB* db) {
+    const int numThreads = 160;
+    const int N = 20;
+
+    printf("Lease mode\n");
+    ThreadRegistry::setLeaseMode(true);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; t++) {
+        threads.emplace_back([db, t] () {
+            for (int i = 0; i < N; i++) {
+                const std::string key = "lease" + std::to_string(t) + "-" + std::to_string(i);
+                ptmdb::Status s = db->Put(ptmdb::WriteOptions(), key, std::to_string(t*N+i));
+                assert(s.ok());
+                std::string value;
+                s = db->Get(ptmdb::ReadOptions(), key, &value);
+                assert(s.ok() && value == std::to_string(t*N+i));
+            }
+        });
+    }
+    for (auto& th : threads) th.join();
+    ThreadRegistry::setLeaseMode(false);
+    assert(numEntries(db) == numThreads*N);
+    for (int t = 0; t < numThreads; t++) {
+        for (int i = 0; i < N; i++) {
+            ptmdb::Status s = db->Delete(ptmdb::WriteOptions(), "lease" + std::to_string(t) + "-" + std::to_string(i));
+            assert(s.ok());
+        }
+    }
+    assert(numEntries(db) == 0);
+}
+
+struct HPNode {
+    static std::atomic<long> numDeleted;
+    uint64_t key;
+    HPNode(uint64_t key) : key{key} { }
+    ~HPNode() { numDeleted.fetch_add(1); }
+};
+std::atomic<long> HPNode::numDeleted {0};
+
+// Retired objects are deleted in batches, never while a hazard pointer protects them, and the number of
+// objects waiting to be deleted stays bounded
+static void testHazardPointers() {
+    const int numThreads = 4;
+    const int N = 20000;
+
+    printf("Hazard pointers\n");
+    HazardPointers<HPNode>* hp = new HazardPointers<HPNode>(1, numThreads);
+    // One thread, an object protected while others are retired around it
+    HPNode* kept = new HPNode(7);
+    hp->protectPtr(0, kept, 0);
+    hp->retire(kept, 0);
+    for (int i = 0; i < N; i++) hp->retire(new HPNode(i), 0);
+    assert(kept->key == 7);
+    assert(HPNode::numDeleted.load() >= N-64);
+    hp->clear(0);
+    for (int i = 0; i < 64; i++) hp->retire(new HPNode(i), 0);
+    assert(HPNode::numDeleted.load() >= N+1);
+
+    // Readers protect the current node while writers replace it and retire the old one
+    std::atomic<HPNode*> current {new HPNode(0)};
+    std::atomic<bool> stop {false};
+    std::vector<std::thread> threads;
+    for (int t = 1; t < numThreads; t++) {
+        threads.emplace_back([&, t] () {
+            uint64_t last = 0;
+            while (!stop.load()) {
+                HPNode* node = hp->protect(0, current, t);
+                assert(node->key >= last);
+                last = node->key;
+                hp->clear(t);
+            }
+        });
+    }
+    const long deleted0 = HPNode::numDeleted.load();
+    for (int i = 1; i <= N; i++) hp->retire(current.exchange(new HPNode(i)), 0);
+    stop.store(true);
+    for (auto& th : threads) th.join();
+    assert(HPNode::numDeleted.load() - deleted0 >= N - 64 - numThreads);
+    delete current.load();
+    delete hp;
+}
+
+// Root object with the blocks of testHeapGrowth(), which are checked after the database is opened again
+struct GrowRoot {
+    static const int MAX_BLOCKS = 512;
+    static const uint64_t BLOCK_SIZE = 1024*1024;
+    TM_TYPE<uint64_t> numBlocks {0};
+    TM_TYPE<uint64_t> heapSize {0};
+    TM_TYPE<uint8_t*> blocks[MAX_BLOCKS];
+};
+
+static const int GROW_ROOT = 3;
+
+// The first and last word of each block
+static bool checkBlock(uint8_t* block, uint64_t i) {
+    TM_TYPE<uint64_t>* words = (TM_TYPE<uint64_t>*)block;
+    const uint64_t last = GrowRoot::BLOCK_SIZE/sizeof(TM_TYPE<uint64_t>) - 1;
+    return words[0].pload() == i && words[last].pload() == ~i;
+}
+
+// Fills the heap past its initial size (PM_REGION_SIZE/MAX_COMBINEDS) with blocks of 1 MB, which
+// makes it grow online. The blocks are checked again by checkHeapGrowth() in a new process.
+static void testHeapGrowth() {
+    printf("Heap growth\n");
+    const uint64_t initialHeap = redoopt::RedoOpt::heapSize();
+    GrowRoot* root = PTM_UPDATE_TX<GrowRoot*>([] () {
+        GrowRoot* root = PTM_NEW<GrowRoot>();
+        PTM_PUT_ROOT(GROW_ROOT, root);
+        return root;
+    });
+    uint64_t numBlocks = 0;
+    while (numBlocks < GrowRoot::MAX_BLOCKS) {
+        numBlocks = PTM_UPDATE_TX<uint64_t>([root] () {
+            uint64_t i = root->numBlocks.pload();
+            for (uint64_t end = i + 16; i < end; i++) {
+                uint8_t* block = (uint8_t*)TM_PMALLOC(GrowRoot::BLOCK_SIZE);
+                TM_TYPE<uint64_t>* words = (TM_TYPE<uint64_t>*)block;
+                words[0] = i;
+                words[GrowRoot::BLOCK_SIZE/sizeof(TM_TYPE<uint64_t>) - 1] = ~i;
+                root->blocks[i] = block;
+            }
+            root->numBlocks = i;
+            root->heapSize = redoopt::RedoOpt::heapSize();
+            return i;
+        });
+        // A few more blocks once the heap has grown
+        if (redoopt::RedoOpt::heapSize() > initialHeap && numBlocks*GrowRoot::BLOCK_SIZE > initialHeap + 16*GrowRoot::BLOCK_SIZE) break;
+    }
+    assert(redoopt::RedoOpt::heapSize() > initialHeap);
+    bool ok = PTM_READ_TX<bool>([root] () {
+        for (uint64_t i = 0; i < root->numBlocks.pload(); i++) {
+            if (!checkBlock(root->blocks[i].pload(), i)) return false;
+        }
+        return root->heapSize.pload() == redoopt::RedoOpt::heapSize();
+    });
+    assert(ok);
+}
+
+// Runs in the process started by testHeapGrowth(): the heap keeps its size and the blocks their contents
+static void checkHeapGrowth() {
+    printf("Heap growth, reopened\n");
+    bool ok = PTM_READ_TX<bool>([] () {
+        GrowRoot* root = PTM_GET_ROOT<GrowRoot>(GROW_ROOT);
+        if (root == nullptr || root->numBlocks.pload() == 0) return false;
+        if (redoopt::RedoOpt::heapSize() != root->heapSize.pload()) return false;
+        if (redoopt::gRedo.esloco.getPoolSize() != root->heapSize.pload()) return false;
+        for (uint64_t i = 0; i < root->numBlocks.pload(); i++) {
+            if (!checkBlock(root->blocks[i].pload(), i)) return false;
+        }
+        return true;
+    });
+    assert(ok);
+    PTM_UPDATE_TX<bool>([] () {
+        GrowRoot* root = PTM_GET_ROOT<GrowRoot>(GROW_ROOT);
+        for (uint64_t i = 0; i < root->numBlocks.pload(); i++) TM_PFREE(root->blocks[i].pload());
+        PTM_DELETE(root);
+        PTM_PUT_ROOT(GROW_ROOT, (GrowRoot*)nullptr);
+        return true;
+    });
+}
+#endif
+
+
+int main(int argc, char* argv[]) {
+#ifdef USE_REDOOPT
+    if (argc > 1 && std::string(argv[1]) == "--reopen") {
+        checkHeapGrowth();
+        std::cout<<"Test Passed\n";
+        return 0;
+    }
+#endif
+    ptmdb::DB* db;
+    ptmdb::Options options {};
+    options.create_if_missing = true;
+    ptmdb::Status status = ptmdb::DB::Open(options, "/tmp/testdb", &db);
+    assert(status.ok());
+
+    testNumEntries(db);
+    testOrderedScans(db);
+    testHashScans(db);
+    testSnapshots(db);
+    testMultiGet(db);
+    testPinnedGet(db);
+    testMerge(db);
+    testBatch(db);
+    testDroppedFamily(db);
+    testIndexType(db);
+    testAllocator(db);
+#ifdef USE_REDOOPT
+    testSlabs();
+    testCoalescing();
+    testExtents();
+    testLeaseMode(db);
+    testHazardPointers();
+    testHeapGrowth();
+#endif
+
+    delete db;
+#ifdef USE_REDOOPT
+    // The heap is checked again in a new process, which opens the file that this one leaves
+    fflush(stdout);
+    execl("/proc/self/exe", argv[0], "--reopen", (char*)nullptr);
+    perror("execl");
+    return 1;
+#endif
+    std::cout<<"Test Passed\n";
+}
@@ -0,0 +1,69 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef _PTMDB_INCLUDE_MERGE_OPERATOR_H_
+#define _PTMDB_INCLUDE_MERGE_OPERATOR_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include "slice.h"
+
+namespace ptmdb {
+
+// A MergeOperator does the read-modify-write of DB::Merge(): it computes
+// the new value of a key from its current value and an operand, inside the
+// write transaction of the merge, so a merge costs a single transaction.
+// A MergeOperator implementation must be thread-safe since ptmdb may invoke
+// its methods concurrently from multiple threads.
+// The transaction may be executed more than once (on each replica, or again
+// after a failed attempt), so Merge() must always give the same result for
+// the same arguments and must not have side effects.
+class MergeOperator {
+ public:
+  virtual ~MergeOperator() { }
+
+  // Sets "*new_value" to the result of applying "operand" to
+  // "existing_value", which is NULL if "key" is not in the database.
+  // "existing_value" is only valid during the call.
+  // Returns false if the merge is not possible, in which case the entry
+  // of "key" is left unchanged.
+  virtual bool Merge(const Slice& key, const Slice* existing_value,
+                     const Slice& operand, std::string* new_value) const = 0;
+
+  // The name of the merge operator.
+  virtual const char* Name() const = 0;
+};
+
+// Return a builtin merge operator for counters.  The values and the
+// operands are 64-bit unsigned integers stored in 8 bytes, in the byte
+// order of the machine, and the operand is added to the value (a missing
+// value is zero).  A value or an operand of another size fails the merge.
+// The result remains the property of this module and must not be deleted.
+inline const MergeOperator* UInt64AddOperator() {
+  class UInt64AddOperatorImpl : public MergeOperator {
+   public:
+    bool Merge(const Slice& key, const Slice* existing_value,
+               const Slice& operand, std::string* new_value) const {
+      uint64_t value = 0;
+      uint64_t delta;
+      if (operand.size() != sizeof(delta)) return false;
+      std::memcpy(&delta, operand.data(), sizeof(delta));
+      if (existing_value != NULL) {
+        if (existing_value->size() != sizeof(value)) return false;
+        std::memcpy(&value, existing_value->data(), sizeof(value));
+      }
+      value += delta;
+      new_value->assign(reinterpret_cast<const char*>(&value), sizeof(value));
+      return true;
+    }
+    const char* Name() const { return "ptmdb.UInt64AddOperator"; }
+  };
+  static const UInt64AddOperatorImpl singleton;
+  return &singleton;
+}
+
+}  // namespace ptmdb
+
+#endif  // _PTMDB_INCLUDE_MERGE_OPERATOR_H_
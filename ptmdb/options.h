@@ -2,15 +2,22 @@
 #define _RDB_INCLUDE_OPTIONS_H_
 
 #include "env.h"
+#include "comparator.h"
+#include "merge_operator.h"
 
 namespace ptmdb {
 
 //class Cache;
-//class Comparator;
 //class Env;
 //class FilterPolicy;
 //class Logger;
-//class Snapshot;
+class Snapshot;
+
+// Index used to store the keys of a database
+enum IndexType {
+  kHashIndex = 0x0,       // Hash map, iterators go over the keys in hash order
+  kOrderedIndex = 0x1     // Skip list, iterators go over the keys in the order of the comparator
+};
 
 // Options to control the behavior of a database (passed to DB::Open)
 struct Options {
@@ -23,7 +30,29 @@ struct Options {
   // REQUIRES: The client must ensure that the comparator supplied
   // here has the same name and orders keys *exactly* the same as the
   // comparator provided to previous open calls on the same DB.
-  //const Comparator* comparator;
+  // Only used by the ordered index.
+  const Comparator* comparator;
+
+  // Index of the keys. The ordered index supports Seek() and range scans,
+  // the hash index has faster point lookups.
+  //
+  // REQUIRES: The same index type as in previous open calls on the same DB,
+  // otherwise DB::Open() returns InvalidArgument.
+  // Default: kHashIndex
+  IndexType index_type;
+
+  // Merge operator used by DB::Merge() and WriteBatch::Merge(), which fail
+  // when it is NULL.  The merges are applied when they are written, so it
+  // may change between open calls.
+  // Default: NULL
+  const MergeOperator* merge_operator;
+
+  // Number of buckets of the hash index when the database is created,
+  // rounded up to a power of two. The index grows by itself as keys are
+  // added, a bucket at a time, so this only avoids the growth for a
+  // database whose size is known in advance.
+  // Default: 64K
+  size_t hash_index_buckets;
 
   // If true, the database will be created if it is missing.
   // Default: false
@@ -140,6 +169,10 @@ struct Options {
 
   // Create an Options object with default values for all fields.
   Options() {
+      comparator = BytewiseComparator();
+      index_type = kHashIndex;
+      merge_operator = NULL;
+      hash_index_buckets = 64*1024;
       create_if_missing = false;
       error_if_exists = false;
       write_buffer_size = 4<<20;
@@ -168,12 +201,12 @@ struct ReadOptions {
   // not have been released).  If "snapshot" is NULL, use an implicit
   // snapshot of the state at the beginning of this read operation.
   // Default: NULL
-  //const Snapshot* snapshot;
+  const Snapshot* snapshot;
 
   ReadOptions()
       : verify_checksums(false),
-        fill_cache(true)
-        //snapshot(NULL)
+        fill_cache(true),
+        snapshot(NULL)
   { }
 };
 
@@ -9,10 +9,19 @@
 #ifndef _HAZARD_POINTERS_REDO_H_
 #define _HAZARD_POINTERS_REDO_H_
 
+#include <algorithm>
 #include <atomic>
 #include <iostream>
 #include <vector>
 
+/*
+ * Retired objects are reclaimed in batches: a thread scans the hazard pointers only after it has retired
+ * R = HP_THRESHOLD_FACTOR*H more objects since its last scan, where H is the number of hazard pointers of the
+ * active threads (named 'R' and 'H' in the HP paper). A scan copies the non-null hazard pointers of the active
+ * threads into a sorted array and looks up each retired object in it, which is O(R log H). At most H retired
+ * objects can be protected, therefore the cost of a scan is amortized over at least R-H retires.
+ * The active threads are the ones with a tid below the highest tid that has published a hazard pointer.
+ */
 template<typename T>
 class HazardPointers {
 
@@ -20,21 +29,63 @@ private:
     static const int      HP_MAX_THREADS = 128;
     static const int      HP_MAX_HPS = 5;     // This is named 'K' in the HP paper
     static const int      CLPAD = 128/sizeof(std::atomic<T*>);
-    static const int      HP_THRESHOLD_R = 0; // This is named 'R' in the HP paper
+    static const int      HP_THRESHOLD_FACTOR = 2;  // R = HP_THRESHOLD_FACTOR*H
+    static const int      HP_THRESHOLD_MIN = 64;    // Minimum for R, so that a single thread doesn't scan on every retire
     static const int      MAX_RETIRED = HP_MAX_THREADS*HP_MAX_HPS; // Maximum number of retired objects per thread
 
     const int             maxHPs;
     const int             maxThreads;
 
+    struct alignas(128) RetiredList {
+        std::vector<T*>   objs;
+        std::vector<T*>   hazards;      // Used by scan(), kept here to avoid allocating on each scan
+        size_t            kept {0};     // Number of objects left by the last scan
+    };
+
     alignas(128) std::atomic<T*>*      hp[HP_MAX_THREADS];
-    // It's not nice that we have a lot of empty vectors, but we need padding to avoid false sharing
-    alignas(128) std::vector<T*>       retiredList[HP_MAX_THREADS*CLPAD];
+    alignas(128) RetiredList           retiredList[HP_MAX_THREADS];
+    alignas(128) std::atomic<int>      maxActive {0};  // Highest tid (+1) that has published a hazard pointer
+
+    // Must be seq-cst (like the store of the hazard pointer), otherwise a scan could miss the hazard pointers of this thread
+    inline void setActive(const int tid) {
+        if (tid < maxActive.load()) return;
+        int curMax = maxActive.load();
+        while (curMax <= tid && !maxActive.compare_exchange_strong(curMax, tid+1)) { }
+    }
+
+    /**
+     * Deletes the retired objects of 'tid' that are not protected by a hazard pointer
+     * Progress Condition: wait-free bounded (by the number of active threads and retired objects)
+     */
+    void scan(const int tid) {
+        RetiredList& rl = retiredList[tid];
+        rl.hazards.clear();
+        const int numActive = std::min(maxActive.load(), maxThreads);
+        for (int it = 0; it < numActive; it++) {
+            for (int ihp = 0; ihp < maxHPs; ihp++) {
+                T* ptr = hp[it][ihp].load();
+                if (ptr != nullptr) rl.hazards.push_back(ptr);
+            }
+        }
+        std::sort(rl.hazards.begin(), rl.hazards.end());
+        size_t kept = 0;
+        for (size_t iret = 0; iret < rl.objs.size(); iret++) {
+            T* obj = rl.objs[iret];
+            if (std::binary_search(rl.hazards.begin(), rl.hazards.end(), obj)) {
+                rl.objs[kept++] = obj;
+            } else {
+                delete obj;
+            }
+        }
+        rl.objs.resize(kept);
+        rl.kept = kept;
+    }
 
 public:
     HazardPointers(int maxHPs=HP_MAX_HPS, int maxThreads=HP_MAX_THREADS) : maxHPs{maxHPs}, maxThreads{maxThreads} {
         for (int it = 0; it < HP_MAX_THREADS; it++) {
             hp[it] = new std::atomic<T*>[CLPAD*2]; // We allocate four cache lines to allow for many hps and without false sharing
-            retiredList[it*CLPAD].reserve(MAX_RETIRED);
+            retiredList[it].objs.reserve(MAX_RETIRED);
             for (int ihp = 0; ihp < HP_MAX_HPS; ihp++) {
                 hp[it][ihp].store(nullptr, std::memory_order_relaxed);
             }
@@ -45,8 +96,8 @@ public:
         for (int it = 0; it < HP_MAX_THREADS; it++) {
             delete[] hp[it];
             // Clear the current retired nodes
-            for (unsigned iret = 0; iret < retiredList[it*CLPAD].size(); iret++) {
-                delete retiredList[it*CLPAD][iret];
+            for (unsigned iret = 0; iret < retiredList[it].objs.size(); iret++) {
+                delete retiredList[it].objs[iret];
             }
         }
     }
@@ -74,6 +125,7 @@ public:
      * Progress Condition: lock-free
      */
     inline T* protect(int index, const std::atomic<T*>& atom, const int tid) {
+        setActive(tid);
         T* n = nullptr;
         T* ret;
 		while ((ret = atom.load()) != n) {
@@ -89,6 +141,7 @@ public:
      * Progress Condition: wait-free population oblivious
      */
     inline T* protectPtr(int index, T* ptr, const int tid) {
+        setActive(tid);
         hp[tid][index].store(ptr);
         return ptr;
     }
@@ -100,35 +153,22 @@ public:
      * Progress Condition: wait-free population oblivious
      */
     inline T* protectPtrRelease(int index, T* ptr, const int tid) {
+        setActive(tid);
         hp[tid][index].store(ptr, std::memory_order_release);
         return ptr;
     }
 
 
     /**
-     * Progress Condition: wait-free bounded (by the number of threads squared)
+     * Progress Condition: wait-free bounded (by the number of active threads and retired objects)
      */
     void retire(T* ptr, const int tid) {
-        retiredList[tid*CLPAD].push_back(ptr);
-        if (retiredList[tid*CLPAD].size() < HP_THRESHOLD_R) return;
-        for (unsigned iret = 0; iret < retiredList[tid*CLPAD].size(); iret++) {
-            auto obj = retiredList[tid*CLPAD][iret];
-            bool canDelete = true;
-            for (int it = 0; it < maxThreads && canDelete; it++) {
-                for (int ihp = 0; ihp < maxHPs; ihp++) {
-                    if (hp[it][ihp].load() == obj) {
-                        canDelete = false;
-                        break;
-                    }
-                }
-            }
-            if (canDelete) { // Delete only if ORC is zero
-                retiredList[tid*CLPAD].erase(retiredList[tid*CLPAD].begin() + iret);
-                delete obj;
-                iret--;
-                continue;
-            }
-        }
+        RetiredList& rl = retiredList[tid];
+        rl.objs.push_back(ptr);
+        const size_t numHPs = (size_t)std::min(maxActive.load(std::memory_order_relaxed), maxThreads)*maxHPs;
+        const size_t threshold = std::max<size_t>(HP_THRESHOLD_FACTOR*numHPs, HP_THRESHOLD_MIN);
+        if (rl.objs.size() < rl.kept + threshold) return;
+        scan(tid);
     }
 };
 
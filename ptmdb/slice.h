@@ -18,8 +18,10 @@
 #include <cassert>
 #include <cstddef>
 #include <cstring>
+#include <memory>
 #include <string>
 #include "ptmdb.h"
+#include "util/hash.h"
 
 namespace ptmdb {
 
@@ -42,8 +44,10 @@ class Slice {
   // Copy constructor
   Slice(const Slice& other){
     size_ = other.size_;
-    data_ = new char[size_+1];
-    std::memcpy((void*)data_, (void*)other.data_, size_+1);
+    char* data = new char[size_+1];
+    std::memcpy(data, other.data_, size_);
+    data[size_] = 0;  // The source is not always followed by a zero
+    data_ = data;
     isreplica = true; // Tell the destructor to cleanup data_
     //printf("Slice copy constructor size=%ld\n", size_);
   }
@@ -90,11 +94,7 @@ class Slice {
   }
 
   uint64_t toHash() const {
-      uint64_t h = 5381;
-      for (size_t i = 0; i < size_; i++) {
-          h = ((h << 5) + h) + data_[i]; /* hash * 33 + data_[i] */
-      }
-      return h;
+      return Hash64(data_, size_);
   }
 
 private:
@@ -122,75 +122,145 @@ inline int Slice::compare(const Slice& b) const {
   return r;
 };
 
+// A value returned by DB::Get() without copying it. When the PTM can pin the
+// replica that was read, the slice refers to the value in that replica, which
+// stays pinned until Reset() or the destruction of the PinnableSlice (so release
+// it soon, like a snapshot). Otherwise the value is copied into a buffer of the
+// PinnableSlice.
+class PinnableSlice : public Slice {
+ public:
+  PinnableSlice() { }
+
+  ~PinnableSlice() { Reset(); }
+
+  // Used by the DB: the slice refers to 'value', and release(arg) is called
+  // (if release is not nullptr) when the slice doesn't refer to it anymore
+  void PinSlice(const Slice& value, void (*release)(void*), void* arg) {
+    Reset();
+    Slice::operator=(Slice(value.data(), value.size()));
+    pinned_ = true;
+    release_ = release;
+    arg_ = arg;
+  }
 
-// We need this for persistency because the contents have to be copied into persistent memory
-class PSlice {
-public:
-	PSlice() { }
-	
-    // Creates a copy of an existing Slice
-    PSlice(const Slice& sl) {
-        size_ = sl.size();
-        data_ = (char*)TM_PMALLOC(size_+1);
-        uint8_t* _addr = (uint8_t*)data_.pload();
-        size_t _size = size_.pload();
-#ifdef USE_CXREDO
-        uint64_t offset = cxredo::tlocal.tl_cx_size;
-        PTM_LOG(_addr,(uint8_t*)sl.data(),_size);
+  // Used by the DB: the value is copied into GetSelf(), then PinSelf() makes the slice refer to it
+  std::string* GetSelf() { return &self_; }
+
+  void PinSelf() {
+    Slice::operator=(Slice(self_));
+  }
+
+  // True if the slice refers to the value in a replica, false if it was copied
+  bool IsPinned() const { return pinned_; }
+
+  void Reset() {
+    if (release_ != nullptr) release_(arg_);
+    pinned_ = false;
+    release_ = nullptr;
+    arg_ = nullptr;
+    self_.clear();
+    Slice::operator=(Slice());
+  }
+
+ private:
+  bool pinned_ {false};
+  void (*release_)(void*) {nullptr};
+  void* arg_ {nullptr};
+  std::string self_;
+
+  // No copying allowed
+  PinnableSlice(const PinnableSlice&);
+  void operator=(const PinnableSlice&);
+};
+
+
+inline size_t roundToWord(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+/*
+ * Offset from an address in the main copy of the heap to the copy that the current transaction accesses.
+ * The redo PTMs run the transactions on a replica of the heap, the PTMs that write in place have no offset.
+ */
+inline uint64_t replicaOffset() {
+#if defined USE_REDO
+    return redo::tlocal.tl_cx_size;
+#elif defined USE_REDOTIMED
+    return redotimed::tlocal.tl_cx_size;
+#elif defined USE_REDOOPT
+    return redoopt::tlocal.tl_cx_size;
+#elif defined USE_CXREDO
+    return cxredo::tlocal.tl_cx_size;
 #elif defined USE_CXREDOTIMED
-        uint64_t offset = cxredotimed::tlocal.tl_cx_size;
-        PTM_LOG(_addr,(uint8_t*)sl.data(),_size);
+    return cxredotimed::tlocal.tl_cx_size;
 #elif defined USE_REDOTIMEDHASH
-        uint64_t offset = redotimedhash::tlocal.tl_cx_size;
-        PTM_LOG(_addr,(uint8_t*)sl.data(),_size);
+    return redotimedhash::tlocal.tl_cx_size;
+#elif defined USE_ROMULUS_LOG || defined ROMULUS_LR_PTM || defined PMDK_PTM
+    return 0;
 #else
-        uint64_t offset = 0;
+#error "replicaOffset() doesn't know which copy of the heap this PTM accesses"
 #endif
-        std::memcpy(_addr+offset, sl.data(), _size);
-        *reinterpret_cast<char*>(_addr+_size+offset) = 0;
-        PTM_FLUSH((uint8_t*)_addr, _size+1);
+}
+
+/*
+ * Writes the bytes of 'a' followed by the bytes of 'b' at 'addr', in persistent memory and inside a transaction.
+ * 'addr' must have room for them rounded up to a whole word: the PTMs log the modifications in words of 8 bytes,
+ * so the last word is written padded with zeros, instead of being copied from past the end of the source.
+ */
+inline void writePaddedBytes(void* addr, const Slice& a, const Slice& b) {
+    const size_t size = a.size() + b.size();
+    const size_t psize = roundToWord(size);
+    char sbuf[512];
+    std::unique_ptr<char[]> hbuf;
+    char* buf = sbuf;
+    if (psize > sizeof(sbuf)) {
+        hbuf.reset(new char[psize]);
+        buf = hbuf.get();
+    }
+    std::memcpy(buf, a.data(), a.size());
+    std::memcpy(buf + a.size(), b.data(), b.size());
+    std::memset(buf + size, 0, psize - size);
+    uint8_t* _addr = (uint8_t*)addr;
+    const uint64_t offset = replicaOffset();
+#ifdef PTM_LOG
+    PTM_LOG(_addr,(uint8_t*)buf,psize);
+#endif
+    std::memcpy(_addr+offset, buf, psize);
+    PTM_FLUSH(_addr, psize);
+}
+
+
+// We need this for persistency because the contents have to be copied into persistent memory
+class PSlice {
+public:
+	PSlice() {
+#ifdef PTMDB_MULTIWORD_PERSIST
+        setRep(nullptr, 0);
+#endif
+    }
+
+    // Creates a copy of an existing Slice. The buffer is followed by a zero and rounded up to a whole word,
+    // see writePaddedBytes().
+    PSlice(const Slice& sl) {
+        setCopy(sl);
     }
 
     // Creates a copy of an existing PSlice (Copy Constructor). Not being used
     PSlice(const PSlice& psl) {
-        size_ = psl.size();
-        data_ = (char*)TM_PMALLOC(size_+1);
-        uint8_t* _addr = (uint8_t*)data_.pload();
-        size_t _size = size_.pload();
-#ifdef USE_CXREDO
-        uint64_t offset = cxredo::tlocal.tl_cx_size;
-        PTM_LOG(_addr,(uint8_t*)psl.data(),_size);
-#elif defined USE_CXREDOTIMED
-        uint64_t offset = cxredotimed::tlocal.tl_cx_size;
-        PTM_LOG(_addr,(uint8_t*)psl.data(),_size);
-#elif defined USE_REDOTIMEDHASH
-        uint64_t offset = redotimedhash::tlocal.tl_cx_size;
-        PTM_LOG(_addr,(uint8_t*)psl.data(),_size);
-#else
-        uint64_t offset = 0;
-#endif
-        std::memcpy(_addr+offset, psl.data(), _size+1);
-        PTM_FLUSH((uint8_t*)_addr, _size+1);
+        setCopy(Slice(psl.data(), psl.size()));
     }
 
     ~PSlice() {
-        TM_PFREE(data_.pload());
+        TM_PFREE(pdata());
     }
 
     // Return a pointer to the beginning of the referenced data
     const char* data() const {
-#ifdef USE_CXREDO
-        uint64_t offset = cxredo::tlocal.tl_cx_size;
-#elif defined USE_CXREDOTIMED
-        uint64_t offset = cxredotimed::tlocal.tl_cx_size;
-#else
-        uint64_t offset = 0;
-#endif
-    	return data_.pload()+offset;
+        return pdata()+replicaOffset();
     }
 
     // Return the length (in bytes) of the referenced data
-    size_t size() const { return size_.pload(); }
+    size_t size() const { return psize(); }
 
     bool operator == (const Slice& other) {
         return (size() == other.size() && std::memcmp(data(), other.data(), size()) == 0);
@@ -202,50 +272,60 @@ public:
 
     // Assignment operator
     PSlice& operator=(const PSlice& psl) {
-        size_ = psl.size();
-        TM_PFREE(data_.pload());
-        data_ = (char*)TM_PMALLOC(size_+1);
-        uint8_t* _addr = (uint8_t*)data_.pload();
-        size_t _size = size_.pload();
-#ifdef USE_CXREDO
-        uint64_t offset = cxredo::tlocal.tl_cx_size;
-        PTM_LOG(_addr,(uint8_t*)psl.data(),_size);
-#elif defined USE_CXREDOTIMED
-        uint64_t offset = cxredotimed::tlocal.tl_cx_size;
-        PTM_LOG(_addr,(uint8_t*)psl.data(),_size);
-#elif defined USE_REDOTIMEDHASH
-        uint64_t offset = redotimedhash::tlocal.tl_cx_size;
-        PTM_LOG(_addr,(uint8_t*)psl.data(),_size);
-#else
-        uint64_t offset = 0;
-#endif
-        std::memcpy(_addr+offset, psl.data(), _size+1);
-        PTM_FLUSH((uint8_t*)_addr, _size+1);
+        if (&psl == this) return *this;
+        TM_PFREE(pdata());
+        setCopy(Slice(psl.data(), psl.size()));
         return *this;
     }
 
-    uint64_t toHash() const {
-#ifdef USE_CXREDO
-        uint64_t offset = cxredo::tlocal.tl_cx_size;
-#elif defined USE_CXREDOTIMED
-        uint64_t offset = cxredotimed::tlocal.tl_cx_size;
-#elif defined USE_REDOTIMEDHASH
-        uint64_t offset = redotimedhash::tlocal.tl_cx_size;
-#else
-        uint64_t offset = 0;
-#endif
-        uint64_t h = 5381;
-        char* data = data_.pload()+offset;
-        size_t size = size_.pload();
-        for (size_t i = 0; i < size; i++) {
-            h = ((h << 5) + h) + data[i]; /* hash * 33 + data_[i] */ // pload() on every data[i]
+    // Assignment of the contents of a Slice. When the new contents fit in the same number of words the existing
+    // buffer is overwritten, instead of being replaced by a new one. Every buffer is allocated by setCopy() with
+    // roundToWord(size+1) bytes, which is what writePaddedBytes() writes.
+    PSlice& operator=(const Slice& sl) {
+        const size_t _size = sl.size();
+        char* _addr = pdata();
+        if (_addr == nullptr || roundToWord(_size+1) != roundToWord(psize()+1)) {
+            TM_PFREE(_addr);
+            setCopy(sl);
+            return *this;
         }
-        return h;
+        writePaddedBytes(_addr, sl, Slice("", 1));  // Followed by a zero, like in the constructor
+        if (_size != psize()) setRep(_addr, _size);
+        return *this;
+    }
+
+    uint64_t toHash() const {
+        return Hash64(data(), psize());
     }
 
 private:
+    // Points this PSlice to a new buffer with the contents of 'sl'
+    void setCopy(const Slice& sl) {
+        const size_t _size = sl.size();
+        char* _addr = (char*)TM_PMALLOC(roundToWord(_size+1));
+        setRep(_addr, _size);
+        writePaddedBytes(_addr, sl, Slice("", 1));
+    }
+
+#ifdef PTMDB_MULTIWORD_PERSIST
+    // The pointer and the size are stored together, as a single entry in the log of the PTM
+    struct Rep {
+        char*  data;
+        size_t size;
+    };
+    TM_TYPE<Rep> rep_;
+
+    char* pdata() const { return rep_.pload().data; }
+    size_t psize() const { return rep_.pload().size; }
+    void setRep(char* data, size_t size) { rep_ = Rep{data, size}; }
+#else
     TM_TYPE<char*> data_ {nullptr};
     TM_TYPE<size_t> size_ {0};
+
+    char* pdata() const { return data_.pload(); }
+    size_t psize() const { return size_.pload(); }
+    void setRep(char* data, size_t size) { size_ = size; data_ = data; }
+#endif
 };
 
 
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2017-2020
+ *   Andreia Correia <andreia.veiga@unine.ch>
+ *   Pedro Ramalhete <pramalhe@gmail.com>
+ *   Pascal Felber <pascal.felber@unine.ch>
+ *
+ * This work is published under the MIT license. See LICENSE.txt
+ */
+#ifndef _PTMDB_DB_SNAPSHOT_H_
+#define _PTMDB_DB_SNAPSHOT_H_
+
+#include "db.h"
+#include "ptmdb.h"
+
+namespace ptmdb {
+
+/*
+ * With the PTMs that support it (PTM_PIN_SNAPSHOT), a snapshot pins the replica that has the last committed
+ * state, and the reads done on the snapshot see that state until it is released.
+ * With the other PTMs, or when the PTM has no more replicas that can be pinned, the snapshot is not pinned and
+ * each read done on it sees the state at the time of that read.
+ */
+class SnapshotImpl : public Snapshot {
+ public:
+  int id {-1};   // Id of the snapshot in the PTM, -1 if it is not pinned
+
+  SnapshotImpl() {
+#ifdef PTM_PIN_SNAPSHOT
+    id = PTM_PIN_SNAPSHOT();
+#endif
+  }
+
+  ~SnapshotImpl() {
+#ifdef PTM_PIN_SNAPSHOT
+    if (id != -1) PTM_UNPIN_SNAPSHOT(id);
+#endif
+  }
+
+  bool pinned() const { return id != -1; }
+
+ private:
+  // No copying allowed
+  SnapshotImpl(const SnapshotImpl&);
+  void operator=(const SnapshotImpl&);
+};
+
+// Executes 'func' in a read transaction, on the state of 'snap' if it is pinned.
+// Like in DBImpl::Get(), 'func' is captured by reference even with PTMDB_CAPTURE_BY_COPY.
+template<typename F>
+inline void snapshotReadTx(const SnapshotImpl* snap, F&& func) {
+#ifdef PTM_PIN_SNAPSHOT
+  if (snap != nullptr && snap->pinned()) {
+    PTM_SNAPSHOT_READ_TX<bool>(snap->id, [&] () {
+      func();
+      return true;
+    });
+    return;
+  }
+#else
+  (void)snap;
+#endif
+#ifdef PTMDB_CAPTURE_BY_COPY
+  PTM_READ_TX<bool>([&] () {
+    func();
+    return true;
+  });
+#else
+  PTM_READ_TX([&] () {
+    func();
+  });
+#endif
+}
+
+}  // namespace ptmdb
+
+#endif  // _PTMDB_DB_SNAPSHOT_H_
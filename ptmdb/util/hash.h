@@ -0,0 +1,100 @@
+// This is a port of wyhash (final version 4) by Wang Yi <godspeed_china@yeah.net>,
+// https://github.com/wangyi-fudan/wyhash, released into the public domain under
+// the Unlicense (http://unlicense.org). This file is in the public domain too.
+//
+// Simple hash function used for the keys of the hash index.
+//
+// The algorithm is the one of wyhash: it reads the key 8 bytes at a time and
+// mixes with 64x64->128 bit multiplications, with three independent lanes for
+// keys longer than 48 bytes. It never reads outside of [data, data+n), so it
+// can be used on keys that are in persistent memory.
+
+#ifndef STORAGE_PTMDB_UTIL_HASH_H_
+#define STORAGE_PTMDB_UTIL_HASH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace ptmdb {
+
+namespace hash_internal {
+
+static const uint64_t kSecret0 = 0xa0761d6478bd642fULL;
+static const uint64_t kSecret1 = 0xe7037ed1a0b428dbULL;
+static const uint64_t kSecret2 = 0x8ebc6af09c88c6e3ULL;
+static const uint64_t kSecret3 = 0x589965cc75374cc3ULL;
+
+// Returns the low and the high 64 bits of a*b xor'ed together
+inline uint64_t Mix(uint64_t a, uint64_t b) {
+  const __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+inline uint64_t Read8(const uint8_t* p) {
+  uint64_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint64_t Read4(const uint8_t* p) {
+  uint32_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Keys of 1 to 3 bytes
+inline uint64_t Read3(const uint8_t* p, size_t n) {
+  return ((uint64_t)p[0] << 16) | ((uint64_t)p[n >> 1] << 8) | p[n - 1];
+}
+
+}  // namespace hash_internal
+
+inline uint64_t Hash64(const char* data, size_t n, uint64_t seed = 0) {
+  using namespace hash_internal;
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+  seed ^= Mix(seed ^ kSecret0, kSecret1);
+  uint64_t a, b;
+  if (n <= 16) {
+    if (n >= 4) {
+      const size_t m = (n >> 3) << 2;
+      a = (Read4(p) << 32) | Read4(p + m);
+      b = (Read4(p + n - 4) << 32) | Read4(p + n - 4 - m);
+    } else if (n > 0) {
+      a = Read3(p, n);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = n;
+    if (i > 48) {
+      uint64_t seed1 = seed, seed2 = seed;
+      do {
+        seed = Mix(Read8(p) ^ kSecret1, Read8(p + 8) ^ seed);
+        seed1 = Mix(Read8(p + 16) ^ kSecret2, Read8(p + 24) ^ seed1);
+        seed2 = Mix(Read8(p + 32) ^ kSecret3, Read8(p + 40) ^ seed2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= seed1 ^ seed2;
+    }
+    while (i > 16) {
+      seed = Mix(Read8(p) ^ kSecret1, Read8(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    a = Read8(p + i - 16);
+    b = Read8(p + i - 8);
+  }
+  a ^= kSecret1;
+  b ^= seed;
+  const __uint128_t r = (__uint128_t)a * b;
+  a = (uint64_t)r;
+  b = (uint64_t)(r >> 64);
+  return Mix(a ^ kSecret0 ^ n, b ^ kSecret1);
+}
+
+}  // namespace ptmdb
+
+#endif  // STORAGE_PTMDB_UTIL_HASH_H_
@@ -8,7 +8,13 @@
 //    data: record[count]
 // record :=
 //    kTypeValue varstring varstring         |
-//    kTypeDeletion varstring
+//    kTypeDeletion varstring |
+//    kTypeMerge varstring varstring         |
+//    kTypeColumnFamilyValue varint32 varstring varstring |
+//    kTypeColumnFamilyDeletion varint32 varstring |
+//    kTypeColumnFamilyMerge varint32 varstring varstring
+// The varint32 of the column family records is the id of the column family,
+// the updates of the default column family use the records without it.
 // varstring :=
 //    len: varint32
 //    data: uint8[len]
@@ -20,8 +26,69 @@
 
 namespace ptmdb {
 
+// Header has an 8-byte sequence number followed by a 4-byte count
+static const size_t kHeader = 12;
 
-WriteBatch::WriteBatch() { }
+enum ValueType {
+    kTypeDeletion = 0x0,
+    kTypeValue = 0x1,
+    kTypeMerge = 0x2,
+    kTypeColumnFamilyDeletion = 0x4,
+    kTypeColumnFamilyValue = 0x5,
+    kTypeColumnFamilyMerge = 0x6
+};
+
+static void putVarint32(std::string* dst, uint32_t v) {
+    char buf[5];
+    int n = 0;
+    while (v >= 128) {
+        buf[n++] = (char)(v | 128);
+        v >>= 7;
+    }
+    buf[n++] = (char)v;
+    dst->append(buf, n);
+}
+
+static void putLengthPrefixedSlice(std::string* dst, const Slice& value) {
+    putVarint32(dst, (uint32_t)value.size());
+    dst->append(value.data(), value.size());
+}
+
+// Returns nullptr if the varint is truncated
+static const char* getVarint32(const char* p, const char* limit, uint32_t* v) {
+    uint32_t result = 0;
+    for (uint32_t shift = 0; shift <= 28 && p < limit; shift += 7) {
+        const uint32_t byte = (uint8_t)(*p++);
+        result |= (byte & 127) << shift;
+        if ((byte & 128) == 0) {
+            *v = result;
+            return p;
+        }
+    }
+    return nullptr;
+}
+
+static bool getLengthPrefixedSlice(const char*& p, const char* limit, Slice* result) {
+    uint32_t len;
+    p = getVarint32(p, limit, &len);
+    if (p == nullptr || len > (uint32_t)(limit - p)) return false;
+    *result = Slice(p, len);
+    p += len;
+    return true;
+}
+
+static uint32_t decodeCount(const std::string& rep) {
+    uint32_t count;
+    std::memcpy(&count, rep.data() + 8, sizeof(count));
+    return count;
+}
+
+static void encodeCount(std::string* rep, uint32_t count) {
+    std::memcpy(&(*rep)[8], &count, sizeof(count));
+}
+
+
+WriteBatch::WriteBatch() : rep_{std::make_shared<std::string>(kHeader, '\0')} { }
 
 
 WriteBatch::~WriteBatch() { }
@@ -29,31 +96,160 @@ WriteBatch::~WriteBatch() { }
 
 WriteBatch::Handler::~Handler() { }
 
+std::string* WriteBatch::mutableRep() {
+    // A transaction that captured the contents may still be reading them
+    if (rep_.use_count() > 1) rep_ = std::make_shared<std::string>(*rep_);
+    return rep_.get();
+}
+
 void WriteBatch::Clear() {
-    trans.clear();
+    if (rep_.use_count() > 1) {
+        rep_ = std::make_shared<std::string>(kHeader, '\0');
+    } else {
+        rep_->assign(kHeader, '\0');
+    }
 }
 
-std::vector<WriteBatch::Op>& WriteBatch::getTransaction() {
-    return trans;
+uint32_t WriteBatch::Count() const {
+    return decodeCount(*rep_);
 }
 
 void WriteBatch::Put(const Slice& key, const Slice& value) {
-    char* k = new char[key.size()+1];
-    char* v = new char[value.size()+1];
-    std::memcpy(k, key.data(), key.size());
-    std::memcpy(v, value.data(), value.size());
-    k[key.size()] = 0;
-    v[value.size()] = 0;
-    Op operat {true, k, (int)key.size(), v, (int)value.size()};
-    trans.push_back(std::move(operat));
+    std::string* rep = mutableRep();
+    encodeCount(rep, decodeCount(*rep) + 1);
+    rep->push_back((char)kTypeValue);
+    putLengthPrefixedSlice(rep, key);
+    putLengthPrefixedSlice(rep, value);
 }
 
 void WriteBatch::Delete(const Slice& key) {
-    char* k = new char[key.size()+1];
-    std::memcpy(k, key.data(), key.size());
-    k[key.size()] = 0;
-    Op operat {false, k, (int)key.size(), nullptr, 0};
-    trans.push_back(std::move(operat));
+    std::string* rep = mutableRep();
+    encodeCount(rep, decodeCount(*rep) + 1);
+    rep->push_back((char)kTypeDeletion);
+    putLengthPrefixedSlice(rep, key);
+}
+
+void WriteBatch::Merge(const Slice& key, const Slice& operand) {
+    std::string* rep = mutableRep();
+    encodeCount(rep, decodeCount(*rep) + 1);
+    rep->push_back((char)kTypeMerge);
+    putLengthPrefixedSlice(rep, key);
+    putLengthPrefixedSlice(rep, operand);
+}
+
+// Starts a record of type 'tag' (of the default column family), or of the column family version of 'tag'
+static void putRecordHeader(std::string* rep, ValueType tag, ValueType cfTag, ColumnFamilyHandle* column_family) {
+    const uint32_t id = column_family->GetID();
+    if (id == 0) {
+        rep->push_back((char)tag);
+    } else {
+        rep->push_back((char)cfTag);
+        putVarint32(rep, id);
+    }
+}
+
+void WriteBatch::Put(ColumnFamilyHandle* column_family, const Slice& key, const Slice& value) {
+    std::string* rep = mutableRep();
+    encodeCount(rep, decodeCount(*rep) + 1);
+    putRecordHeader(rep, kTypeValue, kTypeColumnFamilyValue, column_family);
+    putLengthPrefixedSlice(rep, key);
+    putLengthPrefixedSlice(rep, value);
+}
+
+void WriteBatch::Delete(ColumnFamilyHandle* column_family, const Slice& key) {
+    std::string* rep = mutableRep();
+    encodeCount(rep, decodeCount(*rep) + 1);
+    putRecordHeader(rep, kTypeDeletion, kTypeColumnFamilyDeletion, column_family);
+    putLengthPrefixedSlice(rep, key);
+}
+
+void WriteBatch::Merge(ColumnFamilyHandle* column_family, const Slice& key, const Slice& operand) {
+    std::string* rep = mutableRep();
+    encodeCount(rep, decodeCount(*rep) + 1);
+    putRecordHeader(rep, kTypeMerge, kTypeColumnFamilyMerge, column_family);
+    putLengthPrefixedSlice(rep, key);
+    putLengthPrefixedSlice(rep, operand);
+}
+
+Status WriteBatch::Iterate(Handler* handler) const {
+    return Iterate(*rep_, handler);
+}
+
+namespace {
+// Handler of the first pass of Iterate(), which only decodes the records
+class RecordChecker : public WriteBatch::Handler {
+ public:
+    void Put(const Slice& key, const Slice& value) override { }
+    void Delete(const Slice& key) override { }
+    void Merge(const Slice& key, const Slice& operand) override { }
+    void PutCF(uint32_t column_family_id, const Slice& key, const Slice& value) override { }
+    void DeleteCF(uint32_t column_family_id, const Slice& key) override { }
+    void MergeCF(uint32_t column_family_id, const Slice& key, const Slice& operand) override { }
+};
+}  // namespace
+
+Status WriteBatch::Iterate(const std::string& rep, Handler* handler) {
+    // The whole batch is decoded before the first record is given to the handler, so that a malformed
+    // batch is not partially applied
+    RecordChecker checker;
+    Status s = iterateRecords(rep, &checker);
+    if (!s.ok()) return s;
+    return iterateRecords(rep, handler);
+}
+
+Status WriteBatch::iterateRecords(const std::string& rep, Handler* handler) {
+    if (rep.size() < kHeader) return Status::Corruption("malformed WriteBatch (too small)");
+    const char* p = rep.data() + kHeader;
+    const char* limit = rep.data() + rep.size();
+    Slice key, value;
+    uint32_t id;
+    uint32_t found = 0;
+    while (p < limit) {
+        const char tag = *p++;
+        found++;
+        switch (tag) {
+        case kTypeValue:
+            if (!getLengthPrefixedSlice(p, limit, &key) || !getLengthPrefixedSlice(p, limit, &value)) {
+                return Status::Corruption("bad WriteBatch Put");
+            }
+            handler->Put(key, value);
+            break;
+        case kTypeDeletion:
+            if (!getLengthPrefixedSlice(p, limit, &key)) return Status::Corruption("bad WriteBatch Delete");
+            handler->Delete(key);
+            break;
+        case kTypeMerge:
+            if (!getLengthPrefixedSlice(p, limit, &key) || !getLengthPrefixedSlice(p, limit, &value)) {
+                return Status::Corruption("bad WriteBatch Merge");
+            }
+            handler->Merge(key, value);
+            break;
+        case kTypeColumnFamilyValue:
+            if ((p = getVarint32(p, limit, &id)) == nullptr ||
+                !getLengthPrefixedSlice(p, limit, &key) || !getLengthPrefixedSlice(p, limit, &value)) {
+                return Status::Corruption("bad WriteBatch Put");
+            }
+            handler->PutCF(id, key, value);
+            break;
+        case kTypeColumnFamilyDeletion:
+            if ((p = getVarint32(p, limit, &id)) == nullptr || !getLengthPrefixedSlice(p, limit, &key)) {
+                return Status::Corruption("bad WriteBatch Delete");
+            }
+            handler->DeleteCF(id, key);
+            break;
+        case kTypeColumnFamilyMerge:
+            if ((p = getVarint32(p, limit, &id)) == nullptr ||
+                !getLengthPrefixedSlice(p, limit, &key) || !getLengthPrefixedSlice(p, limit, &value)) {
+                return Status::Corruption("bad WriteBatch Merge");
+            }
+            handler->MergeCF(id, key, value);
+            break;
+        default:
+            return Status::Corruption("unknown WriteBatch tag");
+        }
+    }
+    if (found != decodeCount(rep)) return Status::Corruption("WriteBatch has wrong count");
+    return Status::OK();
 }
 
 
@@ -21,80 +21,78 @@
 #ifndef _ROMULUSDB_INCLUDE_WRITE_BATCH_H_
 #define _ROMULUSDB_INCLUDE_WRITE_BATCH_H_
 
+#include <cstdint>
+#include <memory>
 #include <string>
-#include <vector>
-#include <cstring>
-#include <utility>
 
 namespace ptmdb {
 
+class ColumnFamilyHandle;
 class Slice;
+class Status;
 
 class WriteBatch {
  public:
-  class Op{
-   public:
-    bool operation;
-    char* key;
-    int key_size;
-    char* value;
-    int value_size;
-   Op(bool operation, char* key, int key_size, char* value, int value_size):
-       operation{operation},key{key},key_size{key_size},value{value},value_size{value_size}
-       {};
-
-   // Copy constructor
-   Op(const Op& other){
-	   operation = other.operation;
-	   key_size = other.key_size;
-	   value_size = other.value_size;
-	   key = new char[key_size+1];
-	   value = new char[value_size+1];
-	   std::memcpy(key, other.key, key_size);
-	   std::memcpy(value, other.value, value_size);
-	   key[key_size] = 0;
-	   value[value_size] = 0;
-	   //printf("copy constructor\n");
-   };
-
-   // Move constructor
-   Op(Op&& o) noexcept :
-           key(std::exchange(o.key, nullptr)),
-           value(std::exchange(o.value, nullptr)),
-           key_size(std::exchange(o.key_size, 0)),
-           value_size(std::exchange(o.value_size, 0)),
-           operation(std::exchange(o.operation, false)) { }
-
-   ~Op(){
-	   delete[] key;
-	   delete[] value;
-   }
-  };
-
   WriteBatch();
   ~WriteBatch();
 
-  std::vector<Op>& getTransaction();
-
   // Store the mapping "key->value" in the database.
   void Put(const Slice& key, const Slice& value);
 
   // If the database contains a mapping for "key", erase it.  Else do nothing.
   void Delete(const Slice& key);
 
+  // Merge "operand" into the value of "key" (see DB::Merge()).
+  void Merge(const Slice& key, const Slice& operand);
+
+  // Same as above, in a column family of the DB the batch is written to.
+  // A batch can have updates of several column families, they are all done
+  // in the same transaction.
+  void Put(ColumnFamilyHandle* column_family, const Slice& key, const Slice& value);
+  void Delete(ColumnFamilyHandle* column_family, const Slice& key);
+  void Merge(ColumnFamilyHandle* column_family, const Slice& key, const Slice& operand);
+
   // Clear all updates buffered in this batch.
   void Clear();
 
-  // Support for iterating over the contents of a batch. TODO: Is this needed?
+  // Number of updates in the batch
+  uint32_t Count() const;
+
+  // Support for iterating over the contents of a batch, in the order they were added
   class Handler {
    public:
     virtual ~Handler();
     virtual void Put(const Slice& key, const Slice& value) = 0;
     virtual void Delete(const Slice& key) = 0;
+    virtual void Merge(const Slice& key, const Slice& operand) = 0;
+    // Updates of the column families other than the default one
+    virtual void PutCF(uint32_t column_family_id, const Slice& key, const Slice& value) = 0;
+    virtual void DeleteCF(uint32_t column_family_id, const Slice& key) = 0;
+    virtual void MergeCF(uint32_t column_family_id, const Slice& key, const Slice& operand) = 0;
   };
+  // If the batch is malformed Iterate() returns Corruption without calling the handler.
+  Status Iterate(Handler* handler) const;
+
+  // Same as above, on the contents returned by Contents()
+  static Status Iterate(const std::string& rep, Handler* handler);
+
+  // The encoded updates of the batch. The PTMs that execute a transaction on other threads or
+  // more than once capture this instead of the batch: it is a single buffer for all the updates
+  // and it stays valid after the batch is cleared or destroyed.
+  std::shared_ptr<const std::string> Contents() const { return rep_; }
 
  private:
-  std::vector<Op> trans{};
+  // See the comment at the top of write_batch.cc for the format.
+  // When rep_ is shared with a transaction, the next change to the batch is done on a new buffer.
+  std::shared_ptr<std::string> rep_;
+
+  std::string* mutableRep();
+
+  // Calls the handler for each record, until the first one that is malformed
+  static Status iterateRecords(const std::string& rep, Handler* handler);
+
+  // Checks the whole batch itself in its first pass, and then calls iterateRecords() to apply it
+  friend class DBImpl;
 
   // Intentionally copyable
 };
@@ -29,7 +29,11 @@ using namespace chrono;
 // Please keep this file in sync (as much as possible) with stms/OneFileWF.hpp
 
 // Macros needed for persistence
-#ifdef MEASURE_PWB
+#if !defined(PWB_IS_CLFLUSH) && !defined(PWB_IS_CLFLUSHOPT) && !defined(PWB_IS_CLWB) && !defined(PWB_IS_NOP)
+// The pwb is chosen at startup, see common/pfences.h (which also has flushFromTo())
+#include "../../common/pfences.h"
+
+#elif defined(MEASURE_PWB)
 
 extern thread_local uint64_t tl_num_pwbs;
 
@@ -89,7 +93,7 @@ extern thread_local uint64_t tl_num_pwbs;
 #error "You must define what PWB is. Choose PWB_IS_CLFLUSHOPT if you don't know what your CPU is capable of"
 #endif
 
-#endif // MEASURE_PWB
+#endif // PWB_IS_RUNTIME / MEASURE_PWB
 
 
 // Size of the persistent memory region
@@ -204,12 +208,14 @@ static inline uint64_t trans2idx(uint64_t trans) {
     return trans & 0x3FF; // 10 bits
 }
 
+#ifndef PWB_IS_RUNTIME
 // Flush each cache line in a range
 static inline void flushFromTo(void* from, void* to) noexcept {
     const uint64_t cache_line_size = 64;
     uint8_t* ptr = (uint8_t*)(((uint64_t)from) & (~(cache_line_size-1)));
     for (; ptr < (uint8_t*)to; ptr += cache_line_size) PWB(ptr);
 }
+#endif
 
 
 //
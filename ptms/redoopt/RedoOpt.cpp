@@ -24,7 +24,6 @@ thread_local int64_t tl_nested_read_trans = 0;
 // Global instance
 RedoOpt gRedo {};
 
-std::atomic<uint64_t> printlock {0};
 thread_local varLocal tlocal;
 
 } // End of redotimedhash namespace
@@ -14,6 +14,7 @@
 #include <cassert>
 #include <string>
 #include <cstring>      // std::memcpy()
+#include <stdexcept>    // std::runtime_error
 #include <sys/mman.h>   // Needed if we use mmap()
 #include <sys/types.h>  // Needed by open() and close()
 #include <sys/stat.h>
@@ -27,11 +28,18 @@
 #include <set>          // Needed by allocation statistics
 #include <type_traits>
 #include <chrono>
+#include <condition_variable>
+#include <mutex>        // Needed by growHeap()
+#include <thread>
+#include <vector>
+#include <pthread.h>    // Needed to pin the combiner threads
 
 #include "../../common/pfences.h"
 #include "../../common/ThreadRegistry.hpp"
 #include "../../common/StrongTryRIRWLock.hpp"
 #include "../../common/HazardPointers.hpp"
+#include "../../common/PhaseProfiler.hpp"
+#include "../../common/EventTracer.hpp"
 
 using namespace std;
 using namespace chrono;
@@ -41,6 +49,17 @@ using namespace chrono;
 #ifndef PM_REGION_SIZE
 #define PM_REGION_SIZE (2*1024*1024*1024ULL) // 2GB by default (to run on laptop)
 #endif
+// Size of the virtual address range reserved for the persistent memory region.
+// The heap starts with PM_REGION_SIZE and grows online up to this size (sparse file, only touched pages use PM).
+#ifndef PM_REGION_MAX_SIZE
+#define PM_REGION_MAX_SIZE (64*1024*1024*1024ULL)
+#endif
+// Number of partitions of the heap. Each partition is an independent combining domain, with its own
+// replicas, curComb, ring and States, see RedoOpt::partition(). The address range of each replica is split
+// evenly between the partitions.
+#ifndef PM_PARTITIONS
+#define PM_PARTITIONS  1
+#endif
 // DAX flag (MAP_SYNC) is needed for Optane but not for /dev/shm/
 #ifdef PM_USE_DAX
 #define PM_FLAGS       MAP_SYNC
@@ -67,7 +86,7 @@ namespace redoopt {
 class RedoOpt;
 extern RedoOpt gRedo;
 
-// Global with the 'main' size. Used by pload()
+// Global with the 'main' size (distance between replicas). Used by pload()
 extern uint64_t g_main_size;
 extern uint8_t* g_main_addr;
 extern uint8_t* g_main_addr_end;
@@ -103,25 +122,17 @@ extern mspace create_mspace_with_base(void* base, size_t capacity, int locked);
 #endif
 
 
-// Define this in the Makefile if you want to measure the relative time of each task
-#ifdef MEASURE_FUNC_TIMES
-#define START_TIME()    auto _startTime = steady_clock::now();
-#define START_TIMEST()  auto _sTime     = steady_clock::now();
-#define END_TIME(_x)    auto _endTime   = steady_clock::now(); tlocal.funcTime[_x] += (_endTime-_startTime);
-#define END_TIMEST(_x)  auto _eTime     = steady_clock::now(); tlocal.funcTime[_x] += (_eTime-_sTime);
-#define END_TIMEF(_x)   auto _enTime    = steady_clock::now(); tlocal.funcTime[_x] += (_enTime-_startTime);
-#else
-#define START_TIME()
-#define START_TIMEST()
-#define END_TIME(_x)
-#define END_TIMEST(_x)
-#define END_TIMEF(_x)
-#endif // MEASURE_FUNC_TIMES
+// Time spent in each phase (RedoOpt::Phase), always on. See RedoOpt::phases().
+// Define MEASURE_FUNC_TIMES in the Makefile to have the breakdown shown at the end.
+#define START_TIME()    const uint64_t _startTSC = asm_rdtsc();
+#define START_TIMEST()  const uint64_t _sTSC     = asm_rdtsc();
+#define END_TIME(_x)    RedoOpt::cur().profiler.stop(ThreadRegistry::getTID(), _x, _startTSC);
+#define END_TIMEST(_x)  RedoOpt::cur().profiler.stop(ThreadRegistry::getTID(), _x, _sTSC);
+#define END_TIMEF(_x)   END_TIME(_x)
 
 
 // Returns the cache line of the address (this is for x86 only)
 #define ADDR2CL(_addr) (uint8_t*)((size_t)(_addr) & (~63ULL))
-extern std::atomic<uint64_t> printlock;
 
 struct varLocal {
     void* st{};
@@ -129,26 +140,23 @@ struct varLocal {
     int64_t tl_nested_write_trans{0};
     int64_t tl_nested_read_trans{0};
     bool copy;
-#ifdef MEASURE_FUNC_TIMES
-    const char* funcName[13] {"copy","flushCopy","AggrStores","AggrCL","AggrCLPWBs","flushDeferredPWBs","apply_undolog","apply_redologs","lambdas","Sleeping","getNewComb","publishRequest","writeTx"};
-    nanoseconds funcTime[13] {0ns,0ns,0ns,0ns,0ns,0ns,0ns,0ns,0ns,0ns,0ns,0ns,0ns};
-    ~varLocal(){
-        uint64_t tmp =0;
-        while(!printlock.compare_exchange_strong(tmp, 1)){tmp=0;}
-        for(int i=0;i<13;i++){
-            printf(" %s=, %ld, ",funcName[i],funcTime[i].count());
-        }
-        printf("\n");
-        printlock.store(0);
-    }
-#endif
+    RedoOpt* redo {nullptr};    // Partition of the current transaction, nullptr is gRedo
+    void* multi {nullptr};      // Transaction over several partitions being executed by this thread, see ns_multi_transaction()
+    RedoOpt* pinRedo {nullptr}; // Partition of the replica pinned by this thread, nullptr if none (see ns_pin_replica())
+    int pinComb {-1};           // Index of the pinned replica
+    int pinCount {0};           // Number of pins of the pinned replica
+    int curCombMirror {-1};     // Copy of curComb read by this thread, the one of its NUMA node (see loadCurComb())
+    ThreadRegistry::Lease* pinLease {nullptr};  // Keeps the tid of the thread while it has a pin
 };
 
 extern thread_local varLocal tlocal;
 
 /*
  * Definition of persist<> type.
- * We interpose loads to adjust the synthetic pointers and interpose stores to log them
+ * We interpose loads to adjust the synthetic pointers and interpose stores to log them.
+ * Types up to 8 bytes are logged as the 64 bit word that contains them. Trivially copyable
+ * types larger than a word (up to one cache line) are logged as a single range entry in the
+ * write-set, which is replayed with a single memcpy().
  */
 template<typename T> struct persist {
     // Stores the actual value
@@ -236,6 +244,13 @@ template<typename T> struct persist {
 
 typedef uint64_t SeqTidIdx;
 
+// Thrown to the caller of a transaction that accessed a partition it did not declare, see RedoOpt::partition().
+// The transaction has no effect.
+class PartitionError : public std::logic_error {
+public:
+    explicit PartitionError(const std::string& what) : std::logic_error(what) { }
+};
+
 class RedoOpt {
     int NUM_CORES = 0;
     const int MAX_COMBS = 2;
@@ -243,6 +258,8 @@ class RedoOpt {
     static const int MAX_THREADS = 41;
     static const int MAX_COMBINEDS = MAX_THREADS+1;
     static const int NUM_OBJS = 100;
+    static const int MAX_PARTITIONS = 16;
+    static const int MAX_SNAPSHOTS = 8;     // Maximum number of replicas pinned by snapshots at the same time
     static const int MAXLOGSIZE = 256;
     static const int RINGSIZE = 16192;
     static const int STATESSIZE = 2096;
@@ -251,6 +268,77 @@ class RedoOpt {
     static const int TID_BITS = 8;   // Can't have more than 256 threads (should be enough for now)
     static const int IDX_BITS = 16;  // WARNING: ring capacity up to 4096
     const int maxThreads;
+
+public:
+    // Phases of the transactions measured by the profiler
+    enum Phase {
+        PHASE_COPY = 0,                 // makeCopy()
+        PHASE_FLUSH_COPY,               // flushCopy() after a full copy
+        PHASE_AGGR_CL,                  // Aggregating the cache lines of the write-set
+        PHASE_FLUSH_DEFERRED_PWBS,      // pwbs of the aggregated cache lines
+        PHASE_APPLY_UNDOLOG,
+        PHASE_APPLY_REDOLOGS,
+        PHASE_LAMBDAS,                  // Executing the mutations of the announced requests
+        PHASE_SLEEPING,                 // Waiting in getNewComb() for a replica to be available
+        PHASE_GET_NEW_COMB,
+        PHASE_WRITE_TX,                 // Whole update transaction
+        NUM_PHASES
+    };
+
+    static const char* const* phaseNames() {
+        static const char* const names[NUM_PHASES] = {"copy", "flushCopy", "AggrCL", "flushDeferredPWBs", "apply_undolog",
+                "apply_redologs", "lambdas", "Sleeping", "getNewComb", "writeTx"};
+        return names;
+    }
+
+    typedef PhaseProfiler<NUM_PHASES, MAX_THREADS> Profiler;
+    Profiler profiler {};
+
+    // Events recorded by the tracer, see startTrace()
+    enum TraceEvent {
+        EV_TX_BEGIN = 0,
+        EV_TX_END,
+        EV_COMBINE_BEGIN,               // Start of the execution of the announced requests
+        EV_COMBINE_END,
+        EV_REPLICA_ACQUIRED,
+        EV_COPY_BEGIN,
+        EV_COPY_END,                    // copied is 0 if the copy was aborted
+        EV_REDO_BEGIN,                  // Applying the redo logs of a range of tickets
+        EV_REDO_END,
+        EV_CAS_SUCCESS,                 // CAS on curComb
+        EV_CAS_FAILURE,
+        NUM_EVENTS
+    };
+
+    typedef EventTracer<MAX_THREADS> Tracer;
+
+    static const Tracer::EventInfo* eventInfos() {
+        static const Tracer::EventInfo infos[NUM_EVENTS] = {
+            {"writeTx",     Tracer::BEGIN,   "seq", nullptr},
+            {"writeTx",     Tracer::END,     "ticket", nullptr},
+            {"combine",     Tracer::BEGIN,   "ticket", nullptr},
+            {"combine",     Tracer::END,     "requests", nullptr},
+            {"replica",     Tracer::INSTANT, "replica", "seq"},
+            {"copy",        Tracer::BEGIN,   "seq", nullptr},
+            {"copy",        Tracer::END,     "copied", nullptr},
+            {"redo",        Tracer::BEGIN,   "from", "to"},
+            {"redo",        Tracer::END,     "applied", nullptr},
+            {"cas ok",      Tracer::INSTANT, "ticket", "replica"},
+            {"cas failed",  Tracer::INSTANT, "ticket", "curComb"},
+        };
+        return infos;
+    }
+
+    Tracer tracer {};
+
+private:
+    // File where the trace is saved at exit, when tracing is on from the start
+    const char* traceFile {nullptr};
+
+    inline void trace(const int tid, const TraceEvent ev, const uint64_t arg1, const uint64_t arg2) {
+        if (tracer.isEnabled()) tracer.record(tid, ev, arg1, arg2);
+    }
+
     static const uint64_t HASH_BUCKETS = 64;
 
 
@@ -261,7 +349,7 @@ class RedoOpt {
                     MAX_THREADS, REGISTRY_MAX_THREADS);
             assert(false);
         }
-        if (REGISTRY_MAX_THREADS >= (1ULL << TID_BITS)) {
+        if (REGISTRY_MAX_THREADS >= (1ULL << TID_BITS)-1) {
             printf("Registry size (%d) is larger than capacity of TID_BITS (%ld). Please increase TID_BITS\n",
                     REGISTRY_MAX_THREADS, (1UL << TID_BITS));
             assert(false);
@@ -276,15 +364,22 @@ class RedoOpt {
                     STATESSIZE, IDX_BITS);
             assert(false);
         }
+        if (PM_PARTITIONS < 1 || PM_PARTITIONS > MAX_PARTITIONS) {
+            printf("PM_PARTITIONS (%d) must be between 1 and MAX_PARTITIONS (%d)\n", PM_PARTITIONS, MAX_PARTITIONS);
+            assert(false);
+        }
     }
 
 
-    // A single entry in the write-set
+    // A single entry in the write-set.
+    // For range entries (size > 8) the old and new bytes are in the State's range log, and 'val'
+    // has the location of those bytes (see rangeLoc()).
     struct WriteSetEntry {
         uint8_t*       addr {nullptr};      // Address of value+sequence to change
         uint64_t       oldval {0};          // Previous value
         uint64_t       val {0};             // Desired value to change to
         WriteSetEntry* next {nullptr};
+        uint64_t       size {8};            // Number of bytes to change
     };
 
     // A single entry in the write-set
@@ -299,6 +394,18 @@ class RedoOpt {
         }
     };
 
+    // A chunk of the range log, where we keep the old and new bytes of the multi-word entries
+    struct RangeLogNode {
+        static const uint64_t CAPACITY = 64*1024;
+        uint8_t            data[CAPACITY];
+    };
+    static const uint64_t MAX_RANGE_NODES = 256;
+
+    // Returns the location in the range log of a given chunk and offset in that chunk
+    inline static uint64_t rangeLoc(const uint64_t inode, const uint64_t offset) {
+        return (inode << 32) | offset;
+    }
+
     struct WriteSetCL {
         uint8_t*           addrCL {nullptr};
         WriteSetCL*        next {nullptr};
@@ -322,6 +429,7 @@ class RedoOpt {
         std::atomic<SeqTidIdx> ticket {0};
         std::atomic<bool>      applied[MAX_THREADS];
         std::atomic<uint64_t>  results[MAX_THREADS];
+        std::atomic<bool>      failed[MAX_THREADS];     // The request was not applied, see PartitionError
         WriteSetNode           logHead {};
         WriteSetNode*          logTail {nullptr};
         uint64_t               lSize = 0;
@@ -331,13 +439,23 @@ class RedoOpt {
         WriteSetNodeCL*        logTailCL {nullptr};
         uint64_t               numCL = 0;
 
+        // Range log, allocated lazily. The chunks are never de-allocated while the State is in
+        // use because other threads may be reading them in copy_redolog().
+        std::atomic<RangeLogNode*> rangeNodes[MAX_RANGE_NODES];
+        uint64_t               rangeUsed = 0;      // Bytes used in the range log, by this tx
+        uint8_t*               rangeLo {nullptr};  // Lowest address covered by a range entry of this tx
+        uint8_t*               rangeHi {nullptr};  // Highest address (exclusive) covered by a range entry of this tx
+
         State() { // Used only by the first objState instance
             logTail = &logHead;
             logTailCL = &logHeadCL;
             for (int i = 0; i < MAX_THREADS; i++) applied[i].store(false, std::memory_order_relaxed);
             for (int i = 0; i < MAX_THREADS; i++) results[i].store(0, std::memory_order_relaxed);
+            for (int i = 0; i < MAX_THREADS; i++) failed[i].store(false, std::memory_order_relaxed);
+            for (int i = 0; i < MAX_RANGE_NODES; i++) rangeNodes[i].store(nullptr, std::memory_order_relaxed);
         }
         ~State() {
+            for (int i = 0; i < MAX_RANGE_NODES; i++) delete rangeNodes[i].load();
             WriteSetNode* node = logHead.next;
             WriteSetNode* delNode = node;
             while(node!=nullptr){
@@ -355,6 +473,34 @@ class RedoOpt {
             }
         }
 
+        // Returns a pointer to the bytes in the range log at 'loc', or nullptr if 'loc' is not a
+        // valid location for 'size' bytes (it may be a torn read of an entry that is being reused).
+        inline uint8_t* rangeBytes(const uint64_t loc, const uint64_t size) const {
+            const uint64_t inode = loc >> 32;
+            const uint64_t offset = loc & 0xFFFFFFFFULL;
+            if (inode >= MAX_RANGE_NODES || offset + 2*size > RangeLogNode::CAPACITY) return nullptr;
+            RangeLogNode* node = rangeNodes[inode].load(std::memory_order_acquire);
+            if (node == nullptr) return nullptr;
+            return node->data + offset;
+        }
+
+        // Reserve space for the old and new bytes of a range entry. Returns false if the range log is full.
+        inline bool rangeAlloc(const uint64_t size, uint64_t& loc) {
+            uint64_t inode = rangeUsed / RangeLogNode::CAPACITY;
+            uint64_t offset = rangeUsed % RangeLogNode::CAPACITY;
+            if (offset + 2*size > RangeLogNode::CAPACITY) {
+                inode++;
+                offset = 0;
+            }
+            if (inode >= MAX_RANGE_NODES) return false;
+            if (rangeNodes[inode].load(std::memory_order_relaxed) == nullptr) {
+                rangeNodes[inode].store(new RangeLogNode(), std::memory_order_release);
+            }
+            rangeUsed = inode*RangeLogNode::CAPACITY + offset + 2*size;
+            loc = rangeLoc(inode, offset);
+            return true;
+        }
+
         // We can't use the "copy assignment operator" because we need to make sure that the instance
         // we're copying is the one we have protected with the hazard pointer
         void copyFrom(const State* from) {
@@ -362,6 +508,7 @@ class RedoOpt {
             //const uint64_t numThreads = ThreadRegistry::getMaxThreads();
             for (int i = 0; i < MAX_THREADS; i++) applied[i].store(from->applied[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
             for (int i = 0; i < MAX_THREADS; i++) results[i].store(from->results[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            for (int i = 0; i < MAX_THREADS; i++) failed[i].store(from->failed[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
         }
     };
 
@@ -397,7 +544,7 @@ class RedoOpt {
             NodeCLAggr* tail = logTailCL;
             if(numCL!=0){
                 //3/4 of usedSize flush copy
-                if(numCL+1 > 3*gRedo.esloco.getUsedSize()/(64*4)) {
+                if(numCL+1 > 3*RedoOpt::cur().esloco.getUsedSize()/(64*4)) {
                     tlocal.copy = true;
                     numCL = 0;
                     return;
@@ -459,12 +606,12 @@ class RedoOpt {
                     size = numCL%numBuckets;
                     if(size==0) size = numBuckets;
                 }
-                for (int k = 0; k < size; k++) {
-                    PWB(nodeCL->log[k].addrCL + tlocal.tl_cx_size);
-                }
+                withPwbFlavor([&](auto flavor) {
+                    for (int k = 0; k < size; k++) flavor.pwb(nodeCL->log[k].addrCL + tlocal.tl_cx_size);
+                });
                 nodeCL = nodeCL->next;
             }
-            END_TIME(5);
+            END_TIME(PHASE_FLUSH_DEFERRED_PWBS);
         }
 
         inline void reset() {
@@ -494,7 +641,7 @@ class RedoOpt {
     struct Combined {
         std::atomic<SeqTidIdx>     head {0};
         uint8_t*                   root {nullptr}; //offset in bytes
-        StrongTryRIRWLock          rwLock {MAX_THREADS};
+        StrongTryRIRWLock          rwLock {MAX_THREADS+MAX_SNAPSHOTS};  // Snapshots use the slots after MAX_THREADS
         bool                       flushcopy{false};
         CLAggregate                clsets{};
     };
@@ -527,14 +674,25 @@ public:
     inline static uint64_t sti2idx(const SeqTidIdx sti) {
         return sti & ((1 << IDX_BITS)-1);
     }
+    // Tid of a curComb whose commits are held by a transaction over several partitions, see lockCombining().
+    // checkParams() makes sure that no thread has this tid.
+    static const uint64_t LOCKED_TID = (1ULL << TID_BITS)-1;
+    inline static SeqTidIdx lockedComb(const SeqTidIdx sti) {
+        return makeSeqTidIdx(sti2seq(sti), LOCKED_TID, sti2idx(sti));
+    }
+    inline static bool isLocked(const SeqTidIdx sti) {
+        return sti2tid(sti) == LOCKED_TID;
+    }
 
 
 private:
     struct States {
-        State*        states;
+        State*        states {nullptr};
         uint64_t      lastIdx{1};
-        States() {
-            states = new State[STATESSIZE];
+        uint64_t      size {0};
+        void init(uint64_t numStates) {
+            size = numStates;
+            states = new State[numStates];
         }
         ~States() {
             delete[] states;
@@ -554,14 +712,18 @@ private:
             while(node!=nullptr){
                 for(int i=len-1;i>=0;i--){
                     WriteSetEntry* entry = &node->log[i];
-                    *(uint64_t*)( entry->addr + offset ) = entry->oldval;
+                    if (entry->size == sizeof(uint64_t)) {
+                        *(uint64_t*)( entry->addr + offset ) = entry->oldval;
+                    } else {
+                        std::memcpy(entry->addr + offset, state->rangeBytes(entry->val, entry->size), entry->size);
+                    }
                     j++;
                 }
                 node = node->prev;
                 len=MAXLOGSIZE;
             }
         }
-        END_TIME(6);
+        END_TIME(PHASE_APPLY_UNDOLOG);
     }
 
     inline void copy_redolog(State* state, uint64_t redoSize, int tid, const uint64_t offset) noexcept {
@@ -575,7 +737,15 @@ private:
             for(int i=0;i<len;i++){
                 WriteSetEntry e = node->log[i];
                 if(!ADDR_IS_IN_MAIN(e.addr)) return;
-                *(uint64_t*)(e.addr + offset) = e.val;
+                if (e.size == sizeof(uint64_t)) {
+                    *(uint64_t*)(e.addr + offset) = e.val;
+                } else {
+                    // Range entry: one copy of the new bytes. The caller validates the ticket afterwards.
+                    if (e.size > 64 || !ADDR_IS_IN_MAIN(e.addr + e.size - 1)) return;
+                    uint8_t* bytes = state->rangeBytes(e.val, e.size);
+                    if (bytes == nullptr) return;
+                    std::memcpy(e.addr + offset, bytes + e.size, e.size);
+                }
                 j++;
             }
             if(j>=redoSize) return;
@@ -583,12 +753,13 @@ private:
         }
     }
 
-    inline Combined* apply_redologs(Combined* newComb, uint64_t initCombSeq, SeqTidIdx lastAppliedTicket, SeqTidIdx ltail, int tid) noexcept {
+    inline Combined* apply_redologs(Combined* newComb, uint64_t initCombSeq, SeqTidIdx lastAppliedTicket, SeqTidIdx ltail, int tid, const bool ownRequest) noexcept {
         START_TIME();
         uint64_t start = sti2seq(lastAppliedTicket);
         uint64_t i = start+1;
         uint64_t lastSeq = sti2seq(ltail);
-        SeqTidIdx ringTicket;
+        SeqTidIdx ringTicket = lastAppliedTicket;
+        trace(tid, EV_REDO_BEGIN, i, lastSeq);
         const uint64_t offset = tlocal.tl_cx_size;
         for(;i<=lastSeq;i++){
             ringTicket = ring[i%RINGSIZE].load();
@@ -606,24 +777,27 @@ private:
 #endif
             if (redoSize > 0) {
                 copy_redolog(apply_state, redoSize, tid, offset);
+                count(counters[tid].redoEntries, redoSize);
                 atomic_thread_fence(std::memory_order_acquire);
                 if (ringTicket != apply_state->ticket.load()) {
                     break;
                 }
             }
-            if(sti2seq(per->curComb.load())>=initCombSeq+2){
+            if(sti2seq(loadCurComb())>=initCombSeq+2){
                 //tmpclsets[tid].flushDeferredPWBs();
                 //PFENCE();
                 newComb->head.store(ringTicket,std::memory_order_relaxed);
-                END_TIME(7);
+                END_TIME(PHASE_APPLY_REDOLOGS);
+                trace(tid, EV_REDO_END, i, 0);
                 return nullptr;
             }
         }
 
-        END_TIME(7);
+        END_TIME(PHASE_APPLY_REDOLOGS);
+        trace(tid, EV_REDO_END, i-1, 0);
         // Failed to apply redo log so make a copy
         if (i != lastSeq+1) {
-            if (!makeCopy(newComb, tid)) {
+            if (!makeCopy(newComb, tid, ownRequest)) {
                 return nullptr;
             }
         } else {
@@ -641,25 +815,71 @@ private:
     alignas(128) std::atomic<std::function<uint64_t()>*> enqueuers[MAX_THREADS];
     alignas(128) std::atomic<bool>                       announce[MAX_THREADS];
 
+    // Request of each thread that threw PartitionError in a combiner, which is then applied without running it
+    alignas(128) std::atomic<std::function<uint64_t()>*> failedMutations[MAX_THREADS];
+
     // We need one hazard pointer to protect the std::function published in enqueuers[]
     HazardPointers<std::function<uint64_t()>> hpMut {1, maxThreads};
     const int kHpMut     = 0;
 
+    // Dedicated combiner threads, see startCombiners()
+    alignas(128) std::atomic<int>                        numCombiners {0};
+    std::atomic<bool>                                    stopCombining {false};
+    std::vector<std::thread>                             combinerThreads;
+    std::mutex                                           combinersMutex;
+    // Idle combiners sleep on idleCond, the writers wake them up when sleepingCombiners is not zero
+    alignas(128) std::atomic<int>                        sleepingCombiners {0};
+    std::mutex                                           idleMutex;
+    std::condition_variable                              idleCond;
+
     // Latest measurements of copy time
     alignas(128) std::atomic<microseconds> copyTime {100000us};
 
+    // Counters of the work done to persist, one instance per thread. Each instance is written only by its
+    // own thread, so a relaxed load and store is enough to increment, and stats() sums all of them.
+    struct alignas(128) ThreadCounters {
+        std::atomic<uint64_t> pwbs {0};
+        std::atomic<uint64_t> pfences {0};
+        std::atomic<uint64_t> ntBytes {0};
+        std::atomic<uint64_t> redoEntries {0};
+        std::atomic<uint64_t> fullCopies {0};
+        std::atomic<uint64_t> updateTxs {0};
+        std::atomic<uint64_t> readTxs {0};
+    };
+    alignas(128) ThreadCounters counters[MAX_THREADS];
+
+    static inline void count(std::atomic<uint64_t>& counter, uint64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    inline void countPersist(const int tid, uint64_t pwbs, uint64_t pfences) {
+        count(counters[tid].pwbs, pwbs);
+        count(counters[tid].pfences, pfences);
+    }
+
+    // Read lock of the replica 'combIndex' in the slot of 'tid'. The replica pinned by this thread is already
+    // locked in that slot, and stays locked after the transaction.
+    inline bool readTryLock(const int combIndex, const int tid) {
+        if (tlocal.pinRedo == this && tlocal.pinComb == combIndex) return true;
+        return combs[combIndex].rwLock.sharedTryLock(tid);
+    }
+
+    inline void readUnlock(const int combIndex, const int tid) {
+        if (tlocal.pinRedo == this && tlocal.pinComb == combIndex) return;
+        combs[combIndex].rwLock.sharedUnlock(tid);
+    }
+
     inline int getCombined(const int tid) {
         SeqTidIdx initComb = per->curComb.load();
         const int initCombSeq = sti2seq(initComb);
         // 3 instead of 2 to avoid PFENCE when reading curComb
         for (int i = 0; i < 2; i++) {
-            SeqTidIdx cComb = per->curComb.load();
+            SeqTidIdx cComb = loadCurComb();
             if(sti2seq(cComb) >= initCombSeq+2) break;
             const int curCombIndex = sti2idx(cComb);
-            Combined* lcomb = &combs[curCombIndex];
-            if (!lcomb->rwLock.sharedTryLock(tid)) continue;
-            if (cComb == per->curComb.load()) return curCombIndex;
-            lcomb->rwLock.sharedUnlock(tid);
+            if (!readTryLock(curCombIndex, tid)) continue;
+            if (cComb == loadCurComb()) return curCombIndex;
+            readUnlock(curCombIndex, tid);
         }
         return -1;
     }
@@ -667,7 +887,16 @@ private:
 
 
     // Id for sanity check
-    static const uint64_t MAGIC_ID = 0x1337BAB8;
+    static const uint64_t MAGIC_ID = 0x1337BABA;
+    // Id of the files of the versions with a heap of fixed size, which have another layout
+    static const uint64_t MAGIC_ID_FIXED_HEAP = 0x1337BAB8;
+    // Id of the files of the versions with slabs of up to 2 KB, the metadata of EsLoco has another layout
+    static const uint64_t MAGIC_ID_SMALL_SLABS = 0x1337BAB9;
+
+    // Address where new files are mapped. It's below the range where ASLR places shared libraries (1TB under
+    // the stack), so that a large reservation fits. When it's in use, a new file is mapped wherever the kernel
+    // finds room. A file is always mapped at the address it was created at, see PersistentHeader::baseAddr.
+    static constexpr uintptr_t PREFERRED_BASE_ADDR = 0x7e0000000000ULL;
 
     // Filename for the mapping file
     const char* MMAP_FILENAME = PM_FILE_NAME;
@@ -677,9 +906,10 @@ private:
     int fd = -1;
     uint8_t* base_addr;
     uint64_t max_size;
+    std::mutex growLock;
 
-    // One instance of this is at the start of base_addr, in persistent memory
-    struct PersistentHeader {
+    // Persistent state of one partition. Partition 0 uses the one at the start of the PersistentHeader.
+    struct PartitionHeader {
         uint64_t           id {0}; //validation
         std::atomic<SeqTidIdx>   curComb {0};
         persist<void*>*    objects {nullptr};   // directory
@@ -688,10 +918,122 @@ private:
 #else
         mspace             ms {};
 #endif
-        uint8_t            padding[1024-32]; // padding so that PersistentHeader size is 1024 bytes
+        uint64_t           mainSize {0};        // distance between replicas, must match g_main_size
+        uint64_t           heapSize {0};        // bytes in use by the heap of each replica, only grows
     };
 
-    PersistentHeader* per {nullptr};
+    // The curComb of each partition of a transaction over several partitions, written before any of them is.
+    // While 'pending' is set, a restart sets the curCombs that are not zero, see rollForwardMulti().
+    struct MultiCommit {
+        uint64_t           pending {0};
+        SeqTidIdx          curCombs[MAX_PARTITIONS] {};
+    };
+
+    // One instance of this is at the start of base_addr, in persistent memory
+    struct PersistentHeader : PartitionHeader {
+        uint64_t           numPartitions {0};   // PM_PARTITIONS when the file was created, 0 means 1
+        PartitionHeader    partitions[MAX_PARTITIONS-1];
+        uint8_t*           baseAddr {nullptr};  // Address of the mapping when the file was created, nullptr means PREFERRED_BASE_ADDR
+        MultiCommit        multi {};            // Zero in the files created before the transactions over several partitions
+        uint8_t            padding[1024-64-48*(MAX_PARTITIONS-1)-sizeof(MultiCommit)]; // padding so that PersistentHeader size is 1024 bytes
+    };
+
+    PartitionHeader* per {nullptr};
+
+    // Partition of the heap of this instance. Replica i of partition p starts at
+    // g_main_addr + p*partSize + i*g_main_size, and its heap can grow up to partSize.
+    int partIdx {0};
+    uint64_t partSize {0};
+    // Instances of the other partitions, only used in partition 0 (gRedo)
+    RedoOpt* partitions[MAX_PARTITIONS] {};
+
+    // A transaction over several partitions, in tlocal.multi while its function is executed. Each store is logged
+    // in the State of the partition of its address, see multiOwner().
+    struct MultiTx {
+        int                num {0};
+        RedoOpt*           parts[MAX_PARTITIONS];   // In ascending order of partition
+        int                slot[MAX_PARTITIONS];    // Index in parts[] of each partition, -1 if not declared
+        SeqTidIdx          cCombs[MAX_PARTITIONS];  // curComb of each partition when its commits were held
+        State*             states[MAX_PARTITIONS];
+        bool               copies[MAX_PARTITIONS];  // tlocal.copy of each partition
+        int                curr {0};                // Index of the partition of tlocal.st and tlocal.copy
+    };
+    // Transactions over several partitions are executed one at a time, only used in partition 0 (gRedo)
+    std::mutex multiMutex;
+
+    // Volatile copies of per->curComb in DRAM, one per NUMA node (up to MAX_CURCOMB_MIRRORS), each on a cache line
+    // of its own. The persistent curComb is flushed on every commit, which evicts it from all the caches, therefore
+    // the validation reads go to the copy of the node of the thread, and the persistent one is only read where a
+    // lower bound is needed (the start of a transaction) and at the CAS.
+    // All the copies are advanced after every successful CAS and before the previous replica is unlocked, which
+    // means that each of them can be behind the persistent curComb but never ahead of it.
+    // A commit invalidates every copy, the same as with a single copy, but the threads that wait for it then
+    // reload the line from their own node: one remote transfer per node instead of one per waiting thread.
+    static const int MAX_CURCOMB_MIRRORS = 8;
+    struct alignas(128) CurCombMirror {
+        std::atomic<SeqTidIdx> comb {0};
+    };
+    CurCombMirror vCurComb[MAX_CURCOMB_MIRRORS] {};
+    int numCurCombMirrors {1};
+    std::vector<int> cpuCurCombMirror {};   // Copy of curComb of each cpu, by the NUMA node of the cpu
+
+    // Replica pinned by each snapshot plus one, zero if the slot is free
+    std::atomic<int> snapshotCombs[MAX_SNAPSHOTS] {};
+    // Number of replicas pinned by the snapshots and by the threads (ns_pin_replica())
+    std::atomic<int> numPinned {0};
+
+    // The node of a thread is the one of the cpu it first ran a transaction on
+    inline SeqTidIdx loadCurComb() {
+        int mirror = tlocal.curCombMirror;
+        if (mirror < 0) {
+            const int cpu = sched_getcpu();
+            mirror = (cpu >= 0 && cpu < (int)cpuCurCombMirror.size()) ? cpuCurCombMirror[cpu] : 0;
+            tlocal.curCombMirror = mirror;
+        }
+        return vCurComb[mirror].comb.load();
+    }
+
+    // Advances the copies of curComb to 'comb', unless another thread has already published a newer one
+    inline void publishCurComb(SeqTidIdx comb) {
+        for (int i = 0; i < numCurCombMirrors; i++) {
+            SeqTidIdx cur = vCurComb[i].comb.load();
+            while (sti2seq(cur) < sti2seq(comb)) {
+                if (vCurComb[i].comb.compare_exchange_weak(cur, comb)) break;
+            }
+        }
+    }
+
+    // Calls fn(n) for each number of a list of ranges in sysfs, like "0-17,36-53"
+    template<typename F> static void forEachInSysList(const std::string& path, F fn) {
+        FILE* f = fopen(path.c_str(), "r");
+        if (f == nullptr) return;
+        char list[4096];
+        if (fgets(list, sizeof(list), f) != nullptr) {
+            char* p = list;
+            while (*p >= '0' && *p <= '9') {
+                long first = strtol(p, &p, 10);
+                long last = first;
+                if (*p == '-') last = strtol(p+1, &p, 10);
+                for (long n = first; n <= last; n++) fn((int)n);
+                if (*p == ',') p++;
+            }
+        }
+        fclose(f);
+    }
+
+    // Gives a copy of curComb to each online NUMA node. The nodes past MAX_CURCOMB_MIRRORS share the copies,
+    // and without sysfs there is a single copy.
+    void initCurCombMirrors() {
+        cpuCurCombMirror.assign(std::max({NUM_CORES, (int)sysconf(_SC_NPROCESSORS_CONF), 1}), 0);
+        numCurCombMirrors = 1;
+        forEachInSysList("/sys/devices/system/node/online", [this] (int node) {
+            const int mirror = node % MAX_CURCOMB_MIRRORS;
+            numCurCombMirrors = std::max(numCurCombMirrors, mirror+1);
+            forEachInSysList("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist", [this, mirror] (int cpu) {
+                if (cpu < (int)cpuCurCombMirror.size()) cpuCurCombMirror[cpu] = mirror;
+            });
+        });
+    }
 public:
 #ifdef USE_ESLOCO
     EsLoco<persist> esloco {};
@@ -715,11 +1057,14 @@ public:
 
 
     // Flush touched cache lines
-    inline void flush_range(uint8_t* addr, size_t length) {
+    inline void flush_range(uint8_t* addr, size_t length, const int tid) {
         const int cache_line_size = 64;
+        count(counters[tid].pwbs, (length + cache_line_size - 1)/cache_line_size);
         uint8_t* ptr = addr;
         uint8_t* last = addr + length;
-        for (; ptr < last; ptr += cache_line_size) PWB(ptr);
+        withPwbFlavor([&](auto flavor) {
+            for (; ptr < last; ptr += cache_line_size) flavor.pwb(ptr);
+        });
     }
 
 
@@ -748,16 +1093,17 @@ public:
             _to = _to + ntsize;
             size = size - ntsize;
         }
+        count(counters[tid].ntBytes, _from - from);
         //copy
         while(size>0){
             if(copySize > size) {
-                ntmemcpy(_to, _from, size);
+                ntmemcpy(_to, _from, size, tid);
                 break;
             }
             if(std::memcmp(_to, _from, copySize)!=0){
-                quadntmemcpy(_to, _from, copySize);
+                quadntmemcpy(_to, _from, copySize, tid);
             }
-            if(per->curComb.load() != initComb) {
+            if(loadCurComb() != initComb) {
                 return false;
             }
 
@@ -765,9 +1111,9 @@ public:
             _to = _to+copySize;
             _from = _from+copySize;
         }
-        //prevents reordering between per->curComb.load() and std::memcmp(_to, _from, copySize) and quadntmemcpy(_to, _from, copySize)
+        //prevents reordering between loadCurComb() and std::memcmp(_to, _from, copySize) and quadntmemcpy(_to, _from, copySize)
         std::atomic_thread_fence(std::memory_order_seq_cst);
-        if(per->curComb.load() != initComb) {
+        if(loadCurComb() != initComb) {
             return false;
         }
         auto endTime = steady_clock::now();
@@ -776,7 +1122,8 @@ public:
         return true;
     }
 
-    void ntmemcpy(uint8_t* _to, uint8_t* _from, uint64_t copySize){
+    void ntmemcpy(uint8_t* _to, uint8_t* _from, uint64_t copySize, const int tid){
+        count(counters[tid].ntBytes, copySize);
         const int ntsize = 8;
         uint8_t* ptr = _from;
         uint8_t* last = _from + copySize;
@@ -787,8 +1134,8 @@ public:
         }
     }
 
-    void quadntmemcpy(uint8_t* _to, uint8_t* _from, uint64_t copySize){
-        const int ntsize = 8; // 1 word
+    void quadntmemcpy(uint8_t* _to, uint8_t* _from, uint64_t copySize, const int tid){
+        count(counters[tid].ntBytes, copySize);
         const int quadntsize = 8*8; // 8 words
         uint8_t* ptr = _from;
         uint8_t* last = _from + copySize;
@@ -801,7 +1148,8 @@ public:
     }
 
     // Execute the pwbs to flush after a copy. Return false if the curComb changes in the meantime.
-    bool flushCopy(uint8_t* to, uint64_t usedSize){
+    // With ownRequest the flush also stops once the request of 'tid' has been applied by another thread.
+    bool flushCopy(uint8_t* to, uint64_t usedSize, const int tid, const bool ownRequest){
         SeqTidIdx curC = per->curComb.load();
         uint64_t initCombSeq = sti2seq(curC);
         uint64_t size = usedSize;
@@ -809,18 +1157,17 @@ public:
         uint64_t flushSize = 4096;
         while (size > 0) {
             if (flushSize > size) flushSize = size;
-            flush_range(to, flushSize);
-            SeqTidIdx cComb = per->curComb.load();
+            flush_range(to, flushSize, tid);
+            SeqTidIdx cComb = loadCurComb();
             if (cComb != curC) {
                 // Stop if the curComb has advanced two times or more
                 if (sti2seq(cComb) >= initCombSeq+2) break;
                 Combined* lcomb = &combs[sti2idx(cComb)];
                 SeqTidIdx ltail = lcomb->head.load();
-                if (cComb != per->curComb.load()) break;
-                const int tid = ThreadRegistry::getTID();
+                if (cComb != loadCurComb()) break;
                 bool an = announce[tid].load(std::memory_order_relaxed);
-                if (an == sauron[sti2tid(ltail)].states[sti2idx(ltail)].applied[tid].load()) {
-                    if (cComb == per->curComb.load()) break;
+                if (ownRequest && an == sauron[sti2tid(ltail)].states[sti2idx(ltail)].applied[tid].load()) {
+                    if (cComb == loadCurComb()) break;
                 }
                 curC = cComb;
             }
@@ -847,11 +1194,50 @@ public:
         e->addr = (uint8_t*)addr;
         e->oldval = oldval;
         e->val = val;
+        e->size = sizeof(uint64_t);
         // Clear if entry is from previous tx
         e->next = next;
         tail->buckets[hashAddr] = e;
     }
 
+    /*
+     * Adds a range entry to the write-set, with 'size' bytes (up to one cache line) starting at 'addr'.
+     * Range entries are always appended and are not added to the buckets of the write-set, which means
+     * that word entries inside [rangeLo,rangeHi) can not be aggregated, otherwise they could be replayed
+     * before an overlapping range entry.
+     * @return false if there is no room in the range log, in which case nothing was added
+     */
+    inline bool addRange(void* addr, const void* oldbytes, const void* newbytes, uint64_t size) noexcept {
+        State* state = (State*)tlocal.st;
+        uint64_t loc;
+        if (!state->rangeAlloc(size, loc)) return false;
+        uint8_t* bytes = state->rangeBytes(loc, size);
+        std::memcpy(bytes, oldbytes, size);
+        std::memcpy(bytes + size, newbytes, size);
+        WriteSetNode* tail = state->logTail;
+        uint64_t lSize = state->lSize;
+        if (lSize != 0 && lSize%MAXLOGSIZE == 0) {
+            WriteSetNode* next = tail->next;
+            if (next == nullptr) {
+                next = new WriteSetNode();
+                tail->next = next;
+                next->prev = tail;
+            }
+            tail = next;
+            state->logTail = next;
+        }
+        WriteSetEntry* e = &tail->log[lSize%MAXLOGSIZE];
+        e->addr = (uint8_t*)addr;
+        e->oldval = 0;
+        e->val = loc;
+        e->size = size;
+        e->next = nullptr;
+        state->lSize = lSize+1;
+        if (state->rangeLo == nullptr || (uint8_t*)addr < state->rangeLo) state->rangeLo = (uint8_t*)addr;
+        if ((uint8_t*)addr + size > state->rangeHi) state->rangeHi = (uint8_t*)addr + size;
+        return true;
+    }
+
     /*
      * @return false if address is already present otherwise true
      */
@@ -865,10 +1251,12 @@ public:
             state->lSize=lSize+1;
             return true;
         }
+        // Don't aggregate with a previous entry if a range entry of this tx may overlap this word
+        const int maxNodes = ((uint8_t*)addr >= state->rangeLo && (uint8_t*)addr < state->rangeHi) ? 0 : 16;
         WriteSetNode* node = tail;
         if(lSize%MAXLOGSIZE==0){
             for(int i=0;i<lSize/MAXLOGSIZE;i++){
-                if(i==16) break;
+                if(i==maxNodes) break;
                 WriteSetEntry* be = node->buckets[hashAddr];
                 if(hashAddress(be->addr) == hashAddr){
                     while (be != nullptr) {
@@ -894,7 +1282,7 @@ public:
         }else{
             int numNodes = lSize/MAXLOGSIZE +1;
             for(int i=0;i<numNodes;i++){
-                if(i==16) break;
+                if(i==maxNodes) break;
                 WriteSetEntry* be = node->buckets[hashAddr];
                 if(hashAddress(be->addr) != hashAddr){
                     node = node->prev;
@@ -1018,99 +1406,227 @@ public:
     RedoOpt() : dommap{true},maxThreads{MAX_THREADS}{
         gstartTime = steady_clock::now();
         sauron = new States[maxThreads];
+        // The States are split between the partitions, so that the memory usage doesn't depend on PM_PARTITIONS
+        for (int i = 0; i < maxThreads; i++) sauron[i].init(std::max(STATESSIZE/PM_PARTITIONS, 16));
         ring = new std::atomic<SeqTidIdx>[RINGSIZE];
         for(int i=0;i<RINGSIZE;i++) ring[i] = 0;
         combs = new Combined[MAX_COMBINEDS];
         for (int i = 0; i < maxThreads; i++) enqueuers[i].store(nullptr, std::memory_order_relaxed);
+        for (int i = 0; i < MAX_THREADS; i++) failedMutations[i].store(nullptr, std::memory_order_relaxed);
         NUM_CORES = std::thread::hardware_concurrency();
+        initCurCombMirrors();
         checkParams();
+        // Tracing can be turned on for the whole run with REDOOPT_TRACE=<file of the Chrome trace>
+        traceFile = getenv("REDOOPT_TRACE");
+        if (traceFile != nullptr && !tracer.enable(true)) {
+            printf("ERROR: no memory for the trace of REDOOPT_TRACE\n");
+            traceFile = nullptr;
+        }
 
         if (dommap) {
-            base_addr = (uint8_t*)0x7fddc0000000;
-            max_size = PM_REGION_SIZE + 1024;
+            max_size = std::max<uint64_t>(PM_REGION_SIZE, PM_REGION_MAX_SIZE) + 1024;
+            // The replicas are spaced for the largest heap so that growing the heap never moves them
+            g_main_size = (max_size - sizeof(PersistentHeader))/MAX_COMBINEDS;
+            g_main_size = (g_main_size/1024)*1024; // Round of g_main_size to a multiple of 1024
+            partSize = ((g_main_size/PM_PARTITIONS)/4096)*4096;
             // Check if the file already exists or not
             struct stat buf;
-            if (stat(MMAP_FILENAME, &buf) == 0) {
-                // File exists
+            bool fileExists = (stat(MMAP_FILENAME, &buf) == 0 && buf.st_size >= (off_t)sizeof(PersistentHeader));
+            fd = open(MMAP_FILENAME, O_RDWR|O_CREAT, 0755);
+            if (fd < 0) throw std::runtime_error(std::string("RedoOpt: can't open ") + MMAP_FILENAME + ": " + strerror(errno));
+            // The header of an existing file is read before the mapping, it has the address to map it at
+            alignas(PersistentHeader) uint8_t saved[sizeof(PersistentHeader)] {};
+            bool reuse = fileExists && pread(fd, saved, sizeof(saved), 0) == (ssize_t)sizeof(saved) &&
+                         checkHeader(*reinterpret_cast<PersistentHeader*>(saved));
+            uint8_t* wanted = (uint8_t*)PREFERRED_BASE_ADDR;
+            if (reuse && reinterpret_cast<PersistentHeader*>(saved)->baseAddr != nullptr) {
+                wanted = reinterpret_cast<PersistentHeader*>(saved)->baseAddr;
+            }
+            base_addr = mapRegion(wanted, reuse);
+            g_main_addr = base_addr + sizeof(PersistentHeader);
+            g_main_addr_end = g_main_addr + g_main_size;
+            g_region_end = g_main_addr +MAX_COMBINEDS*g_main_size;
+            for(int i = 0; i < MAX_COMBINEDS; i++){
+                combs[i].root = g_main_addr + i*g_main_size;
+            }
+            PersistentHeader* header = reinterpret_cast<PersistentHeader*>(base_addr);
+            per = header;
+            if (reuse) {
                 //std::cout << "Re-using memory region\n";
-                fd = open(MMAP_FILENAME, O_RDWR|O_CREAT, 0755);
-                assert(fd >= 0);
-                // mmap() memory range
-                uint8_t* got_addr = (uint8_t *)mmap(base_addr, max_size, (PROT_READ | PROT_WRITE), MAP_SHARED_VALIDATE | PM_FLAGS, fd, 0);
-                if (got_addr == MAP_FAILED || got_addr != base_addr) {
-                    perror("ERROR: mmap() is not working !!! ");
-                    printf("got_addr = %p instead of %p\n", got_addr, base_addr);
-                    assert(false);
-                }
-                per = reinterpret_cast<PersistentHeader*>(base_addr);
-                if(per->id != MAGIC_ID) createFile();
-
-
-                g_main_size = (max_size - sizeof(PersistentHeader))/MAX_COMBINEDS;
-                g_main_size = (g_main_size/1024)*1024; // Round of g_main_size to a multiple of 1024
-                g_main_addr = base_addr + sizeof(PersistentHeader);
-                g_main_addr_end = g_main_addr + g_main_size;
-                g_region_end = g_main_addr +MAX_COMBINEDS*g_main_size;
-                uint64_t combidx = sti2idx(per->curComb.load());
-                for(int i = 0; i < MAX_COMBINEDS; i++){
-                    combs[i].root = g_main_addr + i*g_main_size;
-                    if(i!=combidx){
-                        combs[i].head.store(makeSeqTidIdx(0, 1, 0),std::memory_order_relaxed);
-                    }else{
-                        combs[i].head.store(0,std::memory_order_relaxed);
-                    }
-                }
-                Combined* comb = &combs[combidx];
-                comb->rwLock.setReadLock();
-                per->curComb.store(makeSeqTidIdx(0, 0, combidx));
-                //std::cout<<per->curComb.load()<<" curComb\n";
-#ifdef USE_ESLOCO
-                esloco.init(g_main_addr, g_main_size, false);
-#endif
+                rollForwardMulti(header);
+                recover();
             } else {
                 createFile();
             }
+            for (int p = 1; p < PM_PARTITIONS; p++) partitions[p] = new RedoOpt(this, p);
         }
     }
 
+    // Instance of partition 'idx' of the heap, it uses the mapping of 'main'
+    RedoOpt(RedoOpt* main, const int idx) : dommap{false},maxThreads{MAX_THREADS},partIdx{idx} {
+        gstartTime = steady_clock::now();
+        sauron = new States[maxThreads];
+        for (int i = 0; i < maxThreads; i++) sauron[i].init(std::max(STATESSIZE/PM_PARTITIONS, 16));
+        ring = new std::atomic<SeqTidIdx>[RINGSIZE];
+        for(int i=0;i<RINGSIZE;i++) ring[i] = 0;
+        combs = new Combined[MAX_COMBINEDS];
+        for (int i = 0; i < maxThreads; i++) enqueuers[i].store(nullptr, std::memory_order_relaxed);
+        for (int i = 0; i < MAX_THREADS; i++) failedMutations[i].store(nullptr, std::memory_order_relaxed);
+        NUM_CORES = main->NUM_CORES;
+        numCurCombMirrors = main->numCurCombMirrors;
+        cpuCurCombMirror = main->cpuCurCombMirror;
+        fd = main->fd;
+        base_addr = main->base_addr;
+        max_size = main->max_size;
+        partSize = main->partSize;
+        for(int i = 0; i < MAX_COMBINEDS; i++){
+            combs[i].root = heapAddr() + i*g_main_size;
+        }
+        per = &reinterpret_cast<PersistentHeader*>(base_addr)->partitions[idx-1];
+        // A new file has all the partition headers zeroed
+        if (per->id == MAGIC_ID && per->mainSize == g_main_size) {
+            recover();
+        } else {
+            createFile();
+        }
+    }
+
+
+    // Returns true if the file of 'header' can be reused. Throws if it's a RedoOpt file that this build can't
+    // open: reformatting it would lose its data. Files created before the partitions have numPartitions at zero.
+    bool checkHeader(const PersistentHeader& header) {
+        if (header.id != MAGIC_ID && header.id != MAGIC_ID_FIXED_HEAP && header.id != MAGIC_ID_SMALL_SLABS) {
+            return false;   // Not a RedoOpt file, or not initialized
+        }
+        std::string error;
+        if (header.id == MAGIC_ID_FIXED_HEAP) {
+            error = "it was created by a version of RedoOpt with a heap of fixed size, which has another layout";
+        } else if (header.id == MAGIC_ID_SMALL_SLABS) {
+            error = "it was created by a version of RedoOpt with slabs of up to 2 KB, which has another layout";
+        } else if (header.mainSize != g_main_size) {
+            error = "its replicas are " + std::to_string(header.mainSize) + " bytes apart and this build has " +
+                    std::to_string(g_main_size) + " (PM_REGION_MAX_SIZE is not the same)";
+        } else if (std::max<uint64_t>(header.numPartitions, 1) != PM_PARTITIONS) {
+            error = "it has " + std::to_string(std::max<uint64_t>(header.numPartitions, 1)) +
+                    " partitions and this build has PM_PARTITIONS=" + std::to_string(PM_PARTITIONS);
+        } else {
+            return true;
+        }
+        close(fd);
+        throw std::runtime_error(std::string("RedoOpt: refusing to open ") + MMAP_FILENAME + ", " + error +
+                                 ". Move the file away to start with an empty heap.");
+    }
+
+    // mmap() the whole reserved range at 'wanted'. Only the part covered by the file may be accessed.
+    // The address is only a hint, the kernel never replaces an existing mapping. If the range is in use,
+    // a new file is mapped anywhere else, but an existing file has persistent pointers into its range.
+    uint8_t* mapRegion(uint8_t* wanted, bool existing) {
+        uint8_t* got_addr = (uint8_t *)mmap(wanted, max_size, (PROT_READ | PROT_WRITE), MAP_SHARED_VALIDATE | PM_FLAGS, fd, 0);
+        if (got_addr == wanted) return got_addr;
+        if (got_addr != MAP_FAILED) munmap(got_addr, max_size);
+        if (!existing) {
+            got_addr = (uint8_t *)mmap(nullptr, max_size, (PROT_READ | PROT_WRITE), MAP_SHARED_VALIDATE | PM_FLAGS, fd, 0);
+            if (got_addr != MAP_FAILED) return got_addr;
+        }
+        const std::string reason = got_addr == MAP_FAILED ? strerror(errno) : "the range is in use";
+        close(fd);
+        char msg[256];
+        snprintf(msg, sizeof(msg), "RedoOpt: can't map %llu bytes of %s at %p: ",
+                 (unsigned long long)max_size, MMAP_FILENAME, (void*)wanted);
+        throw std::runtime_error(msg + reason);
+    }
+
+    // Start of the heap of this partition, in the main replica
+    inline uint8_t* heapAddr() const {
+        return g_main_addr + partIdx*partSize;
+    }
+
+
+    // Finishes the last transaction over several partitions if the restart was while it set the curCombs. The
+    // partitions are recovered afterwards, from those curCombs.
+    void rollForwardMulti(PersistentHeader* header) {
+        MultiCommit& mc = header->multi;
+        if (mc.pending == 0) return;
+        for (int p = 0; p < PM_PARTITIONS; p++) {
+            if (mc.curCombs[p] == 0) continue;
+            PartitionHeader* ph = (p == 0) ? header : &header->partitions[p-1];
+            ph->curComb.store(mc.curCombs[p]);
+            PWB(&ph->curComb);
+        }
+        PFENCE();
+        mc.pending = 0;
+        PWB(&mc.pending);
+        PSYNC();
+    }
+
+    // Makes the replica of curComb the only one that is up to date, after a restart
+    void recover() {
+        uint64_t combidx = sti2idx(per->curComb.load());
+        for(int i = 0; i < MAX_COMBINEDS; i++){
+            if(i!=combidx){
+                combs[i].head.store(makeSeqTidIdx(0, 1, 0),std::memory_order_relaxed);
+            }else{
+                combs[i].head.store(0,std::memory_order_relaxed);
+            }
+        }
+        Combined* comb = &combs[combidx];
+        comb->rwLock.setReadLock();
+        per->curComb.store(makeSeqTidIdx(0, 0, combidx));
+        for (int i = 0; i < MAX_CURCOMB_MIRRORS; i++) vCurComb[i].comb.store(per->curComb.load());
+        //std::cout<<per->curComb.load()<<" curComb\n";
+#ifdef USE_ESLOCO
+        esloco.init(heapAddr(), per->heapSize, false);
+#endif
+    }
+
+
+    // Size the file must have so that every replica of this partition has 'heapSize' bytes of heap
+    uint64_t fileSizeFor(uint64_t heapSize) {
+        return sizeof(PersistentHeader) + (MAX_COMBINEDS-1)*g_main_size + partIdx*partSize + heapSize;
+    }
+
+    // Extends the file to at least 'size' bytes. The partitions share the file, so it never shrinks.
+    bool extendFile(uint64_t size) {
+        static std::mutex fileLock;
+        std::lock_guard<std::mutex> lock(fileLock);
+        struct stat buf;
+        if (fstat(fd, &buf) == 0 && (uint64_t)buf.st_size >= size) return true;
+        return ftruncate(fd, size) != -1;
+    }
+
 
     void createFile(){
-        // File doesn't exist
-        fd = open(MMAP_FILENAME, O_RDWR|O_CREAT, 0755);
-        assert(fd >= 0);
-        if (lseek(fd, max_size-1, SEEK_SET) == -1) {
-            perror("lseek() error");
-        }
-        if (write(fd, "", 1) == -1) {
-            perror("write() error");
-        }
-        // mmap() memory range
-        uint8_t* got_addr = (uint8_t *)mmap(base_addr, max_size, (PROT_READ | PROT_WRITE), MAP_SHARED_VALIDATE | PM_FLAGS, fd, 0);
-        if (got_addr == MAP_FAILED || got_addr != base_addr) {
-            perror("ERROR: mmap() is not working !!! ");
-            printf("got_addr = %p instead of %p\n", got_addr, base_addr);
-            assert(false);
+        // File (or partition) doesn't exist or is not valid. The initial heap of each replica is
+        // PM_REGION_SIZE/MAX_COMBINEDS, split between the partitions.
+        uint64_t heapSize = std::min<uint64_t>(((PM_REGION_SIZE/MAX_COMBINEDS/PM_PARTITIONS)/1024)*1024, partSize);
+        if (!extendFile(fileSizeFor(heapSize))) {
+            perror("ftruncate() error");
         }
         // No data in persistent memory, initialize
-        per = new (base_addr) PersistentHeader;
-        g_main_size = (max_size - sizeof(PersistentHeader))/MAX_COMBINEDS;
-        g_main_size = (g_main_size/1024)*1024; // Round of g_main_size to a multiple of 1024
-        g_main_addr = base_addr + sizeof(PersistentHeader);
-        g_main_addr_end = g_main_addr + g_main_size;
-        g_region_end = g_main_addr +MAX_COMBINEDS*g_main_size;
+        if (partIdx == 0) {
+            PersistentHeader* header = new (base_addr) PersistentHeader;
+            header->numPartitions = PM_PARTITIONS;
+            header->baseAddr = base_addr;
+            PWB(&header->numPartitions);
+            PWB(&header->baseAddr);
+            countPersist(ThreadRegistry::getTID(), 2, 0);
+            per = header;
+        } else {
+            per = new (per) PartitionHeader;
+        }
+        per->mainSize = g_main_size;
+        per->heapSize = heapSize;
         PWB(&per->curComb);
+        PWB(&per->heapSize);
 
-        for(int i = 0; i < MAX_COMBINEDS; i++){
-            combs[i].root = g_main_addr + i*g_main_size;
-        }
         Combined* comb = &combs[sti2idx(per->curComb.load())];
         comb->rwLock.setReadLock();
-        updateTx<bool>([&] () {
+        ns_write_transaction<bool>([&] () {
 #ifdef USE_ESLOCO
-            esloco.init(g_main_addr, g_main_size, true);
+            esloco.init(heapAddr(), heapSize, true);
             per->objects = (persist<void*>*)esloco.malloc(sizeof(void*)*NUM_OBJS);
 #else
-            per->ms = create_mspace_with_base(g_main_addr, g_main_size, false);
+            per->ms = create_mspace_with_base(heapAddr(), partSize, false);
             per->objects = (persist<void*>*)mspace_malloc(per->ms, sizeof(void*)*NUM_OBJS);
 #endif
             for (int i = 0; i < NUM_OBJS; i++) {
@@ -1122,10 +1638,56 @@ public:
         per->id = MAGIC_ID;
         PWB(&per->id);
         PSYNC();
+        countPersist(ThreadRegistry::getTID(), 3, 2);
+    }
+
+
+    /*
+     * Grows the heap of every replica to at least 'minHeapSize' bytes, without a restart.
+     * The replicas are g_main_size apart, so growing only needs to extend the (sparse) file
+     * and move the end of the pool. The new size is durable before anything is allocated from it.
+     * Returns false if the reserved range of the partition (PM_REGION_MAX_SIZE/PM_PARTITIONS) is exhausted
+     * or the file can't be extended.
+     */
+    bool growHeap(uint64_t minHeapSize) {
+        std::lock_guard<std::mutex> lock(growLock);
+        uint64_t heapSize = per->heapSize;
+        if (minHeapSize <= heapSize) return true;   // Another thread already did it
+        if (minHeapSize > partSize) return false;
+        // Double the heap each time, to amortize the cost of extending the file
+        uint64_t newHeapSize = std::max(minHeapSize, 2*heapSize);
+        newHeapSize = std::min(((newHeapSize+1023)/1024)*1024, partSize);
+        if (!extendFile(fileSizeFor(newHeapSize))) {
+            perror("ERROR: ftruncate() could not grow the heap ");
+            return false;
+        }
+        per->heapSize = newHeapSize;
+        PWB(&per->heapSize);
+        PSYNC();
+        countPersist(ThreadRegistry::getTID(), 1, 1);
+#ifdef USE_ESLOCO
+        esloco.grow(newHeapSize);
+#endif
+        return true;
     }
 
 
+#ifdef USE_ESLOCO
+    // Allocates from EsLoco, growing the heap if the pool is exhausted
+    void* heapMalloc(size_t size) {
+        void* addr = esloco.malloc(size);
+        // Blocks are aligned to their size, a new block (or slab) may need twice its size above the top of the pool
+        while (addr == nullptr && growHeap(std::max(esloco.getUsedSize() + 4*size + 32*1024, esloco.getPoolSize() + 1))) {
+            addr = esloco.malloc(size);
+        }
+        return addr;
+    }
+#endif
+
+
     ~RedoOpt() {
+        stopCombiners();
+        for (int p = 1; p < PM_PARTITIONS; p++) delete partitions[p];
         delete[] sauron;
         delete[] ring;
         delete[] combs;
@@ -1140,27 +1702,72 @@ public:
             std::cout << "RedoOpt: statsAllocBytes = " << statsAllocBytes << "\n";
             std::cout << "RedoOpt: statsAllocNum = " << statsAllocNum << "\n";
         }
+#ifdef MEASURE_FUNC_TIMES
+        std::cout << profiler.snapshot().toString(phaseNames());
+#endif
+        if (traceFile != nullptr) {
+            tracer.enable(false);
+            if (!tracer.saveChromeTrace(traceFile, eventInfos(), NUM_EVENTS)) {
+                std::cout << "RedoOpt: failed to write the trace to " << traceFile << "\n";
+            }
+        }
     }
 
     static std::string className() { return "RedoOptPTM"; }
 
+    // Instance of the partition of the transaction this thread is in, or gRedo when outside of a transaction
+    static inline RedoOpt& cur() {
+        RedoOpt* r = tlocal.redo;
+        return r != nullptr ? *r : gRedo;
+    }
+
+    // Sets the partition of the transactions of this thread, used by the allocator and the logging of stores
+    struct PartitionScope {
+        RedoOpt* prev;
+        PartitionScope(RedoOpt* r) : prev{tlocal.redo} { tlocal.redo = r; }
+        ~PartitionScope() { tlocal.redo = prev; }
+    };
+
+    // A transaction on a partition can't call a transaction on another one: each partition commits on its
+    // own replicas, only the transactions that declare their partitions can commit on several of them (see
+    // ns_multi_transaction()). The combiner that runs the outer transaction catches the exception, see combine(),
+    // and it's thrown again to the caller of the outer transaction.
+    void checkSamePartition() {
+        if (&cur() == this) return;
+        if (tlocal.multi != nullptr && static_cast<MultiTx*>(tlocal.multi)->slot[partIdx] >= 0) return;
+        throw PartitionError("RedoOpt: a transaction of partition " + std::to_string(cur().partIdx) +
+                             " started a transaction of partition " + std::to_string(partIdx));
+    }
+
+    // Throws PartitionError if the request of 'tid' was applied without effect in 'state'
+    void checkApplied(const State* state, const int tid) {
+        if (!state->failed[tid].load(std::memory_order_relaxed)) return;
+        throw PartitionError("RedoOpt: a transaction of partition " + std::to_string(partIdx) +
+                             " started a transaction of another partition, it was not applied");
+    }
+
     template <typename T>
     static inline T* get_object(int idx) {
-        return reinterpret_cast<T*>( gRedo.per->objects[idx].pload() );
+        return reinterpret_cast<T*>( cur().per->objects[idx].pload() );
     }
 
     template <typename T>
     static inline void put_object(int idx, T* obj) {
-        gRedo.per->objects[idx].pstore(obj);
+        cur().per->objects[idx].pstore(obj);
     }
 
 
     template<typename R,class F>
     R ns_read_transaction(F&& func) {
-        if (tl_nested_read_trans > 0) {
+        // Inside a write transaction the reads must see its stores, on the replica it's writing
+        if (tl_nested_read_trans > 0 || tl_nested_write_trans > 0) {
+            checkSamePartition();
+            PartitionScope scope {this};
             return (R)func();
         }
+        PartitionScope scope {this};
         int tid = ThreadRegistry::getTID();
+        count(counters[tid].readTxs, 1);
         ++tl_nested_read_trans;
         for (int i=0; i < MAX_READ_TRIES + 2; i++) {
 
@@ -1171,37 +1778,40 @@ public:
                 if (oldfunc != nullptr) hpMut.retire(oldfunc, tid);
                 const bool newrequest = !announce[tid].load();
                 announce[tid].store(newrequest); // seq-cst store
+                if (sleepingCombiners.load() > 0) wakeCombiners();
             }
-            SeqTidIdx cComb = per->curComb.load();
+            SeqTidIdx cComb = loadCurComb();
             const int curCombIndex = sti2idx(cComb);
             Combined* lcomb = &combs[curCombIndex];
 
-            if (lcomb->rwLock.sharedTryLock(tid)) {
+            if (readTryLock(curCombIndex, tid)) {
 
-                if(cComb == per->curComb.load()){
+                if(cComb == loadCurComb()){
                     SeqTidIdx ticket = lcomb->head.load();
                     if (sti2seq(ticket) == sti2seq(cComb)) {
                         tlocal.tl_cx_size = curCombIndex*g_main_size;
-                        auto ret = func();
-                        lcomb->rwLock.sharedUnlock(tid);
+                        auto ret = readOnReplica(func, curCombIndex, tid);
+                        readUnlock(curCombIndex, tid);
                         SeqTidIdx ringtail = ring[sti2seq(ticket)%RINGSIZE].load();
 
                         if(sti2seq(ringtail) < sti2seq(ticket)){
                             PWB(&per->curComb);
                             PSYNC();
+                            countPersist(tid, 1, 1);
                         }
                         --tl_nested_read_trans;
                         tlocal.tl_cx_size = 0;
                         return (R)ret;
                     }
                 }
-                lcomb->rwLock.sharedUnlock(tid);
+                readUnlock(curCombIndex, tid);
             }
         }
         --tl_nested_read_trans;
         SeqTidIdx cComb = per->curComb.load();
         PWB(&per->curComb);
         PSYNC();
+        countPersist(tid, 1, 1);
 
         const int combIndex = sti2idx(cComb);
         Combined* comb = &combs[combIndex];
@@ -1213,24 +1823,174 @@ public:
 
         State* tstate = &sauron[sti2tid(t)].states[sti2idx(t)];
 
+        checkApplied(tstate, tid);
         return (R)tstate->results[tid].load();
     }
 
-    bool makeCopy(Combined* newComb, int tid){
+    // Runs the read-only 'func' on the replica 'combIndex', which is read-locked by 'tid'. If 'func' throws, the
+    // replica is unlocked before the exception leaves the read transaction.
+    template<class F>
+    auto readOnReplica(F& func, const int combIndex, const int tid) -> decltype(func()) {
+        try {
+            return func();
+        } catch (...) {
+            readUnlock(combIndex, tid);
+            --tl_nested_read_trans;
+            tlocal.tl_cx_size = 0;
+            throw;
+        }
+    }
+
+    /*
+     * Pins the current replica for a snapshot, which holds the read lock of the replica until ns_unpin_snapshot().
+     * Returns the id of the snapshot, or -1 if there are already too many snapshots: each registered thread can
+     * hold the read lock of one replica and the combiners must always find a replica that is not locked.
+     */
+    int ns_pin_snapshot() {
+        const int limit = std::min<int>(MAX_SNAPSHOTS, MAX_COMBINEDS-1-(int)ThreadRegistry::getMaxThreads());
+        if (numPinned.fetch_add(1) >= limit) {
+            numPinned.fetch_sub(1);
+            return -1;
+        }
+        int snap = 0;
+        int expected = 0;
+        while (!snapshotCombs[snap].compare_exchange_strong(expected, -1)) {
+            expected = 0;
+            snap = (snap+1) % MAX_SNAPSHOTS;
+        }
+        const int slot = MAX_THREADS+snap;
+        while (true) {
+            SeqTidIdx cComb = loadCurComb();
+            const int combIndex = sti2idx(cComb);
+            Combined* lcomb = &combs[combIndex];
+            if (lcomb->rwLock.sharedTryLock(slot)) {
+                if (cComb == loadCurComb() && sti2seq(lcomb->head.load()) == sti2seq(cComb)) {
+                    snapshotCombs[snap].store(combIndex+1);
+                    // The snapshot may be the only reader of the last commit, make sure it is durable
+                    PWB(&per->curComb);
+                    PSYNC();
+                    countPersist(ThreadRegistry::getTID(), 1, 1);
+                    return snap;
+                }
+                lcomb->rwLock.sharedUnlock(slot);
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    void ns_unpin_snapshot(const int snap) {
+        const int combIndex = snapshotCombs[snap].load()-1;
+        combs[combIndex].rwLock.sharedUnlock(MAX_THREADS+snap);
+        snapshotCombs[snap].store(0);
+        numPinned.fetch_sub(1);
+    }
+
+    /*
+     * Pins the replica that has the last committed state for the values read by reference, with the read lock in
+     * the slot of the thread's own tid instead of the slot of a snapshot. All the pins of a thread share the lock
+     * of one replica, and the read transactions of the thread on that replica don't release it.
+     * Returns false, without pinning, if the thread is in a transaction, if it pins an older replica, or if the
+     * combiners would run out of replicas. The pin must be released by the same thread with ns_unpin_replica(),
+     * and in lease mode the thread keeps its tid until then.
+     */
+    bool ns_pin_replica() {
+        if (tl_nested_read_trans > 0 || tl_nested_write_trans > 0) return false;
+        if (tlocal.pinCount > 0) {
+            // The pinned replica can't be written, if it is the current one then it has the last commit
+            if (tlocal.pinRedo != this || tlocal.pinComb != sti2idx(loadCurComb())) return false;
+            tlocal.pinCount++;
+            return true;
+        }
+        const int limit = MAX_COMBINEDS-1-(int)ThreadRegistry::getMaxThreads();
+        if (numPinned.fetch_add(1) >= limit) {
+            numPinned.fetch_sub(1);
+            return false;
+        }
+        ThreadRegistry::Lease* lease = new ThreadRegistry::Lease(MAX_THREADS);
+        const int tid = ThreadRegistry::getTID();
+        while (true) {
+            SeqTidIdx cComb = loadCurComb();
+            const int combIndex = sti2idx(cComb);
+            Combined* lcomb = &combs[combIndex];
+            if (lcomb->rwLock.sharedTryLock(tid)) {
+                if (cComb == loadCurComb() && sti2seq(lcomb->head.load()) == sti2seq(cComb)) {
+                    // The pin may be the only reader of the last commit, make sure it is durable
+                    PWB(&per->curComb);
+                    PSYNC();
+                    countPersist(tid, 1, 1);
+                    tlocal.pinRedo = this;
+                    tlocal.pinComb = combIndex;
+                    tlocal.pinCount = 1;
+                    tlocal.pinLease = lease;
+                    return true;
+                }
+                lcomb->rwLock.sharedUnlock(tid);
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    void ns_unpin_replica() {
+        assert(tlocal.pinRedo == this && tlocal.pinCount > 0);
+        if (--tlocal.pinCount > 0) return;
+        combs[tlocal.pinComb].rwLock.sharedUnlock(ThreadRegistry::getTID());
+        numPinned.fetch_sub(1);
+        delete tlocal.pinLease;
+        tlocal.pinRedo = nullptr;
+        tlocal.pinComb = -1;
+        tlocal.pinLease = nullptr;
+    }
+
+    // Executes 'func' on the replica pinned by the snapshot. The nested read transactions of 'func' run on it too.
+    template<typename R, class F>
+    R ns_snapshot_read_transaction(const int snap, F&& func) {
+        return readOnPinned<R>(snapshotCombs[snap].load()-1, func);
+    }
+
+    // Executes 'func' on the replica pinned by this thread, same as ns_snapshot_read_transaction()
+    template<typename R, class F>
+    R ns_pinned_read_transaction(F&& func) {
+        assert(tlocal.pinRedo == this && tlocal.pinCount > 0);
+        return readOnPinned<R>(tlocal.pinComb, func);
+    }
+
+    template<typename R, class F>
+    R readOnPinned(const int combIndex, F& func) {
+        PartitionScope scope {this};
+        const uint64_t prevSize = tlocal.tl_cx_size;
+        tlocal.tl_cx_size = combIndex*g_main_size;
+        ++tl_nested_read_trans;
+        try {
+            auto ret = func();
+            --tl_nested_read_trans;
+            tlocal.tl_cx_size = prevSize;
+            return (R)ret;
+        } catch (...) {
+            --tl_nested_read_trans;
+            tlocal.tl_cx_size = prevSize;
+            throw;
+        }
+    }
+
+    // Copies the replica of curComb to 'newComb'. With ownRequest the copy is abandoned once the request of 'tid'
+    // has been applied by another thread.
+    bool makeCopy(Combined* newComb, int tid, const bool ownRequest){
         START_TIME();
         newComb->clsets.reset();
         SeqTidIdx initComb = per->curComb.load();
         uint64_t initCombSeq = sti2seq(initComb);
+        trace(tid, EV_COPY_BEGIN, initCombSeq, 0);
         newComb->head.store(makeSeqTidIdx(0, 1, 0));
         for(int i=0;i<2;i++){
             int lCombIndex = sti2idx(initComb);
             Combined* lcomb = &combs[lCombIndex];
 
             SeqTidIdx head = lcomb->head.load();
-            if(initComb!=per->curComb.load()) {
-                initComb = per->curComb.load();
+            if(initComb!=loadCurComb()) {
+                initComb = loadCurComb();
                 if(sti2seq(initComb)>= initCombSeq+2) {
-                    END_TIME(0);
+                    END_TIME(PHASE_COPY);
+                    trace(tid, EV_COPY_END, 0, 0);
                     return false;
                 }
                 continue;
@@ -1240,31 +2000,36 @@ public:
             State* tail_state = &tail_states->states[sti2idx(head)];
             bool an = announce[tid].load(std::memory_order_relaxed);
 
-            if(an == tail_state->applied[tid].load()){
-                if(initComb==per->curComb.load()) {
-                    END_TIME(0);
+            if(ownRequest && an == tail_state->applied[tid].load()){
+                if(initComb==loadCurComb()) {
+                    END_TIME(PHASE_COPY);
+                    trace(tid, EV_COPY_END, 0, 0);
                     return false;
                 }
-                initComb = per->curComb.load();
+                initComb = loadCurComb();
                 if(sti2seq(initComb)>= initCombSeq+2) {
-                    END_TIME(0);
+                    END_TIME(PHASE_COPY);
+                    trace(tid, EV_COPY_END, 0, 0);
                     return false;
                 }
                 continue;
             }
 
             if(!copyFromTo(lcomb->root, newComb->root, lCombIndex, initComb, tid)){
-                initComb = per->curComb.load();
+                initComb = loadCurComb();
                 if(sti2seq(initComb)>= initCombSeq+2) {
-                    END_TIME(0);
+                    END_TIME(PHASE_COPY);
+                    trace(tid, EV_COPY_END, 0, 0);
                     return false;
                 }
                 continue;
             }
+            count(counters[tid].fullCopies, 1);
             newComb->flushcopy = false;
             tlocal.copy = false;
             newComb->head.store(head);
-            END_TIME(0);
+            END_TIME(PHASE_COPY);
+            trace(tid, EV_COPY_END, 1, 0);
             return true;
         }
         assert(false);
@@ -1274,20 +2039,21 @@ public:
     int getNewComb(uint64_t cComb, const int tid) {
         unsigned int mThreads = ThreadRegistry::getMaxThreads();
         if(mThreads>1){
-            SeqTidIdx curC = per->curComb.load();
+            SeqTidIdx curC = loadCurComb();
             int start = sti2idx(curC)+1;
             for(int i=start;i<MAX_COMBS;i++){
-                SeqTidIdx curC = per->curComb.load();
+                SeqTidIdx curC = loadCurComb();
                 if (cComb!=curC) return -1;
                 if (combs[i].rwLock.exclusiveTryLock(tid)) return i;
             }
         }
 
         auto _startTime = steady_clock::now();
+        START_TIME();
 
         if(copyTime.load()==0us){
             for (int i = 0; i < MAX_COMBINEDS; i++) {
-                SeqTidIdx curC = per->curComb.load();
+                SeqTidIdx curC = loadCurComb();
                 if (cComb!=curC) return -1;
                 if (combs[i].rwLock.exclusiveTryLock(tid)) return i;
             }
@@ -1298,13 +2064,13 @@ public:
         microseconds timeus = duration_cast<microseconds>(endTime-_startTime);
         while (timeus < copyTime.load()*4) {
             for (int i = 0; i < MAX_COMBS; i++) {
-                SeqTidIdx curC = per->curComb.load();
+                SeqTidIdx curC = loadCurComb();
                 if (cComb!=curC) {
-                    END_TIME(9);
+                    END_TIME(PHASE_SLEEPING);
                     return -1;
                 }
                 if (combs[i].rwLock.exclusiveTryLock(tid)) {
-                    END_TIME(9);
+                    END_TIME(PHASE_SLEEPING);
                     return i;
                 }
             }
@@ -1313,34 +2079,39 @@ public:
             endTime = steady_clock::now();
             timeus = duration_cast<microseconds>(endTime-_startTime);
         }
-        END_TIME(9);
+        END_TIME(PHASE_SLEEPING);
         // Now scan to the end (there can be multiple ones repeating on the first 4)
         for (int i = 0; i < MAX_COMBINEDS; i++) {
-            SeqTidIdx curC = per->curComb.load();
+            SeqTidIdx curC = loadCurComb();
             if (cComb!=curC) return -1;
             if (combs[i].rwLock.exclusiveTryLock(tid)) return i;
         }
         return -1;
     }
 
-    // Non-static thread-safe read-write transaction.
-    // Progress: wait-free
-    template<typename R, class F> R ns_write_transaction(F&& func) {
-        START_TIME();
-        // Call lambda directly if we're already inside a transaction
-        if (tl_nested_write_trans > 0) return (R)func();
-        ++tl_nested_write_trans;
-        // Encapsulate the lambda inside a std::function object and publish a pointer to the std::function
-        const int tid = ThreadRegistry::getTID();
-        auto oldfunc = enqueuers[tid].load(std::memory_order_relaxed);
-        std::function<uint64_t()>* myfunc = (std::function<uint64_t()>*)new std::function<R()>(func);
-        enqueuers[tid].store(myfunc, std::memory_order_relaxed);
-        const bool newrequest = !announce[tid].load(std::memory_order_relaxed);
-        announce[tid].store(newrequest);  // seq-cst store
-        uint64_t initCombSeq = sti2seq(per->curComb.load());
-        // Retire the std::function of the previous tx
-        if (oldfunc != nullptr) hpMut.retire(oldfunc, tid);
+    // Empties the logs of 'newState' and copies the results of 'tail_state', the State of curComb
+    inline void startState(State* newState, const SeqTidIdx newTicket, State* tail_state) {
+        newState->ticket.store(newTicket);
+        newState->logTail = &newState->logHead;
+        newState->lSize = 0;
+        newState->rangeUsed = 0;
+        newState->rangeLo = nullptr;
+        newState->rangeHi = nullptr;
+        newState->numCL = 0;
+        newState->logTailCL = &newState->logHeadCL;
+        // Copy the contents of the current State into the new State
+        newState->copyFrom(tail_state);
+        newState->logSize.store(0);
+    }
 
+    /*
+     * Applies the open requests on a replica and makes it the new curComb, the core of the write transactions.
+     * Called with ownRequest=true by a thread for its own request, in which case it gives up once its request
+     * has been applied by another thread, or by a combiner thread with ownRequest=false for the requests of the
+     * other threads, in which case it gives up when there are no open requests.
+     * Returns the State of the new curComb, or nullptr if this thread did not commit.
+     */
+    State* combine(const int tid, const bool ownRequest, const bool newrequest, const uint64_t initCombSeq) {
         Combined* newComb = nullptr;
         int newCombIndex = 0;
         States* newStates = &sauron[tid];
@@ -1348,59 +2119,59 @@ public:
         //used for logging
         tlocal.st = newState;
         for (int iter = 0; iter < 2; iter++) {
-            SeqTidIdx cComb = per->curComb.load();
+            SeqTidIdx cComb = loadCurComb();
             uint64_t seqltail = sti2seq(cComb);
             Combined* lcomb = &combs[sti2idx(cComb)];
             SeqTidIdx ltail = lcomb->head.load();
             if(seqltail >= initCombSeq+2) break;
 
-            if (cComb != per->curComb.load()) continue;
+            if (cComb != loadCurComb()) continue;
             States* tail_states = &sauron[sti2tid(ltail)];
             State* tail_state = &tail_states->states[sti2idx(ltail)];
 
-            if(newrequest == tail_state->applied[tid].load()){
-                if(cComb == per->curComb.load()) break;
-                continue;
+            if (ownRequest) {
+                if(newrequest == tail_state->applied[tid].load()){
+                    if(cComb == loadCurComb()) break;
+                    continue;
+                }
+            } else if (!hasOpenRequests(tail_state)) {
+                break;
             }
 
             SeqTidIdx newTicket = makeSeqTidIdx(seqltail+1, (uint64_t)tid, newStates->lastIdx);
-            newState->ticket.store(newTicket);
-            newState->logTail = &newState->logHead;
-            newState->lSize = 0;
-            newState->numCL = 0;
-            newState->logTailCL = &newState->logHeadCL;
-            // Copy the contents of the current State into the new State
-            newState->copyFrom(tail_state);
-            newState->logSize.store(0);
+            startState(newState, newTicket, tail_state);
 
-            if(cComb != per->curComb.load()) continue;
+            if(cComb != loadCurComb()) continue;
 
             SeqTidIdx ringtail = ring[seqltail%RINGSIZE].load();
             if(ltail != ringtail){
                 if(sti2seq(ringtail) > seqltail) continue;
                 PWB(&per->curComb);
                 //advance tail like Michael and Scott
+                countPersist(tid, 1, 0);
                 ring[seqltail%RINGSIZE].compare_exchange_strong(ringtail, ltail);
             }
 
             if(newComb == nullptr){
+                Profiler::Timer timer {profiler, tid, PHASE_GET_NEW_COMB};
                 newCombIndex = getNewComb(cComb, tid);
                 if(newCombIndex==-1) continue;
             }
             newComb = &combs[newCombIndex];
             tlocal.tl_cx_size = newCombIndex*g_main_size;
+            trace(tid, EV_REPLICA_ACQUIRED, newCombIndex, seqltail);
 
             //apply missing redo log
             SeqTidIdx lastAppliedTicket = newComb->head.load();
             if(lastAppliedTicket == makeSeqTidIdx(0, 1, 0)){
-                if(!makeCopy(newComb, tid)) break;
+                if(!makeCopy(newComb, tid, ownRequest)) break;
             }else{
                 tlocal.copy = newComb->flushcopy;
-                if( apply_redologs(newComb, initCombSeq, lastAppliedTicket, ltail, tid)==nullptr) break;
+                if( apply_redologs(newComb, initCombSeq, lastAppliedTicket, ltail, tid, ownRequest)==nullptr) break;
             }
 
             // re-start because curComb changed
-            if(cComb != per->curComb.load()) continue;
+            if(cComb != loadCurComb()) continue;
 
             //optimization
             //if (seqltail != sti2seq(ring[seqltail%RINGSIZE].load())) break;
@@ -1408,43 +2179,39 @@ public:
             // Now newComb is as up to date as curComb
             // Help other requests, starting from zero
 
-            bool atleastone = false;
-
+            trace(tid, EV_COMBINE_BEGIN, seqltail+1, 0);
             START_TIMEST();
-            for (uint64_t i = 0; i < maxThreads; i++) {
-                // Check if it is an open request
-                bool applied = newState->applied[i].load();
-                if (announce[i].load() == applied) continue;
-                // Apply the mutation and save the result
-                std::function<uint64_t()>* mutation = hpMut.protectPtr(kHpMut, enqueuers[i].load(), tid);
-                if (mutation != enqueuers[i].load()) break;
-                if(cComb != per->curComb.load()) break;
-
-                atleastone = true;
-                newState->results[i].store((*mutation)(),std::memory_order_release);
-                newState->applied[i].store(!applied);
-            }
-
-            END_TIMEST(8);
-            if(!atleastone) continue;
+            const int64_t numRequests = applyRequests(newState, cComb, tid);
+            END_TIMEST(PHASE_LAMBDAS);
+            trace(tid, EV_COMBINE_END, std::max<int64_t>(numRequests, 0), 0);
+            if (numRequests < 0) {
+                // Done again without the request that failed, which bounds the number of retries by maxThreads
+                apply_undolog(newState);
+                iter--;
+                continue;
+            }
+            if(numRequests == 0) continue;
             if(!tlocal.copy){
+                Profiler::Timer timer {profiler, tid, PHASE_AGGR_CL};
                 newComb->clsets.merge(newState);
             }else{
                 newComb->flushcopy = tlocal.copy;
             }
-            if(cComb != per->curComb.load()){
+            if(cComb != loadCurComb()){
                 apply_undolog(newState);
                 continue;
             }
 
             if(tlocal.copy){
-                if(!flushCopy(newComb->root, esloco.getUsedSize())){
+                Profiler::Timer timer {profiler, tid, PHASE_FLUSH_COPY};
+                if(!flushCopy(newComb->root, esloco.getUsedSize(), tid, ownRequest)){
                     apply_undolog(newState);
                     break;
                 }
                 newComb->flushcopy = false;
                 tlocal.copy = false;
             }else{
+                countPersist(tid, newComb->clsets.numCL, 0);
                 newComb->clsets.flushDeferredPWBs();
             }
             newComb->clsets.reset();
@@ -1457,41 +2224,215 @@ public:
             //this PFENCE is ommited because it will be executed per->curComb.compare_exchange_strong(tmp, newCombIndex) that
             // will issue the necessary fence that orders previous PWB and the store on curComb
             //PFENCE();
+            PFENCE_BY_CAS();
+            countPersist(tid, 0, 1);
 #ifdef MEASURE_PWB
             tl_num_pfences++;
 #endif
             if (per->curComb.compare_exchange_strong(cComb, newcComb)){
+                trace(tid, EV_CAS_SUCCESS, seqltail+1, newCombIndex);
+                publishCurComb(newcComb);
                 lcomb->rwLock.setReadUnlock();
                 SeqTidIdx oldTicket = ring[(seqltail+1)%RINGSIZE].load();
                 if(sti2seq(oldTicket) < seqltail+1){
                     PWB(&per->curComb);
                     //PSYNC();
+                    PFENCE_BY_CAS();
+                    countPersist(tid, 1, 1);
 #ifdef MEASURE_PWB
                     tl_num_pfences++;
 #endif
                     ring[(seqltail+1)%RINGSIZE].compare_exchange_strong(oldTicket, newTicket);
                 }
                 newStates->lastIdx++;
-                if(newStates->lastIdx == STATESSIZE) newStates->lastIdx = 0;
+                if(newStates->lastIdx == newStates->size) newStates->lastIdx = 0;
                 hpMut.clear(tid);
-                --tl_nested_write_trans;
                 tlocal.tl_cx_size = 0;
                 tlocal.st = nullptr;
-                END_TIMEF(12);
-                return (R)newState->results[tid].load();
+                return newState;
             }
+            trace(tid, EV_CAS_FAILURE, seqltail+1, sti2seq(cComb));
+            // Help to advance the copy of curComb, otherwise the next iteration would fail again
+            const bool locked = isLocked(cComb);
+            if (!locked) publishCurComb(cComb);
             apply_undolog(newState);
             newComb->head.store(ltail,std::memory_order_release);
             newComb->rwLock.setReadUnlock();
             newComb = nullptr;
+            if (locked) {
+                // A transaction over several partitions holds the commits, this attempt doesn't count
+                waitWhileLocked(cComb);
+                iter--;
+            }
         }
         hpMut.clear(tid);
         if(newComb!=nullptr){
             newComb->rwLock.exclusiveUnlock();
         }
-        --tl_nested_write_trans;
         tlocal.tl_cx_size = 0;
         tlocal.st = nullptr;
+        return nullptr;
+    }
+
+    /*
+     * Executes the requests that are open in 'newState' and saves their results in it, giving up if curComb is no
+     * longer 'cComb'. Returns the number of requests applied, or -1 if one of them threw PartitionError. Its stores
+     * are then mixed with those of the other requests in the log, so the caller must undo newState and call this
+     * again, and that request is applied without running it.
+     */
+    int64_t applyRequests(State* newState, const SeqTidIdx cComb, const int tid) {
+        int64_t numRequests = 0;
+        for (uint64_t i = 0; i < maxThreads; i++) {
+            // Check if it is an open request
+            bool applied = newState->applied[i].load();
+            if (announce[i].load() == applied) continue;
+            // Apply the mutation and save the result
+            std::function<uint64_t()>* mutation = hpMut.protectPtr(kHpMut, enqueuers[i].load(), tid);
+            if (mutation != enqueuers[i].load()) break;
+            if(cComb != loadCurComb()) break;
+
+            numRequests++;
+            if (failedMutations[i].load() == mutation) {
+                newState->failed[i].store(true, std::memory_order_relaxed);
+            } else {
+                try {
+                    newState->results[i].store((*mutation)(),std::memory_order_release);
+                } catch (const PartitionError&) {
+                    failedMutations[i].store(mutation);
+                    return -1;
+                }
+                newState->failed[i].store(false, std::memory_order_relaxed);
+            }
+            newState->applied[i].store(!applied);
+        }
+        return numRequests;
+    }
+
+    // Yields until the transaction over several partitions that holds the commits of this one releases them
+    void waitWhileLocked(const SeqTidIdx lComb) {
+        while (per->curComb.load() == lComb) std::this_thread::yield();
+    }
+
+    // Returns true if a request in 'state' has not been applied
+    inline bool hasOpenRequests(State* state) {
+        for (int i = 0; i < maxThreads; i++) {
+            if (announce[i].load() != state->applied[i].load()) return true;
+        }
+        return false;
+    }
+
+    /*
+     * Waits until the request of 'tid' is applied by a combiner thread. Returns false if there are no combiner
+     * threads (or when they are stopped while waiting), in which case this thread must do the combining.
+     */
+    bool waitForCombiners(const int tid, const bool newrequest) {
+        const uint64_t maxSpins = spinLimit();
+        for (uint64_t spins = 0; numCombiners.load(std::memory_order_relaxed) > 0; spins++) {
+            SeqTidIdx cComb = loadCurComb();
+            SeqTidIdx head = combs[sti2idx(cComb)].head.load();
+            State* state = &sauron[sti2tid(head)].states[sti2idx(head)];
+            if (state->applied[tid].load() == newrequest && cComb == loadCurComb()) return true;
+            if (spins >= maxSpins) std::this_thread::yield();
+        }
+        return false;
+    }
+
+    // Number of times to poll before yielding, when waiting for another thread. Spinning only helps when that
+    // thread has a core of its own, with fewer cores it delays the thread that is waited for.
+    uint64_t spinLimit() const {
+        return NUM_CORES > numCombiners.load(std::memory_order_relaxed) ? 1000 : 0;
+    }
+
+    // Returns true if some thread announced a request that is not applied in the current state
+    bool pendingRequests() {
+        SeqTidIdx cComb = loadCurComb();
+        SeqTidIdx head = combs[sti2idx(cComb)].head.load();
+        return hasOpenRequests(&sauron[sti2tid(head)].states[sti2idx(head)]);
+    }
+
+    // Puts an idle combiner to sleep until wakeCombiners() or stopCombiners(). The writers store in announce[]
+    // before reading sleepingCombiners, and the combiner increments it before checking announce[], both
+    // seq-cst, so at least one of them sees the other. The timeout is only a safety net.
+    void sleepWhileIdle() {
+        std::unique_lock<std::mutex> lock(idleMutex);
+        sleepingCombiners.fetch_add(1);
+        if (!stopCombining.load() && !pendingRequests()) idleCond.wait_for(lock, 10ms);
+        sleepingCombiners.fetch_sub(1);
+    }
+
+    void wakeCombiners() {
+        std::lock_guard<std::mutex> lock(idleMutex);
+        idleCond.notify_all();
+    }
+
+    // Body of a combiner thread. When there are no requests it spins for a while, then yields, and then sleeps.
+    void combinerLoop(const int cpu) {
+        if (cpu >= 0) {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(cpu, &cpuset);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+        }
+        const int tid = ThreadRegistry::getTID();
+        PartitionScope scope {this};
+        // The lambdas may start write transactions of their own, which must be flattened like in combine()
+        ++tl_nested_write_trans;
+        const uint64_t kIdleYields = 1000;
+        uint64_t idle = 0;
+        while (!stopCombining.load(std::memory_order_relaxed)) {
+            SeqTidIdx cComb = loadCurComb();
+            SeqTidIdx head = combs[sti2idx(cComb)].head.load();
+            if (!hasOpenRequests(&sauron[sti2tid(head)].states[sti2idx(head)])) {
+                const uint64_t idleSpins = spinLimit();
+                if (++idle > idleSpins + kIdleYields) {
+                    sleepWhileIdle();   // Sleeps again until there is a request
+                } else if (idle > idleSpins) {
+                    std::this_thread::yield();
+                }
+                continue;
+            }
+            idle = 0;
+            combine(tid, false, false, sti2seq(cComb));
+        }
+        --tl_nested_write_trans;
+    }
+
+    // Non-static thread-safe read-write transaction.
+    // Progress: wait-free
+    template<typename R, class F> R ns_write_transaction(F&& func) {
+        START_TIME();
+        // Call lambda directly if we're already inside a transaction
+        if (tl_nested_write_trans > 0) {
+            checkSamePartition();
+            PartitionScope scope {this};
+            return (R)func();
+        }
+        PartitionScope scope {this};
+        ++tl_nested_write_trans;
+        // Encapsulate the lambda inside a std::function object and publish a pointer to the std::function
+        const int tid = ThreadRegistry::getTID();
+        auto oldfunc = enqueuers[tid].load(std::memory_order_relaxed);
+        std::function<uint64_t()>* myfunc = (std::function<uint64_t()>*)new std::function<R()>(func);
+        enqueuers[tid].store(myfunc, std::memory_order_relaxed);
+        count(counters[tid].updateTxs, 1);
+        const bool newrequest = !announce[tid].load(std::memory_order_relaxed);
+        announce[tid].store(newrequest);  // seq-cst store
+        if (sleepingCombiners.load() > 0) wakeCombiners();
+        uint64_t initCombSeq = sti2seq(per->curComb.load());
+        trace(tid, EV_TX_BEGIN, initCombSeq, 0);
+        // Retire the std::function of the previous tx
+        if (oldfunc != nullptr) hpMut.retire(oldfunc, tid);
+
+        State* newState = nullptr;
+        // With dedicated combiners we only have to wait for our request to be applied
+        if (!waitForCombiners(tid, newrequest)) newState = combine(tid, true, newrequest, initCombSeq);
+        --tl_nested_write_trans;
+        if (newState != nullptr) {
+            END_TIMEF(PHASE_WRITE_TX);
+            trace(tid, EV_TX_END, sti2seq(newState->ticket.load()), 0);
+            checkApplied(newState, tid);
+            return (R)newState->results[tid].load();
+        }
 
         SeqTidIdx cComb = per->curComb.load();
         const int combIndex = sti2idx(cComb);
@@ -1505,21 +2446,264 @@ public:
             if(sti2seq(oldTicket) < combSeq){
                 PWB(&per->curComb);
                 //PSYNC();
+                PFENCE_BY_CAS();
+                countPersist(tid, 1, 1);
                 ring[combSeq%RINGSIZE].compare_exchange_strong(oldTicket, t);
             }
         }
         States* tstates = &sauron[sti2tid(t)];
         State* tstate = &tstates->states[sti2idx(t)];
 
-        END_TIMEF(12);
+        END_TIMEF(PHASE_WRITE_TX);
+        trace(tid, EV_TX_END, sti2seq(t), 0);
+        checkApplied(tstate, tid);
         return (R)tstate->results[tid].load();
     }
 
+    /*
+     * Transaction over the partitions 'parts' (in ascending order, without duplicates), called on gRedo. The commits
+     * of the partitions are held in that order (lockCombining()), 'func' is executed on a replica with the same index
+     * in all of them, and then the requests announced in those partitions are applied. The new curCombs are written
+     * to PersistentHeader::multi before any of them is set, so that a restart sees all of them or none. When there
+     * is nothing to commit, like for a read-only 'func', the curCombs are given back as they were.
+     * Progress: blocking. These transactions run one at a time, and the combiners of their partitions wait for them.
+     */
+    template<typename R, class F> R ns_multi_transaction(const std::vector<int>& parts, F&& func) {
+        // Call lambda directly if we're already inside a transaction of all those partitions
+        if (tl_nested_write_trans > 0 || tl_nested_read_trans > 0) {
+            for (int p : parts) partition(p).checkSamePartition();
+            PartitionScope scope {&partition(parts[0])};
+            return (R)func();
+        }
+        std::lock_guard<std::mutex> lock(multiMutex);
+        const int tid = ThreadRegistry::getTID();
+        MultiTx m {};
+        for (int p = 0; p < MAX_PARTITIONS; p++) m.slot[p] = -1;
+        for (int p : parts) {
+            m.slot[p] = m.num;
+            m.parts[m.num] = &partition(p);
+            m.cCombs[m.num] = m.parts[m.num]->lockCombining();
+            m.num++;
+        }
+        count(m.parts[0]->counters[tid].updateTxs, 1);
+        const int newCombIndex = lockCommonReplica(m, tid);
+        tlocal.tl_cx_size = newCombIndex*g_main_size;
+        for (int k = 0; k < m.num; k++) {
+            m.states[k] = m.parts[k]->prepareMulti(m.cCombs[k], newCombIndex, tid);
+            m.copies[k] = tlocal.copy;
+        }
+        R ret {};
+        std::exception_ptr error {nullptr};
+        int64_t numRequests = 0;
+        ++tl_nested_write_trans;
+        while (true) {
+            if (!error) {
+                m.curr = 0;
+                tlocal.st = m.states[0];
+                tlocal.copy = m.copies[0];
+                tlocal.multi = &m;
+                try {
+                    PartitionScope scope {m.parts[0]};
+                    ret = (R)func();
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                m.copies[m.curr] = tlocal.copy;
+                tlocal.multi = nullptr;
+                // The requests are still applied, and the exception is thrown to the caller after the commit
+                if (error) undoMulti(m);
+            }
+            numRequests = 0;
+            for (int k = 0; k < m.num && numRequests >= 0; k++) {
+                PartitionScope scope {m.parts[k]};
+                tlocal.st = m.states[k];
+                tlocal.copy = m.copies[k];
+                const int64_t n = m.parts[k]->applyRequests(m.states[k], m.cCombs[k], tid);
+                m.copies[k] = tlocal.copy;
+                numRequests = (n < 0) ? -1 : numRequests + n;
+            }
+            if (numRequests >= 0) break;
+            // A request threw PartitionError, everything is done again without running it (see applyRequests())
+            undoMulti(m);
+        }
+        --tl_nested_write_trans;
+        bool modified = numRequests > 0;
+        for (int k = 0; k < m.num; k++) modified = modified || m.states[k]->lSize > 0;
+        if (modified) {
+            commitMulti(m, newCombIndex, tid);
+        } else {
+            releaseMulti(m, newCombIndex);
+        }
+        for (int k = 0; k < m.num; k++) m.parts[k]->hpMut.clear(tid);
+        tlocal.tl_cx_size = 0;
+        tlocal.st = nullptr;
+        tlocal.copy = false;
+        if (error) std::rethrow_exception(error);
+        return ret;
+    }
+
+    // Holds the commits of this partition for a transaction over several partitions and returns the curComb. The
+    // replica of the curComb doesn't change, therefore the readers are not affected, but the CAS of the combiners
+    // fails until curComb is set again (see combine()).
+    SeqTidIdx lockCombining() {
+        SeqTidIdx cComb = per->curComb.load();
+        while (!per->curComb.compare_exchange_weak(cComb, lockedComb(cComb))) { }
+        // The combiner that set it may not have advanced the copies of curComb yet
+        publishCurComb(cComb);
+        return cComb;
+    }
+
+    // Exclusive locks the replica with the same index in all the partitions of 'm', so that the stores to any of
+    // them are done with the same tl_cx_size. Returns the index.
+    static int lockCommonReplica(MultiTx& m, const int tid) {
+        for (int i = 0; ; i = (i+1) % MAX_COMBINEDS) {
+            int k = 0;
+            while (k < m.num && m.parts[k]->combs[i].rwLock.exclusiveTryLock(tid)) k++;
+            if (k == m.num) return i;
+            while (k > 0) m.parts[--k]->combs[i].rwLock.exclusiveUnlock();
+            if (i == MAX_COMBINEDS-1) std::this_thread::yield();
+        }
+    }
+
+    // Starts the State of this partition in a transaction over several partitions, and brings the replica
+    // 'newCombIndex' up to date with cComb, which can't change until the end of the transaction. Sets tlocal.copy
+    // if the replica must be flushed in full.
+    State* prepareMulti(const SeqTidIdx cComb, const int newCombIndex, const int tid) {
+        const uint64_t seqltail = sti2seq(cComb);
+        SeqTidIdx ltail = combs[sti2idx(cComb)].head.load();
+        States* newStates = &sauron[tid];
+        State* newState = &newStates->states[newStates->lastIdx];
+        startState(newState, makeSeqTidIdx(seqltail+1, (uint64_t)tid, newStates->lastIdx),
+                   &sauron[sti2tid(ltail)].states[sti2idx(ltail)]);
+        SeqTidIdx ringtail = ring[seqltail%RINGSIZE].load();
+        if (ltail != ringtail) {
+            PWB(&per->curComb);
+            //advance tail like Michael and Scott
+            countPersist(tid, 1, 0);
+            ring[seqltail%RINGSIZE].compare_exchange_strong(ringtail, ltail);
+        }
+        Combined* newComb = &combs[newCombIndex];
+        trace(tid, EV_REPLICA_ACQUIRED, newCombIndex, seqltail);
+        while (true) {
+            SeqTidIdx lastAppliedTicket = newComb->head.load();
+            if (lastAppliedTicket == makeSeqTidIdx(0, 1, 0)) {
+                if (makeCopy(newComb, tid, false)) break;
+            } else {
+                tlocal.copy = newComb->flushcopy;
+                if (apply_redologs(newComb, seqltail, lastAppliedTicket, ltail, tid, false) != nullptr) break;
+            }
+        }
+        return newState;
+    }
+
+    // Undoes the stores of a transaction over several partitions, and of the requests it applied
+    static void undoMulti(MultiTx& m) {
+        for (int k = 0; k < m.num; k++) {
+            RedoOpt* r = m.parts[k];
+            State* newState = m.states[k];
+            r->apply_undolog(newState);
+            SeqTidIdx ltail = r->combs[sti2idx(m.cCombs[k])].head.load();
+            r->startState(newState, newState->ticket.load(), &r->sauron[sti2tid(ltail)].states[sti2idx(ltail)]);
+        }
+    }
+
+    // Flushes the replicas of a transaction over several partitions and makes them the curCombs
+    void commitMulti(MultiTx& m, const int newCombIndex, const int tid) {
+        MultiCommit& mc = reinterpret_cast<PersistentHeader*>(base_addr)->multi;
+        for (int p = 0; p < MAX_PARTITIONS; p++) mc.curCombs[p] = 0;
+        for (int k = 0; k < m.num; k++) {
+            RedoOpt* r = m.parts[k];
+            PartitionScope scope {r};
+            Combined* newComb = &r->combs[newCombIndex];
+            State* newState = m.states[k];
+            tlocal.copy = m.copies[k];
+            if(!tlocal.copy){
+                newComb->clsets.merge(newState);
+            }else{
+                newComb->flushcopy = tlocal.copy;
+            }
+            if(tlocal.copy){
+                // curComb is held, the flush can't be abandoned
+                r->flushCopy(newComb->root, r->esloco.getUsedSize(), tid, false);
+                newComb->flushcopy = false;
+            }else{
+                r->countPersist(tid, newComb->clsets.numCL, 0);
+                newComb->clsets.flushDeferredPWBs();
+            }
+            newComb->clsets.reset();
+            newState->logSize.store(newState->lSize,std::memory_order_relaxed);
+            newComb->head.store(newState->ticket.load(),std::memory_order_relaxed);
+            newComb->rwLock.downgrade();
+            mc.curCombs[r->partIdx] = makeSeqTidIdx(sti2seq(m.cCombs[k])+1, (uint64_t)tid, (uint64_t)newCombIndex);
+        }
+        for (uint8_t* cl = ADDR2CL(&mc); cl < (uint8_t*)(&mc+1); cl += 64) PWB(cl);
+        PFENCE();
+        mc.pending = 1;
+        PWB(&mc.pending);
+        PFENCE();
+        // The new curCombs stay held until 'pending' is durably cleared, otherwise a restart could set them again
+        // after the next commit of one of these partitions
+        for (int k = 0; k < m.num; k++) {
+            RedoOpt* r = m.parts[k];
+            r->per->curComb.store(lockedComb(mc.curCombs[r->partIdx]));
+            PWB(&r->per->curComb);
+        }
+        PFENCE();
+        mc.pending = 0;
+        PWB(&mc.pending);
+        PSYNC();
+        countPersist(tid, 2*(sizeof(MultiCommit)/64+1)+m.num, 4);
+        for (int k = 0; k < m.num; k++) {
+            RedoOpt* r = m.parts[k];
+            const SeqTidIdx newcComb = mc.curCombs[r->partIdx];
+            const SeqTidIdx newTicket = m.states[k]->ticket.load();
+            const uint64_t seq = sti2seq(newcComb);
+            r->per->curComb.store(newcComb);
+            r->trace(tid, EV_CAS_SUCCESS, seq, newCombIndex);
+            r->publishCurComb(newcComb);
+            r->combs[sti2idx(m.cCombs[k])].rwLock.setReadUnlock();
+            SeqTidIdx oldTicket = r->ring[seq%RINGSIZE].load();
+            if(sti2seq(oldTicket) < seq) r->ring[seq%RINGSIZE].compare_exchange_strong(oldTicket, newTicket);
+            States* newStates = &r->sauron[tid];
+            newStates->lastIdx++;
+            if(newStates->lastIdx == newStates->size) newStates->lastIdx = 0;
+        }
+    }
+
+    // Gives back the replicas and the curCombs of a transaction over several partitions with nothing to commit
+    static void releaseMulti(MultiTx& m, const int newCombIndex) {
+        for (int k = m.num-1; k >= 0; k--) {
+            RedoOpt* r = m.parts[k];
+            Combined* newComb = &r->combs[newCombIndex];
+            if (m.copies[k]) newComb->flushcopy = true;
+            newComb->rwLock.exclusiveUnlock();
+            r->per->curComb.store(m.cCombs[k]);
+        }
+    }
+
+    // Switches tlocal.st and tlocal.copy to the partition of 'addr', an address in the main replica, for a store
+    // of the transaction over several partitions 'm'
+    static RedoOpt& multiOwner(MultiTx* m, const uint8_t* addr) {
+        const uint64_t p = (uint64_t)(addr - g_main_addr)/gRedo.partSize;
+        const int k = (p < PM_PARTITIONS) ? m->slot[p] : -1;
+        if (k < 0) {
+            throw PartitionError("RedoOpt: a transaction over several partitions stored in partition " +
+                                 std::to_string(p) + ", which it did not declare");
+        }
+        if (k != m->curr) {
+            m->copies[m->curr] = tlocal.copy;
+            m->curr = k;
+            tlocal.st = m->states[k];
+            tlocal.copy = m->copies[k];
+        }
+        return *m->parts[k];
+    }
+
 
     template <typename T, typename... Args> static T* tmNew(Args&&... args) {
-        RedoOpt& r = gRedo;
+        RedoOpt& r = cur();
 #ifdef USE_ESLOCO
-        void* addr = r.esloco.malloc(sizeof(T));
+        void* addr = r.heapMalloc(sizeof(T));
         assert(addr != nullptr);
 #else
         void* addr = mspace_malloc( ((uint8_t*)(r.per->ms))+tlocal.tl_cx_size, sizeof(T));
@@ -1542,7 +2726,7 @@ public:
     template<typename T> static void tmDelete(T* obj) {
         if (obj == nullptr) return;
         obj->~T();
-        RedoOpt& r = gRedo;
+        RedoOpt& r = cur();
 #ifdef USE_ESLOCO
         r.esloco.free(obj);
 #else
@@ -1563,9 +2747,9 @@ public:
 
     /* Allocator for arrays and C methods */
     static void* pmalloc(size_t size) {
-        RedoOpt& r = gRedo;
+        RedoOpt& r = cur();
 #ifdef USE_ESLOCO
-        void* addr = r.esloco.malloc(size);
+        void* addr = r.heapMalloc(size);
         assert(addr != nullptr);
 #else
         void* addr = mspace_malloc( ((uint8_t*)(r.per->ms))+tlocal.tl_cx_size , size);
@@ -1582,7 +2766,7 @@ public:
 
     /* De-allocator for arrays and C methods */
     static void pfree(void* ptr) {
-        RedoOpt& r = gRedo;
+        RedoOpt& r = cur();
 #ifdef USE_ESLOCO
         r.esloco.free(ptr);
 #else
@@ -1601,9 +2785,190 @@ public:
         }
     }
 
+    /* Gives back to the pool the empty slabs and the free blocks at the top of the heap. Call it inside an update transaction */
+    static void ptrim() {
+#ifdef USE_ESLOCO
+        cur().esloco.trim();
+#endif
+    }
+
+    /* Bytes of heap of each replica of the current partition, as persisted in its header. Only grows */
+    static uint64_t heapSize() { return cur().per->heapSize; }
+
+    // Totals of the counters of all threads, see stats()
+    struct Stats {
+        uint64_t pwbs {0};          // Cache lines flushed
+        uint64_t pfences {0};       // pfences and psyncs, including the ones done by the CAS on curComb
+        uint64_t ntBytes {0};       // Bytes copied between replicas with non-temporal stores
+        uint64_t redoEntries {0};   // Redo log entries applied to bring a replica up to date
+        uint64_t fullCopies {0};    // Replicas brought up to date with a full copy
+        uint64_t updateTxs {0};
+        uint64_t readTxs {0};
+    };
+
+    /* Sums the counters of all the threads. It can be called at any time, the result is not a snapshot */
+    static Stats stats() {
+        Stats s {};
+        for (int p = 0; p < PM_PARTITIONS; p++) {
+            for (int i = 0; i < MAX_THREADS; i++) {
+                const ThreadCounters& c = partition(p).counters[i];
+                s.pwbs += c.pwbs.load(std::memory_order_relaxed);
+                s.pfences += c.pfences.load(std::memory_order_relaxed);
+                s.ntBytes += c.ntBytes.load(std::memory_order_relaxed);
+                s.redoEntries += c.redoEntries.load(std::memory_order_relaxed);
+                s.fullCopies += c.fullCopies.load(std::memory_order_relaxed);
+                s.updateTxs += c.updateTxs.load(std::memory_order_relaxed);
+                s.readTxs += c.readTxs.load(std::memory_order_relaxed);
+            }
+        }
+        return s;
+    }
+
+    /* Breakdown of the time spent in each phase by all threads, since the start or the last resetPhases() */
+    static Profiler::Snapshot phaseSnapshot() { return gRedo.profiler.snapshot(); }
+
+    /* Same as phaseSnapshot(), as a table with one line per phase */
+    static std::string phases() { return gRedo.profiler.snapshot().toString(phaseNames()); }
+
+    static void resetPhases() { gRedo.profiler.reset(); }
+
+    /*
+     * Event tracing. Starts recording the events of all threads (previous events are dropped) until stopTrace().
+     * The events can then be exported with traceToChrome() or saveTrace(), and opened in chrome://tracing.
+     * The first call allocates the buffers of the trace, returns false if there is no memory for them.
+     */
+    static bool startTrace() {
+        gRedo.tracer.clear();
+        return gRedo.tracer.enable(true);
+    }
+
+    static void stopTrace() { gRedo.tracer.enable(false); }
+
+    /*
+     * Dedicated combiner mode. Starts 'num' service threads that do all the combining, copies of the replicas and
+     * flushing, while the application threads only announce their requests and wait for them to be applied.
+     * Combiner i is pinned to core firstCpu+i, or to the last cores of the machine if firstCpu is negative.
+     * The combiners use tids of the registry, therefore at most MAX_THREADS-num application threads can run.
+     */
+    static void startCombiners(const int num, const int firstCpu = -1) {
+        RedoOpt& r = gRedo;
+        std::lock_guard<std::mutex> lock(r.combinersMutex);
+        if (r.combinerThreads.size() > 0) return;
+        r.stopCombining.store(false);
+        for (int i = 0; i < num; i++) {
+            const int cpu = (firstCpu >= 0) ? firstCpu+i : std::max(0, r.NUM_CORES-1-i);
+            r.combinerThreads.emplace_back(&RedoOpt::combinerLoop, &r, cpu);
+        }
+        r.numCombiners.store(num);
+    }
+
+    // Stops the combiner threads. The application threads go back to doing the combining themselves.
+    static void stopCombiners() {
+        RedoOpt& r = gRedo;
+        std::lock_guard<std::mutex> lock(r.combinersMutex);
+        r.numCombiners.store(0);
+        r.stopCombining.store(true);
+        r.wakeCombiners();
+        for (auto& th : r.combinerThreads) th.join();
+        r.combinerThreads.clear();
+    }
+
+    static std::string traceToChrome() { return gRedo.tracer.toChromeTrace(eventInfos(), NUM_EVENTS); }
+
+    static bool saveTrace(const char* filename) { return gRedo.tracer.saveChromeTrace(filename, eventInfos(), NUM_EVENTS); }
+
     // Wrappers to non-static functions
-    template<typename R,class F> inline static R readTx(F&& func) { return gRedo.ns_read_transaction<R>(func); }
-    template<typename R,class F> inline static R updateTx(F&& func) { return gRedo.ns_write_transaction<R>(func); }
+    // In lease mode, the tid is leased for the duration of the transaction (see ThreadRegistry)
+    template<typename R,class F> inline static R readTx(F&& func) {
+        ThreadRegistry::Lease lease {MAX_THREADS};
+        return gRedo.ns_read_transaction<R>(func);
+    }
+    template<typename R,class F> inline static R updateTx(F&& func) {
+        ThreadRegistry::Lease lease {MAX_THREADS};
+        return gRedo.ns_write_transaction<R>(func);
+    }
+
+    /*
+     * Partitions of the heap (PM_PARTITIONS). A transaction on a partition commits independently of the other
+     * partitions, therefore the throughput of the writes scales with the number of partitions in use.
+     * The objects of a partition must be allocated and accessed only in transactions of that partition. A transaction
+     * over several partitions declares them when it starts, with the list of partitions: it holds the commits of
+     * all of them and commits on all of them at once, which is slower, and the other transactions of those
+     * partitions wait for it. Inside of it, tmNew(), tmDelete() and get_object() need a transaction of the partition
+     * of the object, nested in it.
+     * A transaction that starts a transaction (read or write) of a partition it did not declare has no effect, and
+     * its caller gets a PartitionError.
+     * gRedo (and the functions without a partition) is partition 0. The phases and the traces are those of
+     * partition 0, stats() is the sum of all partitions.
+     */
+    static int numPartitions() { return PM_PARTITIONS; }
+
+    static RedoOpt& partition(const int p) {
+        assert(p >= 0 && p < PM_PARTITIONS);
+        return p == 0 ? gRedo : *gRedo.partitions[p];
+    }
+
+    template<typename R,class F> inline static R readTx(const int p, F&& func) {
+        ThreadRegistry::Lease lease {MAX_THREADS};
+        return partition(p).ns_read_transaction<R>(func);
+    }
+    template<typename R,class F> inline static R updateTx(const int p, F&& func) {
+        ThreadRegistry::Lease lease {MAX_THREADS};
+        return partition(p).ns_write_transaction<R>(func);
+    }
+    template<typename R,class F> inline static R readTx(std::vector<int> parts, F&& func) {
+        ThreadRegistry::Lease lease {MAX_THREADS};
+        if (sortPartitions(parts) == 1) return partition(parts[0]).ns_read_transaction<R>(func);
+        return gRedo.ns_multi_transaction<R>(parts, func);
+    }
+    template<typename R,class F> inline static R updateTx(std::vector<int> parts, F&& func) {
+        ThreadRegistry::Lease lease {MAX_THREADS};
+        if (sortPartitions(parts) == 1) return partition(parts[0]).ns_write_transaction<R>(func);
+        return gRedo.ns_multi_transaction<R>(parts, func);
+    }
+
+    // Puts the partitions of a transaction in ascending order without duplicates, returns how many there are
+    static size_t sortPartitions(std::vector<int>& parts) {
+        assert(!parts.empty());
+        std::sort(parts.begin(), parts.end());
+        parts.erase(std::unique(parts.begin(), parts.end()), parts.end());
+        assert(parts.front() >= 0 && parts.back() < PM_PARTITIONS);
+        return parts.size();
+    }
+
+    // Instance whose write-set logs the stores to 'addr', an address in the main replica. In a transaction over
+    // several partitions it's the partition of the address.
+    static inline RedoOpt& logOwner(const uint8_t* addr) {
+        if (tlocal.multi == nullptr) return cur();
+        return multiOwner(static_cast<MultiTx*>(tlocal.multi), addr);
+    }
+
+    /*
+     * Snapshots of partition 0. A snapshot pins the replica that has the last committed state, the transactions
+     * executed with snapshotReadTx() see that state regardless of the commits done after pinSnapshot().
+     * While it is pinned the replica can't be used by the combiners, so snapshots should not be kept for long.
+     * pinSnapshot() returns -1 when no more replicas can be pinned.
+     */
+    static int pinSnapshot() {
+        ThreadRegistry::Lease lease {MAX_THREADS};
+        return gRedo.ns_pin_snapshot();
+    }
+    static void unpinSnapshot(const int snap) { gRedo.ns_unpin_snapshot(snap); }
+    template<typename R,class F> inline static R snapshotReadTx(const int snap, F&& func) {
+        return gRedo.ns_snapshot_read_transaction<R>(snap, func);
+    }
+
+    /*
+     * Pins of partition 0 by the calling thread, for the values read by reference. pinReplica() pins the replica
+     * that has the last committed state in the thread's own reader slot, pinnedReadTx() executes a transaction on
+     * it, and each successful pinReplica() must be followed by an unpinReplica() on the same thread.
+     * pinReplica() returns false when the replica can't be pinned.
+     */
+    static bool pinReplica() { return gRedo.ns_pin_replica(); }
+    static void unpinReplica() { gRedo.ns_unpin_replica(); }
+    template<typename R,class F> inline static R pinnedReadTx(F&& func) {
+        return gRedo.ns_pinned_read_transaction<R>(func);
+    }
 };
 
 //
@@ -1620,25 +2985,59 @@ template<typename T> static void put_object(int idx, T* obj) { RedoOpt::put_obje
 
 
 template<typename T> inline void persist<T>::pstore(T newVal) {
+    static_assert(sizeof(T) <= 64, "persist<T> is limited to types up to one cache line");
+    static_assert(sizeof(T) <= sizeof(uint64_t) || std::is_trivially_copyable<T>::value,
+                  "persist<T> of multiple words requires a trivially copyable type");
     uint8_t* valaddr = (uint8_t*)&val;
     const uint64_t offset = tlocal.tl_cx_size;
-    bool copy = tlocal.copy;
     bool sameAddr = false;
+    uint8_t* addr;    // Address in the main region, used in the log
+    uint8_t* raddr;   // Address in the replica we're modifying
     if (offset != 0 && ADDR_IS_IN_MAIN(valaddr)) {
-        uint64_t oldval = (uint64_t)*reinterpret_cast<T*>( valaddr + offset );
-        if (oldval != (uint64_t)newVal) {
-            sameAddr = !gRedo.addAddrIfAbsent(valaddr, oldval, (uint64_t)newVal);
-            *reinterpret_cast<T*>( valaddr + offset ) = newVal;
-        }
-        if (!copy && !sameAddr) gRedo.addIfAbsent(valaddr);
+        addr = valaddr;
+        raddr = valaddr + offset;
     } else if (ADDR_IS_IN_REGION(valaddr)) {
-        if ((uint64_t)val != (uint64_t)newVal){
-            sameAddr = !gRedo.addAddrIfAbsent(valaddr - offset, (uint64_t)val, (uint64_t)newVal);
-            val = newVal;
-        }
-        if (!copy && !sameAddr) gRedo.addIfAbsent(valaddr - offset);
+        addr = valaddr - offset;
+        raddr = valaddr;
     } else {
         val = newVal;
+        return;
+    }
+    RedoOpt& r = RedoOpt::logOwner(addr);
+    bool copy = tlocal.copy;
+    uint8_t* waddr = (uint8_t*)((size_t)addr & (~7ULL));
+    if (sizeof(T) <= sizeof(uint64_t) && addr + sizeof(T) <= waddr + sizeof(uint64_t)) {
+        // Log the whole word that contains the value, so that replaying doesn't modify adjacent bytes
+        // We use memcpy() because the word and T may not alias
+        uint8_t* rword = raddr - (addr - waddr);
+        uint64_t oldval, newval;
+        std::memcpy(&oldval, rword, sizeof(uint64_t));
+        std::memcpy(raddr, &newVal, sizeof(T));
+        std::memcpy(&newval, rword, sizeof(uint64_t));
+        if (oldval != newval) sameAddr = !r.addAddrIfAbsent(waddr, oldval, newval);
+        if (!copy && !sameAddr) r.addIfAbsent(waddr);
+        return;
+    }
+    // Multi-word value (or one that crosses a word boundary), logged as a single range entry
+    if (std::memcmp(raddr, &newVal, sizeof(T)) != 0) {
+        if (!r.addRange(addr, raddr, &newVal, sizeof(T))) {
+            // The range log is full, fallback to logging each word
+            uint8_t* lastw = (uint8_t*)((size_t)(addr + sizeof(T) - 1) & (~7ULL));
+            uint64_t oldwords[10];
+            std::memcpy(oldwords, raddr - (addr - waddr), lastw - waddr + sizeof(uint64_t));
+            std::memcpy(raddr, &newVal, sizeof(T));
+            for (uint8_t* w = waddr; w <= lastw; w += sizeof(uint64_t)) {
+                uint64_t newval;
+                std::memcpy(&newval, raddr + (w - addr), sizeof(uint64_t));
+                r.addAddrIfAbsent(w, oldwords[(w - waddr)/sizeof(uint64_t)], newval);
+            }
+        } else {
+            std::memcpy(raddr, &newVal, sizeof(T));
+        }
+    }
+    if (!copy) {
+        r.addIfAbsent(addr);
+        if (ADDR2CL(addr) != ADDR2CL(addr + sizeof(T) - 1)) r.addIfAbsent(addr + sizeof(T) - 1);
     }
 }
 }